@@ -0,0 +1,189 @@
+#include "include/channel.h"
+#include "include/fiber_sync.h"
+#include "include/scheduler.h"
+#include "include/log.h"
+#include "include/macro.h"
+
+namespace captain {
+
+//多个分支同时可以完成时从不同的位置开始尝试，不会总是偏向第一个
+static thread_local uint32_t t_select_start = 0;
+
+void ChannelBase::close() {
+    m_closed = true;
+    notifyAll();
+}
+
+void ChannelBase::enqueue(int dir, ChannelWaiter* waiter) {
+    MutexType::Lock lock(m_mutex);
+    waiter->prev = m_tail[dir];
+    waiter->next = nullptr;
+    if(m_tail[dir]) {
+        m_tail[dir]->next = waiter;
+    } else {
+        m_head[dir] = waiter;
+    }
+    m_tail[dir] = waiter;
+    waiter->linked = true;
+    ++m_waiting[dir];
+}
+
+void ChannelBase::dequeue(int dir, ChannelWaiter* waiter) {
+    MutexType::Lock lock(m_mutex);
+    if(!waiter->linked) {
+        return;
+    }
+    if(waiter->prev) {
+        waiter->prev->next = waiter->next;
+    } else {
+        m_head[dir] = waiter->next;
+    }
+    if(waiter->next) {
+        waiter->next->prev = waiter->prev;
+    } else {
+        m_tail[dir] = waiter->prev;
+    }
+    waiter->prev = waiter->next = nullptr;
+    waiter->linked = false;
+    --m_waiting[dir];
+}
+
+void ChannelBase::notify(int dir) {
+    //和Select()中登记之后的重试配对：收发成功之后才看等待数，登记之后才重试，两边至少有一方看到对方
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_waiting[dir].load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    Scheduler* scheduler = nullptr;
+    Fiber::ptr fiber;
+    {
+        MutexType::Lock lock(m_mutex);
+        while(ChannelWaiter* waiter = m_head[dir]) {
+            m_head[dir] = waiter->next;
+            if(m_head[dir]) {
+                m_head[dir]->prev = nullptr;
+            } else {
+                m_tail[dir] = nullptr;
+            }
+            waiter->prev = waiter->next = nullptr;
+            waiter->linked = false;
+            --m_waiting[dir];
+            //select在别的通道上已经被唤醒了，跳过
+            ChannelWaitState* state = waiter->state;
+            if(state->fired.exchange(true)) {
+                continue;
+            }
+            //节点在等待协程的栈上，调度之后随时可能失效，先把需要的东西取出来
+            state->firedBy = this;
+            state->firedDir = dir;
+            scheduler = state->scheduler;
+            fiber.swap(state->fiber);
+            break;
+        }
+    }
+    if(fiber) {
+        scheduler->schedule(&fiber);
+        --scheduler->m_suspendedCount;
+    }
+}
+
+void ChannelBase::notifyAll() {
+    std::vector<std::pair<Scheduler*, Fiber::ptr> > woken;
+    {
+        MutexType::Lock lock(m_mutex);
+        for(int dir = 0; dir < 2; ++dir) {
+            while(ChannelWaiter* waiter = m_head[dir]) {
+                m_head[dir] = waiter->next;
+                waiter->prev = waiter->next = nullptr;
+                waiter->linked = false;
+                --m_waiting[dir];
+                ChannelWaitState* state = waiter->state;
+                if(state->fired.exchange(true)) {
+                    continue;
+                }
+                state->firedBy = this;
+                state->firedDir = dir;
+                woken.push_back(std::make_pair(state->scheduler, Fiber::ptr()));
+                woken.back().second.swap(state->fiber);
+            }
+            m_tail[dir] = nullptr;
+        }
+    }
+    for(auto& i : woken) {
+        i.first->schedule(&i.second);
+        --i.first->m_suspendedCount;
+    }
+}
+
+int ChannelBase::Select(Case* cases, size_t count, bool block) {
+    if(count == 0) {
+        return -1;
+    }
+    size_t start = count > 1 ? t_select_start++ % count : 0;
+    ChannelBase* hint = nullptr;
+    int hint_dir = 0;
+    int done = -1;
+    while(true) {
+        for(size_t n = 0; n < count; ++n) {
+            size_t i = (start + n) % count;
+            if(cases[i].channel->tryOp(cases[i].dir, cases[i].value, cases[i].ok)) {
+                done = i;
+                break;
+            }
+        }
+        if(done != -1 || !block) {
+            break;
+        }
+
+        ChannelWaitState state;
+        state.scheduler = Scheduler::GetThis();
+        CAPTAIN_ASSERT2(state.scheduler, "channel wait outside a scheduler");
+        state.fiber = Fiber::GetThis();
+        CAPTAIN_ASSERT2(state.fiber.get() != Scheduler::GetMainFiber()
+                , "channel wait in the scheduler main fiber");
+
+        ChannelWaiter inline_nodes[4];
+        std::vector<ChannelWaiter> heap_nodes;
+        ChannelWaiter* nodes = inline_nodes;
+        if(count > 4) {
+            heap_nodes.resize(count);
+            nodes = &heap_nodes[0];
+        }
+        ++state.scheduler->m_suspendedCount;
+        for(size_t i = 0; i < count; ++i) {
+            nodes[i].state = &state;
+            cases[i].channel->enqueue(cases[i].dir, &nodes[i]);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        //登记之后再试一次，登记之前完成的收发看不到我们，不会来唤醒
+        for(size_t n = 0; n < count; ++n) {
+            size_t i = (start + n) % count;
+            if(cases[i].channel->tryOp(cases[i].dir, cases[i].value, cases[i].ok)) {
+                done = i;
+                break;
+            }
+        }
+        //重试成功时抢在唤醒者之前把fired置上就不用挂起，抢不到说明已经有人要调度我们了，必须等它
+        if(done == -1 || state.fired.exchange(true)) {
+            FiberWaiter::Suspend();
+        } else {
+            --state.scheduler->m_suspendedCount;
+        }
+        for(size_t i = 0; i < count; ++i) {
+            cases[i].channel->dequeue(cases[i].dir, &nodes[i]);
+        }
+        hint = state.firedBy;
+        hint_dir = state.firedDir;
+        if(done != -1) {
+            break;
+        }
+    }
+    //被某个通道唤醒却完成了别的分支，把这次唤醒转给那个通道上的其他等待者
+    if(hint && done != -1
+            && (cases[done].channel != hint || cases[done].dir != hint_dir)) {
+        hint->notify(hint_dir);
+    }
+    return done;
+}
+
+}
@@ -6,6 +6,8 @@
 
 namespace captain {
 
+static std::atomic<uint64_t> s_fd_generation {0};
+
 FdCtx::FdCtx(int fd)
     :m_isInit(false)
     ,m_isSocket(false)
@@ -13,6 +15,7 @@ FdCtx::FdCtx(int fd)
     ,m_userNonblock(false)
     ,m_isClosed(false)
     ,m_fd(fd)
+    ,m_generation(++s_fd_generation)
     ,m_recvTimeout(-1)
     ,m_sendTimeout(-1) {
     init();
@@ -86,6 +89,9 @@ FdCtx::ptr FdManager::get(int fd, bool auto_create) {
     lock.unlock();
 
     RWMutexType::WriteLock lock2(m_mutex);
+    if(fd >= (int)m_datas.size()) {
+        m_datas.resize(fd * 1.5);
+    }
     FdCtx::ptr ctx(new FdCtx(fd));
     m_datas[fd] = ctx;
     return ctx;
@@ -99,4 +105,12 @@ void FdManager::del(int fd) {
     m_datas[fd].reset();
 }
 
+uint64_t FdManager::getGeneration(int fd) {
+    RWMutexType::ReadLock lock(m_mutex);
+    if((int)m_datas.size() <= fd || !m_datas[fd]) {
+        return 0;
+    }
+    return m_datas[fd]->getGeneration();
+}
+
 }
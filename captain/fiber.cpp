@@ -4,6 +4,11 @@
 #include "include/log.h"
 #include "include/scheduler.h"
 #include <atomic>
+#include <deque>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 namespace captain{
 
@@ -12,6 +17,10 @@ static Logger::ptr g_logger = CAPTAIN_LOG_NAME("system");
 static std::atomic<uint64_t> s_fiber_id {0};
 static std::atomic<uint64_t> s_fiber_count {0};
 
+//协程局部存储每个槽位的释放函数，槽位只增不减
+static void (*s_local_deleters[Fiber::MAX_LOCAL_SLOTS])(void*);
+static std::atomic<size_t> s_local_slots {0};
+
 //线程的主协程  当前协程
 static thread_local Fiber* t_fiber = nullptr;
 //main/master/主 协程
@@ -20,19 +29,167 @@ static thread_local Fiber::ptr t_threadFiber = nullptr;
 static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
     Config::Lookup<uint32_t>("fiber.stack_size", 1024 * 1024, "fiber stack size");
 
-//测试内存分配的效率
-class MallocStackAllocator {
+//每个线程缓存的空闲栈个数上限
+static ConfigVar<uint32_t>::ptr g_fiber_stack_cache_size =
+    Config::Lookup<uint32_t>("fiber.stack_cache_size", 64, "fiber stack cache size per thread");
+//每个线程缓存的结束了的协程对象个数上限，0表示不复用
+static ConfigVar<uint32_t>::ptr g_fiber_free_list_size =
+    Config::Lookup<uint32_t>("fiber.free_list_size", 64, "fiber free list size per thread");
+//缓存的栈空闲超过这个时间就把物理内存还给系统，0表示不归还
+static ConfigVar<uint32_t>::ptr g_fiber_stack_idle_ms =
+    Config::Lookup<uint32_t>("fiber.stack_idle_ms", 1000, "fiber stack idle ms before release memory");
+
+static size_t GetPageSize() {
+    static size_t s_page_size = sysconf(_SC_PAGESIZE);
+    return s_page_size;
+}
+
+static size_t RoundUpToPage(size_t size) {
+    size_t page = GetPageSize();
+    return (size + page - 1) / page * page;
+}
+
+/* mmap分配协程栈
+1、栈的最低地址处留一个PROT_NONE的保护页，栈溢出直接SIGSEGV，不会悄悄写坏堆
+2、释放的栈放进当前线程的缓存，下次分配直接复用，不再走mmap/munmap
+3、缓存里空闲太久的栈用MADV_DONTNEED归还物理内存，地址空间保留，RSS跟着实际用量走
+ */
+class MmapStackAllocator {
 public:
-    static void* Alloc(size_t size) {
-        return malloc(size);
+    static void* Alloc(size_t size);
+    static void Dealloc(void* vp, size_t size);
+    static void Trim();
+};
+
+namespace {
+
+struct CachedStack {
+    char* base;    //包括保护页的起始地址
+    size_t size;   //可用部分的大小，不含保护页
+    uint64_t time; //放进缓存的时间
+};
+
+//按放进来的时间排序，复用时从尾部取最热的，归还内存时从头部开始
+//结束了的协程也放在这里，线程退出时先析构它们，它们的栈再回到stacks里一起释放
+struct StackCache {
+    ~StackCache() {
+        fibers.clear();
+        for(auto& i : stacks) {
+            munmap(i.base, i.size + GetPageSize());
+        }
+    }
+
+    std::deque<CachedStack> stacks;
+    //[0, purged)已经归还了物理内存
+    size_t purged = 0;
+    //结束了的协程，连同它的栈一起复用
+    std::vector<Fiber::ptr> fibers;
+};
+
+}
+
+static thread_local StackCache t_stack_cache;
+
+void* MmapStackAllocator::Alloc(size_t size) {
+    size = RoundUpToPage(size);
+    StackCache& cache = t_stack_cache;
+    if(!cache.stacks.empty() && cache.stacks.back().size == size) {
+        char* base = cache.stacks.back().base;
+        cache.stacks.pop_back();
+        if(cache.purged > cache.stacks.size()) {
+            cache.purged = cache.stacks.size();
+        }
+        return base + GetPageSize();
+    }
+
+    size_t page = GetPageSize();
+    void* base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE
+                    , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base == MAP_FAILED) {
+        CAPTAIN_ASSERT2(false, std::string("mmap fiber stack: ") + strerror(errno));
+    }
+    if(mprotect(base, page, PROT_NONE)) {
+        CAPTAIN_ASSERT2(false, std::string("mprotect guard page: ") + strerror(errno));
+    }
+    return (char*)base + page;
+}
+
+void MmapStackAllocator::Dealloc(void* vp, size_t size) {
+    size = RoundUpToPage(size);
+    size_t page = GetPageSize();
+    char* base = (char*)vp - page;
+    StackCache& cache = t_stack_cache;
+    size_t limit = g_fiber_stack_cache_size->getValue();
+    if(limit == 0) {
+        munmap(base, size + page);
+        return;
+    }
+    //缓存满了，淘汰最久没用的
+    while(cache.stacks.size() >= limit) {
+        CachedStack& front = cache.stacks.front();
+        munmap(front.base, front.size + page);
+        cache.stacks.pop_front();
+        if(cache.purged) {
+            --cache.purged;
+        }
+    }
+    cache.stacks.push_back(CachedStack{base, size, GetCurrentMS()});
+    Trim();
+}
+
+void MmapStackAllocator::Trim() {
+    StackCache& cache = t_stack_cache;
+    uint32_t idle = g_fiber_stack_idle_ms->getValue();
+    if(idle == 0 || cache.purged >= cache.stacks.size()) {
+        return;
+    }
+    uint64_t now = GetCurrentMS();
+    size_t page = GetPageSize();
+    while(cache.purged < cache.stacks.size()) {
+        CachedStack& i = cache.stacks[cache.purged];
+        if(now - i.time < idle) {
+            break;
+        }
+        madvise(i.base + page, i.size, MADV_DONTNEED);
+        ++cache.purged;
     }
+}
 
-    static void Dealloc(void* vp, size_t size) {
-        return free(vp);
+using StackAllocator = MmapStackAllocator;
+
+//共享栈的大小，只有用到的页才占物理内存
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size =
+    Config::Lookup<uint32_t>("fiber.shared_stack_size", 8 * 1024 * 1024, "fiber shared stack size");
+
+/* 线程共享的栈
+共享栈模式的协程都在所在线程的这块栈上执行。协程切出之后把[sp, 栈顶)拷贝到自己的缓冲区，
+切入时拷贝回原来的地址，栈上的指针仍然有效，所以协程只能在同一个线程上恢复。
+owner是栈上现在放着的内容属于哪个协程，一样的话切入时不用拷贝
+ */
+struct SharedStack {
+    SharedStack(size_t s)
+        :size(RoundUpToPage(s)) {
+        size_t page = GetPageSize();
+        void* base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE
+                        , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(base == MAP_FAILED) {
+            CAPTAIN_ASSERT2(false, std::string("mmap shared stack: ") + strerror(errno));
+        }
+        mprotect(base, page, PROT_NONE);
+        stack = (char*)base + page;
     }
+
+    ~SharedStack() {
+        munmap(stack - GetPageSize(), size + GetPageSize());
+    }
+
+    char* stack;
+    size_t size;
+    Fiber* owner = nullptr;
+    std::atomic<size_t> fibers = {0};
 };
-//赋值
-using StackAllocator = MallocStackAllocator;
+
+static thread_local std::shared_ptr<SharedStack> t_shared_stack;
 
 //获取当前正在执行的协程的唯一标识符（ID）
 uint64_t Fiber::GetFiberId() {
@@ -47,10 +204,7 @@ Fiber::Fiber() {
     //CAPTAIN_LOG_DEBUG(g_logger) << "====Fiber::Fiber()无参====";
     m_state = EXEC;
     SetThis(this);
-
-    if(getcontext(&m_ctx)) {
-        CAPTAIN_ASSERT2(false, "getcontext");
-    }
+    //主协程使用线程自己的栈，上下文在第一次切出时保存
     //总协程+1
     ++s_fiber_count;
 
@@ -58,39 +212,23 @@ Fiber::Fiber() {
 }
 
 //有回调函数的这个真正开启了新的协程，需要分配栈空间
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
+Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller, bool shared_stack)
     :m_id(++s_fiber_id)
     ,m_cb(cb) {
     //CAPTAIN_LOG_DEBUG(g_logger) << "====Fiber::Fiber有参====" ;
     ++s_fiber_count;
+#ifdef CAPTAIN_FIBER_USE_ASM
+    //共享栈在第一次切入时才知道是哪个线程的，上下文到那时再准备
+    if(shared_stack && !use_caller) {
+        m_useSharedStack = true;
+        CAPTAIN_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id << " shared_stack";
+        return;
+    }
+#endif
     //m_stacksize 初始化为传入的 stacksize，如果 stacksize 为0，则使用全局配置 g_fiber_stack_size 的值作为栈大小。
     m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
-    //栈生成 使用 StackAllocator 类分配 m_stacksize 大小的栈内存
-    m_stack = StackAllocator::Alloc(m_stacksize);
-    //调用 getcontext 函数获取当前上下文，并将其保存在 m_ctx 成员变量中。
-    if(getcontext(&m_ctx)) {
-        CAPTAIN_ASSERT2(false, "getcontext");
-    }
-/*
-上下文包含了当前线程（或协程）的寄存器状态，栈信息等，可以理解为保存了当前线程执行的上下文状态，
-包括当前函数调用的返回地址和栈指针等。通过 getcontext 获取当前协程的上下文信息后，
-可以在之后需要切换到该协程执行时，通过 setcontext 或 swapcontext 将保存的上下文恢复，
-从而实现协程的切换和调度。在协程的切换和恢复过程中，保存和恢复的上下文信息是关键，
-它决定了协程从何处继续执行和在何处暂停。 
- */
-
-    //设置协程上下文 m_ctx 的 uc_link 指向为 nullptr，表示当协程执行完毕时不返回到任何上下文
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
-    //使用 makecontext 函数为协程上下文设置执行函数。如果 use_caller 为 false，
-    //则设置执行函数为 Fiber::MainFunc，否则设置为 Fiber::CallerMainFunc。
-    if(!use_caller) {
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
-    } else {
-        makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
-    }
+    //栈和上下文在第一次切入时才准备，排队中的协程不占用栈
+    m_useCaller = use_caller;
 
     CAPTAIN_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id;
 }
@@ -98,14 +236,25 @@ Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
 //Fiber::~Fiber() 用于释放协程对象的资源，包括栈内存的回收，并在必要时进行协程切换，确保不会析构当前正在执行的协程对象。
 Fiber::~Fiber() {
     --s_fiber_count;
-    if(m_stack) { //如果协程对象有分配栈内存（m_stack 不为 nullptr）
+    clearLocals();
+    if(m_useSharedStack) {
+        CAPTAIN_ASSERT(m_state == TERM
+                || m_state == EXCEPT
+                || m_state == INIT);
+        if(m_sharedStack) {
+            --m_sharedStack->fibers;
+        }
+        free(m_saved);
+    } else if(m_stacksize) { //有自己的栈的协程，没有执行过的还没有分配栈
         //协程必须在终止状态或异常状态下才能被析构。
         CAPTAIN_ASSERT(m_state == TERM
                 || m_state == EXCEPT
                 || m_state == INIT);
         //回收栈 回收之前分配的协程栈内存。
-        StackAllocator::Dealloc(m_stack, m_stacksize);
-    } else { //如果协程对象没有分配栈内存（m_stack 为 nullptr）
+        if(m_stack) {
+            StackAllocator::Dealloc(m_stack, m_stacksize);
+        }
+    } else { //线程的主协程，使用线程自己的栈
         CAPTAIN_ASSERT(!m_cb);//断言当前协程没有关联的回调函数。因为没有分配栈内存，这意味着这个协程没有执行过任务。
         CAPTAIN_ASSERT(m_state == EXEC);//断言当前协程状态为执行状态（EXEC），这表示当前协程正在运行中。
 
@@ -124,41 +273,102 @@ Fiber::~Fiber() {
 //重置协程函数，并重置状态
 //INIT，TERM
 void Fiber::reset(std::function<void()> cb) {
-    //通过断言确保协程的栈已经分配（m_stack 不为空），并且协程的状态为 INIT、TERM 或 EXCEPT，这些状态表明协程处于可重置的状态。
-    CAPTAIN_ASSERT(m_stack);
+    //通过断言确保不是线程的主协程，并且协程的状态为 INIT、TERM 或 EXCEPT，这些状态表明协程处于可重置的状态。
+    CAPTAIN_ASSERT(m_stacksize || m_useSharedStack);
     CAPTAIN_ASSERT(m_state == TERM
             || m_state == EXCEPT
             || m_state == INIT);
     m_cb = cb; //将传入的新执行函数 cb 设置为协程的回调函数 m_cb。
-    if(getcontext(&m_ctx)) { //获取当前协程的上下文
-        CAPTAIN_ASSERT2(false, "getcontext");
-    }
-    //设置协程的上下文（context）中的堆栈信息，将之前分配的堆栈
-    //（m_stack）和堆栈大小（m_stacksize）赋给上下文的相应字段。
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-    //使用 makecontext 函数将协程的回调函数 Fiber::MainFunc 设置为协程的执行函数。
-    //makecontext 它用于为协程上下文设置一个新的执行函数。
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    m_profile = nullptr;
+    m_tag = nullptr;
+    //上一个任务的优先级和截止时间不能带给新任务，否则schedule()时会沿用过期的截止时间
+    m_priority = Scheduler::NORMAL;
+    m_deadline = 0;
+    m_skipped = -1;
+    clearLocals();
+    if(m_useSharedStack) {
+        //上下文在下次切入时在共享栈上准备
+        m_savedSize = 0;
+        m_state = INIT;
+        return;
+    }
+    //执行函数为 Fiber::MainFunc，上下文在下次切入时在原来的栈上重新准备
+    m_useCaller = false;
     m_state = INIT; //表示协程已经重置为初始状态，可以再次执行。
 }
 
+void Fiber::allocStack() {
+    //栈生成 使用 StackAllocator 类分配 m_stacksize 大小的栈内存
+    m_stack = StackAllocator::Alloc(m_stacksize);
+}
+
+void Fiber::prepareStack() {
+    if(!m_profile && StackProfile::IsEnabled()) {
+        m_profile = StackProfile::Default();
+    }
+    if(m_profile) {
+        StackProfile::Paint(m_stack, m_stacksize);
+    }
+    //在分配的栈上准备上下文，如果 use_caller 为 false，
+    //则设置执行函数为 Fiber::MainFunc，否则设置为 Fiber::CallerMainFunc。
+    if(!m_useCaller) {
+        MakeFiberContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc);
+    } else {
+        MakeFiberContext(&m_ctx, m_stack, m_stacksize, &Fiber::CallerMainFunc);
+    }
+}
+
+Fiber::ptr Fiber::Create(std::function<void()> cb) {
+    std::vector<Fiber::ptr>& fibers = t_stack_cache.fibers;
+    if(!fibers.empty()) {
+        Fiber::ptr fiber;
+        fiber.swap(fibers.back());
+        fibers.pop_back();
+        fiber->reset(std::move(cb));
+        return fiber;
+    }
+    return Fiber::ptr(new Fiber(std::move(cb)));
+}
+
+void Fiber::Recycle(Fiber::ptr& fiber) {
+    //还有别人持有的、栈大小不是默认值的、共享栈的协程不复用
+    if(fiber.use_count() != 1
+            || (fiber->m_state != TERM && fiber->m_state != EXCEPT)
+            || fiber->m_useSharedStack
+            || fiber->m_stacksize != g_fiber_stack_size->getValue()) {
+        fiber.reset();
+        return;
+    }
+    std::vector<Fiber::ptr>& fibers = t_stack_cache.fibers;
+    if(fibers.size() >= g_fiber_free_list_size->getValue()) {
+        fiber.reset();
+        return;
+    }
+    //回调函数里捕获的对象和协程局部存储现在就释放，不要等到下次复用
+    fiber->m_cb = nullptr;
+    fiber->m_priority = Scheduler::NORMAL;
+    fiber->m_deadline = 0;
+    fiber->clearLocals();
+    fibers.push_back(std::move(fiber));
+}
+
 // 强行把当前协程切换为目标执行协程
 void Fiber::call() {
     SetThis(this);
+    if(!m_stack) {
+        allocStack();
+    }
+    if(m_state == INIT) {
+        prepareStack();
+    }
     m_state = EXEC;
     CAPTAIN_LOG_ERROR(g_logger) << getId();
-    if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
-        CAPTAIN_ASSERT2(false, "swapcontext");
-    }
+    SwapFiberContext(&t_threadFiber->m_ctx, &m_ctx);
 }
 
 void Fiber::back() {
     SetThis(t_threadFiber.get());
-    if(swapcontext(&m_ctx, &t_threadFiber->m_ctx)) {
-        CAPTAIN_ASSERT2(false, "swapcontext");
-    }
+    SwapFiberContext(&m_ctx, &t_threadFiber->m_ctx);
 }
 
 //切换到当前协程执行 将控制权从调用者切换到当前协程，并将协程的状态设置为 EXEC，表示该协程正在执行。
@@ -166,23 +376,78 @@ void Fiber::back() {
 void Fiber::swapIn() {
     SetThis(this);//将当前协程（this 指针所指向的协程对象）设置为线程局部存储中的当前协程。
     CAPTAIN_ASSERT(m_state != EXEC); //确保当前协程不处于执行状态，避免重复切换。
+    if(m_useSharedStack) {
+        loadSharedStack();
+    } else {
+        if(!m_stack) {
+            allocStack();
+        }
+        if(m_state == INIT) {
+            prepareStack();
+        }
+    }
     m_state = EXEC; //将当前协程的状态设置为执行状态（EXEC）。
-    //swapcontext 函数的作用是实现上下文之间的切换，将执行流程从主协程切换到当前协程，同时保存主协程的上下文，以便后续切换回主协程时恢复执行。
-    if(swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx)) {
-    //if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
-        CAPTAIN_ASSERT2(false, "swapcontext");
+    //将执行流程从主协程切换到当前协程，同时保存主协程的上下文，以便后续切换回主协程时恢复执行。
+    SwapFiberContext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx);
+    //协程已经切出，共享栈上的内容可以拷贝了
+    if(m_useSharedStack) {
+        saveSharedStack();
+    } else if(m_profile && (m_state == TERM || m_state == EXCEPT)) {
+        //协程结束了，记录栈用量的最高水位
+        m_profile->record(StackProfile::Measure(m_stack, m_stacksize));
+        m_profile = nullptr;
     }
 }
 
+void Fiber::loadSharedStack() {
+#ifdef CAPTAIN_FIBER_USE_ASM
+    if(m_thread == -1) {
+        m_thread = GetThreadId();
+    }
+    CAPTAIN_ASSERT2(m_thread == GetThreadId(), "shared stack fiber id=" + std::to_string(m_id)
+            + " resumed on another thread");
+    if(!m_sharedStack) {
+        if(!t_shared_stack) {
+            t_shared_stack.reset(new SharedStack(g_fiber_shared_stack_size->getValue()));
+        }
+        m_sharedStack = t_shared_stack;
+        ++m_sharedStack->fibers;
+    }
+    SharedStack& shared = *m_sharedStack;
+    if(m_state == INIT) {
+        MakeFiberContext(&m_ctx, shared.stack, shared.size, &Fiber::MainFunc);
+    } else if(shared.owner != this) {
+        memcpy(m_ctx.sp, m_saved, m_savedSize);
+    }
+    shared.owner = this;
+#endif
+}
+
+void Fiber::saveSharedStack() {
+#ifdef CAPTAIN_FIBER_USE_ASM
+    //已经结束的协程不会再恢复
+    if(m_state == TERM || m_state == EXCEPT) {
+        m_savedSize = 0;
+        return;
+    }
+    SharedStack& shared = *m_sharedStack;
+    size_t size = shared.stack + shared.size - (char*)m_ctx.sp;
+    if(size > m_savedCapacity) {
+        m_saved = (char*)realloc(m_saved, size);
+        CAPTAIN_ASSERT(m_saved);
+        m_savedCapacity = size;
+    }
+    memcpy(m_saved, m_ctx.sp, size);
+    m_savedSize = size;
+#endif
+}
+
 //切换到后台执行
 //swapOut 从【当前协程】切换到【线程的主协程】
 void Fiber::swapOut() {
     SetThis(Scheduler::GetMainFiber());
     //当前协程的上下文（保存在 m_ctx）切换回主协程的上下文（保存在 Scheduler::GetMainFiber()->m_ctx）
-    if(swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)) {
-    //if(swapcontext(&m_ctx, &t_threadFiber->m_ctx)) {
-        CAPTAIN_ASSERT2(false, "swapcontext");
-    }
+    SwapFiberContext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx);
     //CAPTAIN_LOG_DEBUG(g_logger) << "====swapOut()====";
 }
 
@@ -207,6 +472,56 @@ void Fiber::SetThis(Fiber* f) {
     t_fiber = f;
 }
 
+Fiber* Fiber::PeekThis() {
+    return t_fiber;
+}
+
+Fiber* Fiber::GetCurrent() {
+    if(t_fiber) {
+        return t_fiber;
+    }
+    return GetThis().get();
+}
+
+size_t Fiber::AllocLocalSlot(void (*deleter)(void*)) {
+    size_t slot = s_local_slots++;
+    CAPTAIN_ASSERT2(slot < MAX_LOCAL_SLOTS, "too many FiberLocal slots");
+    s_local_deleters[slot] = deleter;
+    return slot;
+}
+
+void Fiber::SetLocal(size_t slot, void* value) {
+    Fiber* cur = GetCurrent();
+    if(slot >= cur->m_locals.size()) {
+        if(!value) {
+            return;
+        }
+        cur->m_locals.resize(slot + 1);
+    }
+    void* old = cur->m_locals[slot];
+    cur->m_locals[slot] = value;
+    if(old && old != value) {
+        s_local_deleters[slot](old);
+    }
+}
+
+void Fiber::clearLocals() {
+    //值的析构函数里可能又设置了别的槽位，直到一遍下来没有值为止。clear保留容量，复用时不用重新分配
+    bool found = true;
+    while(found) {
+        found = false;
+        for(size_t i = 0; i < m_locals.size(); ++i) {
+            void* v = m_locals[i];
+            if(v) {
+                m_locals[i] = nullptr;
+                s_local_deleters[i](v);
+                found = true;
+            }
+        }
+    }
+    m_locals.clear();
+}
+
 //返回当前协程，如果该线程没有协程，GetThis()会初始化一个主协程
 Fiber::ptr Fiber::GetThis() {
     /* 
@@ -232,9 +547,10 @@ void Fiber::YieldToReady() {
 }
 
 //协程切换到后台，并且设置为Hold状态
+//状态保持EXEC切回调度器，由run()在上下文保存完之后改成HOLD。
+//提前改成HOLD的话，IO事件可能在切出之前就触发，别的线程会恢复一个还没保存好的上下文
 void Fiber::YieldToHold() {
     Fiber::ptr cur = GetThis();
-    cur->m_state = HOLD;
     cur->swapOut();
 }
 
@@ -243,6 +559,20 @@ uint64_t Fiber::TotalFibers() {
     return s_fiber_count;
 }
 
+//归还当前线程缓存里空闲太久的栈的物理内存
+void Fiber::TrimStackCache() {
+    StackAllocator::Trim();
+}
+
+//当前线程缓存的空闲栈个数
+size_t Fiber::CachedStacks() {
+    return t_stack_cache.stacks.size();
+}
+
+size_t Fiber::SharedStackFibers() {
+    return t_shared_stack ? (size_t)t_shared_stack->fibers : 0;
+}
+
 //协程的执行函数，该函数被设置为协程上下文的入口点。它负责执行协程函数，并在执行过程中处理可能出现的异常情况。
 void Fiber::MainFunc() {
     //获取当前正在执行的协程指针。这里的 Fiber::ptr 是协程智能指针，它允许在协程执行结束后自动释放资源。
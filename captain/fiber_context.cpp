@@ -0,0 +1,139 @@
+#include "include/fiber_context.h"
+#include "include/log.h"
+#include "include/macro.h"
+#include <stdint.h>
+#include <string.h>
+
+namespace captain {
+
+#ifdef CAPTAIN_FIBER_USE_ASM
+
+#if defined(__x86_64__)
+/* System V x86-64：rbx rbp r12-r15 由被调用者保存，另外保存 mxcsr 和 x87 控制字。
+栈上从低到高：[mxcsr|fpucw] r15 r14 r13 r12 rbx rbp 返回地址
+ */
+asm(R"(
+    .text
+    .globl captain_swap_context
+    .type captain_swap_context, @function
+    .p2align 4
+captain_swap_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size captain_swap_context, .-captain_swap_context
+)");
+
+void MakeFiberContext(FiberContext* ctx, void* stack, size_t size, void (*entry)()) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    uint64_t* sp = (uint64_t*)top;
+    //假的返回地址，entry开始执行时rsp按16字节对齐减8，和正常call进来一样；栈回溯到这里结束
+    *--sp = 0;
+    //captain_swap_context最后的ret跳到entry
+    *--sp = (uint64_t)entry;
+    //rbp rbx r12 r13 r14 r15
+    for(int i = 0; i < 6; ++i) {
+        *--sp = 0;
+    }
+    //mxcsr和x87控制字取默认值
+    uint32_t fpu[2] = {0x1F80, 0x037F};
+    --sp;
+    memcpy(sp, fpu, sizeof(fpu));
+    ctx->sp = sp;
+}
+
+#elif defined(__aarch64__)
+/* AAPCS64：x19-x28 fp(x29) lr(x30) 和 d8-d15 由被调用者保存，栈上占176字节保持16字节对齐 */
+asm(R"(
+    .text
+    .globl captain_swap_context
+    .type captain_swap_context, %function
+    .p2align 4
+captain_swap_context:
+    sub sp, sp, #176
+    stp x19, x20, [sp, #0]
+    stp x21, x22, [sp, #16]
+    stp x23, x24, [sp, #32]
+    stp x25, x26, [sp, #48]
+    stp x27, x28, [sp, #64]
+    stp x29, x30, [sp, #80]
+    stp d8, d9, [sp, #96]
+    stp d10, d11, [sp, #112]
+    stp d12, d13, [sp, #128]
+    stp d14, d15, [sp, #144]
+    mov x2, sp
+    str x2, [x0]
+    mov sp, x1
+    ldp x19, x20, [sp, #0]
+    ldp x21, x22, [sp, #16]
+    ldp x23, x24, [sp, #32]
+    ldp x25, x26, [sp, #48]
+    ldp x27, x28, [sp, #64]
+    ldp x29, x30, [sp, #80]
+    ldp d8, d9, [sp, #96]
+    ldp d10, d11, [sp, #112]
+    ldp d12, d13, [sp, #128]
+    ldp d14, d15, [sp, #144]
+    add sp, sp, #176
+    ret
+    .size captain_swap_context, .-captain_swap_context
+)");
+
+void MakeFiberContext(FiberContext* ctx, void* stack, size_t size, void (*entry)()) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    uint64_t* sp = (uint64_t*)(top - 176);
+    memset(sp, 0, 176);
+    //fp为0，栈回溯到这里结束；lr为entry，ret之后从entry开始执行
+    sp[11] = (uint64_t)entry;
+    ctx->sp = sp;
+}
+#endif
+
+const char* FiberContextBackend() {
+    return "asm";
+}
+
+#else
+
+const char* FiberContextBackend() {
+    return "ucontext";
+}
+
+void MakeFiberContext(FiberContext* ctx, void* stack, size_t size, void (*entry)()) {
+    if(getcontext(&ctx->uc)) {
+        CAPTAIN_ASSERT2(false, "getcontext");
+    }
+    //uc_link为空，entry执行完不返回到任何上下文
+    ctx->uc.uc_link = nullptr;
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = size;
+    makecontext(&ctx->uc, entry, 0);
+}
+
+void SwapFiberContext(FiberContext* from, FiberContext* to) {
+    if(swapcontext(&from->uc, &to->uc)) {
+        CAPTAIN_ASSERT2(false, "swapcontext");
+    }
+}
+
+#endif
+
+}
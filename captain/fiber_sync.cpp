@@ -0,0 +1,259 @@
+#include "include/fiber_sync.h"
+#include "include/scheduler.h"
+#include "include/log.h"
+#include "include/macro.h"
+
+namespace captain {
+
+void FiberWaitQueue::push_back(FiberWaiter* waiter) {
+    waiter->next = nullptr;
+    if(m_tail) {
+        m_tail->next = waiter;
+    } else {
+        m_head = waiter;
+    }
+    m_tail = waiter;
+}
+
+FiberWaiter* FiberWaitQueue::pop_front() {
+    FiberWaiter* waiter = m_head;
+    if(waiter) {
+        m_head = waiter->next;
+        if(!m_head) {
+            m_tail = nullptr;
+        }
+        waiter->next = nullptr;
+    }
+    return waiter;
+}
+
+void FiberWaiter::init() {
+    scheduler = Scheduler::GetThis();
+    CAPTAIN_ASSERT2(scheduler, "fiber sync wait outside a scheduler");
+    fiber = Fiber::GetThis();
+    CAPTAIN_ASSERT2(fiber.get() != Scheduler::GetMainFiber()
+            , "fiber sync wait in the scheduler main fiber");
+    ++scheduler->m_suspendedCount;
+}
+
+void FiberWaiter::wake() {
+    //节点在等待协程的栈上，调度之后协程随时可能恢复执行，先把需要的东西取出来
+    Scheduler* s = scheduler;
+    Fiber::ptr f;
+    f.swap(fiber);
+    s->schedule(&f);
+    --s->m_suspendedCount;
+}
+
+//状态保持EXEC切回调度器，由run()在切换完成之后改成HOLD。
+//这之前唤醒者已经调度了它也没关系，调度器不会执行还处于EXEC状态的协程
+void FiberWaiter::Suspend() {
+    Fiber::ptr cur = Fiber::GetThis();
+    cur->swapOut();
+}
+
+bool FiberMutex::tryLock() {
+    MutexType::Lock lock(m_mutex);
+    if(m_locked) {
+        return false;
+    }
+    m_locked = true;
+    return true;
+}
+
+void FiberMutex::lock() {
+    MutexType::Lock lock(m_mutex);
+    if(!m_locked) {
+        m_locked = true;
+        return;
+    }
+    FiberWaiter waiter;
+    waiter.init();
+    m_waiters.push_back(&waiter);
+    lock.unlock();
+    //被唤醒时锁已经交给了自己
+    FiberWaiter::Suspend();
+}
+
+void FiberMutex::unlock() {
+    FiberWaiter* waiter = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        CAPTAIN_ASSERT(m_locked);
+        waiter = m_waiters.pop_front();
+        //有等待者时m_locked保持true，锁直接交给它
+        if(!waiter) {
+            m_locked = false;
+        }
+    }
+    if(waiter) {
+        waiter->wake();
+    }
+}
+
+FiberSemaphore::FiberSemaphore(size_t count)
+    :m_count(count) {
+}
+
+bool FiberSemaphore::tryWait() {
+    MutexType::Lock lock(m_mutex);
+    if(m_count > 0) {
+        --m_count;
+        return true;
+    }
+    return false;
+}
+
+void FiberSemaphore::wait() {
+    MutexType::Lock lock(m_mutex);
+    if(m_count > 0) {
+        --m_count;
+        return;
+    }
+    FiberWaiter waiter;
+    waiter.init();
+    m_waiters.push_back(&waiter);
+    lock.unlock();
+    FiberWaiter::Suspend();
+}
+
+void FiberSemaphore::notify() {
+    FiberWaiter* waiter = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        waiter = m_waiters.pop_front();
+        //有等待者时计数直接交给它，不经过m_count
+        if(!waiter) {
+            ++m_count;
+        }
+    }
+    if(waiter) {
+        waiter->wake();
+    }
+}
+
+void FiberCondition::wait(FiberMutex::Lock& lock) {
+    FiberWaiter waiter;
+    waiter.init();
+    {
+        //先登记再释放互斥锁，两者之间的notify不会丢失
+        MutexType::Lock l(m_mutex);
+        m_waiters.push_back(&waiter);
+    }
+    lock.unlock();
+    FiberWaiter::Suspend();
+    lock.lock();
+}
+
+void FiberCondition::notify() {
+    FiberWaiter* waiter = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        waiter = m_waiters.pop_front();
+    }
+    if(waiter) {
+        waiter->wake();
+    }
+}
+
+void FiberCondition::notifyAll() {
+    FiberWaitQueue waiters;
+    {
+        MutexType::Lock lock(m_mutex);
+        while(FiberWaiter* waiter = m_waiters.pop_front()) {
+            waiters.push_back(waiter);
+        }
+    }
+    while(FiberWaiter* waiter = waiters.pop_front()) {
+        waiter->wake();
+    }
+}
+
+WaitGroup::WaitGroup(int count)
+    :m_count(count) {
+}
+
+void WaitGroup::add(int count) {
+    FiberWaitQueue wake;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_count += count;
+        CAPTAIN_ASSERT(m_count >= 0);
+        if(m_count == 0) {
+            while(FiberWaiter* waiter = m_waiters.pop_front()) {
+                wake.push_back(waiter);
+            }
+        }
+    }
+    while(FiberWaiter* waiter = wake.pop_front()) {
+        waiter->wake();
+    }
+}
+
+void WaitGroup::wait() {
+    MutexType::Lock lock(m_mutex);
+    if(m_count == 0) {
+        return;
+    }
+    FiberWaiter waiter;
+    waiter.init();
+    m_waiters.push_back(&waiter);
+    lock.unlock();
+    FiberWaiter::Suspend();
+}
+
+void FiberRWMutex::rdlock() {
+    MutexType::Lock lock(m_mutex);
+    if(!m_writer && m_writerWaiters.empty()) {
+        ++m_readers;
+        return;
+    }
+    FiberWaiter waiter;
+    waiter.init();
+    m_readerWaiters.push_back(&waiter);
+    lock.unlock();
+    //被唤醒时读锁已经算在m_readers里了
+    FiberWaiter::Suspend();
+}
+
+void FiberRWMutex::wrlock() {
+    MutexType::Lock lock(m_mutex);
+    if(!m_writer && m_readers == 0) {
+        m_writer = true;
+        return;
+    }
+    FiberWaiter waiter;
+    waiter.init();
+    m_writerWaiters.push_back(&waiter);
+    lock.unlock();
+    FiberWaiter::Suspend();
+}
+
+void FiberRWMutex::unlock() {
+    FiberWaitQueue wake;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_writer) {
+            m_writer = false;
+            //写锁释放时先放行所有等待的读者，写者和读者交替，谁都不会饿死
+            while(FiberWaiter* waiter = m_readerWaiters.pop_front()) {
+                ++m_readers;
+                wake.push_back(waiter);
+            }
+        } else {
+            CAPTAIN_ASSERT(m_readers > 0);
+            --m_readers;
+        }
+        if(!m_writer && m_readers == 0) {
+            if(FiberWaiter* waiter = m_writerWaiters.pop_front()) {
+                m_writer = true;
+                wake.push_back(waiter);
+            }
+        }
+    }
+    while(FiberWaiter* waiter = wake.pop_front()) {
+        waiter->wake();
+    }
+}
+
+}
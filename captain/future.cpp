@@ -0,0 +1,108 @@
+#include "include/future.h"
+#include "include/log.h"
+#include "include/macro.h"
+
+namespace captain {
+
+void FutureStateBase::wait() {
+    if(isReady()) {
+        return;
+    }
+    MutexType::Lock lock(m_mutex);
+    if(m_status == READY) {
+        return;
+    }
+    FiberWaiter waiter;
+    waiter.init();
+    m_waiters.push_back(&waiter);
+    lock.unlock();
+    FiberWaiter::Suspend();
+}
+
+void FutureStateBase::then(std::function<void()> cb) {
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_status != READY) {
+            m_callbacks.push_back(std::move(cb));
+            return;
+        }
+    }
+    cb();
+}
+
+void FutureStateBase::rethrow() const {
+    if(m_exception) {
+        std::rethrow_exception(m_exception);
+    }
+}
+
+bool FutureStateBase::setException(std::exception_ptr e) {
+    if(!claim()) {
+        return false;
+    }
+    m_exception = e;
+    complete();
+    return true;
+}
+
+bool FutureStateBase::claim() {
+    MutexType::Lock lock(m_mutex);
+    if(m_status != PENDING) {
+        return false;
+    }
+    m_status = SETTING;
+    return true;
+}
+
+void FutureStateBase::complete() {
+    FiberWaitQueue waiters;
+    std::vector<std::function<void()> > callbacks;
+    {
+        MutexType::Lock lock(m_mutex);
+        CAPTAIN_ASSERT(m_status == SETTING);
+        m_status = READY;
+        while(FiberWaiter* waiter = m_waiters.pop_front()) {
+            waiters.push_back(waiter);
+        }
+        callbacks.swap(m_callbacks);
+    }
+    while(FiberWaiter* waiter = waiters.pop_front()) {
+        waiter->wake();
+    }
+    for(auto& i : callbacks) {
+        i();
+    }
+}
+
+Future<void> WhenAll(const std::vector<FutureStateBase::ptr>& states) {
+    Promise<void> promise;
+    Future<void> future = promise.getFuture();
+    if(states.empty()) {
+        promise.setValue();
+        return future;
+    }
+    std::shared_ptr<std::atomic<size_t> > left =
+        std::make_shared<std::atomic<size_t> >(states.size());
+    for(auto& i : states) {
+        i->then([promise, left]() mutable {
+            if(--*left == 0) {
+                promise.setValue();
+            }
+        });
+    }
+    return future;
+}
+
+Future<size_t> WhenAny(const std::vector<FutureStateBase::ptr>& states) {
+    Promise<size_t> promise;
+    Future<size_t> future = promise.getFuture();
+    for(size_t i = 0; i < states.size(); ++i) {
+        //只有第一个完成的能设置成功
+        states[i]->then([promise, i]() mutable {
+            promise.setValue(i);
+        });
+    }
+    return future;
+}
+
+}
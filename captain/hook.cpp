@@ -6,6 +6,7 @@
 #include "include/fiber.h"
 #include "include/iomanager.h"
 #include "include/fd_manager.h"
+#include "include/io_uring.h"
 
 captain::Logger::ptr g_logger = CAPTAIN_LOG_NAME("system");
 namespace captain {
@@ -79,10 +80,24 @@ struct timer_info {
     int cancelled = 0;
 };
 
+typedef captain::IOManager::IoRequest IoRequest;
+
+static IoRequest MakeRequest(uint8_t opcode, const void* addr, uint32_t len, uint32_t flags = 0
+        , uint64_t addr2 = 0) {
+    IoRequest req;
+    req.opcode = opcode;
+    req.addr = (void*)addr;
+    req.len = len;
+    req.flags = flags;
+    req.addr2 = addr2;
+    return req;
+}
+
 //do_io：hook住和io相关的一些操作
+//req是io_uring后端下等待时直接提交的操作，为空时和epoll后端一样等fd就绪之后重试
 template<typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
-        uint32_t event, int timeout_so, Args&&... args) {
+        uint32_t event, int timeout_so, const IoRequest* req, Args&&... args) {
     //没有被hook  直接执行原函数
     if(!captain::t_hook_enable) {
         return fun(fd, std::forward<Args>(args)...);
@@ -109,7 +124,8 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
     /* 【条件】 */
     //to 超时时间
     uint64_t to = ctx->getTimeout(timeout_so);
-    std::shared_ptr<timer_info> tinfo(new timer_info);
+    //只有真的需要等待时才创建【条件】，直接读写成功的情况下不分配内存
+    std::shared_ptr<timer_info> tinfo;
 
 retry:
     //先尝试直接执行，如果能返回一个非负数。说明以及读到数据了？可以直接return出去
@@ -124,7 +140,9 @@ retry:
         //拿出当前线程所在的iomanager
         captain::IOManager* iom = captain::IOManager::GetThis();
         captain::Timer::ptr timer; //定时器，一个定时任务的类
-        //【条件】变量  设置在了上面
+        if(!tinfo) {
+            tinfo = std::make_shared<timer_info>();
+        }
         std::weak_ptr<timer_info> winfo(tinfo);
 
         //如果超时时间不等于-1，则说明设置了超时
@@ -143,8 +161,12 @@ retry:
                 iom->cancelEvent(fd, (captain::IOManager::Event)(event));
             }, winfo);
         }
+        //io_uring后端直接把操作提交给内核，完成时结果已经有了，不需要再调用一次
+        bool submitted = req && iom->useIoUring();
+        int result = 0;
         //取消掉之后 会从event中唤醒回来？ 且 没带回调函数 会用默认用当前协程做回调参数
-        int rt = iom->addEvent(fd, (captain::IOManager::Event)(event));
+        int rt = submitted ? iom->submitIO(fd, (captain::IOManager::Event)(event), *req, &result)
+                           : iom->addEvent(fd, (captain::IOManager::Event)(event));
         //如果添加失败
         if(rt) {
             CAPTAIN_LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
@@ -155,17 +177,31 @@ retry:
             return -1;
         } else {
             //CAPTAIN_LOG_DEBUG(g_logger) << "do_io<" << hook_fun_name << ">";
+            //其他线程上的close()可能在这次注册之前就做完了cancelAll()，
+            //句柄关掉之后内核不会再报告事件，只能自己取消掉，醒来重试时拿到EBADF
+            if(ctx->isClose()) {
+                iom->cancelEvent(fd, (captain::IOManager::Event)(event));
+            }
             //成功，让出当前协程的执行时间
             captain::Fiber::YieldToHold();
             //CAPTAIN_LOG_DEBUG(g_logger) << "do_io<" << hook_fun_name << ">";
             if(timer) {
                 timer->cancel();
             }
+            //超时取消和操作完成同时发生时，已经读写的数据不能丢
+            if(submitted && result >= 0) {
+                return result;
+            }
             //如果info->cancelled，说明是通过定时任务将其唤醒的  说明已经超时
             if(tinfo->cancelled) {
                 errno = tinfo->cancelled;
                 return -1;
             }
+            //被cancelEvent取消的操作和epoll后端一样重新执行
+            if(submitted && result != -ECANCELED && result != -EAGAIN) {
+                errno = -result;
+                return -1;
+            }
             //如果事件回来了  再重新读
             goto retry;
         }
@@ -182,43 +218,46 @@ extern "C" {
 
 unsigned int sleep(unsigned int seconds) {
     //如果 captain::t_hook_enable 为假，那么直接调用原始的 sleep 函数
-    if(!captain::t_hook_enable) {
+    //普通的Scheduler没有定时器，只能真的睡眠
+    if(!captain::t_hook_enable || !captain::IOManager::GetThis()) {
         return sleep_f(seconds);
     }
     //如果 captain::t_hook_enable 为真，说明启用了钩子，此时会将当前协程挂起，等待指定的时间后恢复
     captain::Fiber::ptr fiber = captain::Fiber::GetThis();
     captain::IOManager* iom = captain::IOManager::GetThis();
-    iom->addTimer(seconds * 1000, std::bind((void(captain::Scheduler::*)
-            (captain::Fiber::ptr, int thread))&captain::IOManager::schedule
-            ,iom, fiber, -1));
+    iom->addTimer(seconds * 1000, [iom, fiber]() {
+                iom->schedule(fiber);
+            });
     captain::Fiber::YieldToHold();
     return 0;
 }
 
 int usleep(useconds_t usec) {
-    if(!captain::t_hook_enable) {
+    //普通的Scheduler没有定时器，只能真的睡眠
+    if(!captain::t_hook_enable || !captain::IOManager::GetThis()) {
         return usleep_f(usec);
     }
     captain::Fiber::ptr fiber = captain::Fiber::GetThis();
     captain::IOManager* iom = captain::IOManager::GetThis();
-    iom->addTimer(usec / 1000, std::bind((void(captain::Scheduler::*)
-            (captain::Fiber::ptr, int thread))&captain::IOManager::schedule
-            ,iom, fiber, -1));
+    iom->addTimer(usec / 1000, [iom, fiber]() {
+                iom->schedule(fiber);
+            });
     captain::Fiber::YieldToHold();
     return 0;
 }
 
 int nanosleep(const struct timespec *req, struct timespec *rem) {
-    if(!captain::t_hook_enable) {
+    //普通的Scheduler没有定时器，只能真的睡眠
+    if(!captain::t_hook_enable || !captain::IOManager::GetThis()) {
         return nanosleep_f(req, rem);
     }
 
     int timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 /1000;
     captain::Fiber::ptr fiber = captain::Fiber::GetThis();
     captain::IOManager* iom = captain::IOManager::GetThis();
-    iom->addTimer(timeout_ms, std::bind((void(captain::Scheduler::*)
-            (captain::Fiber::ptr, int thread))&captain::IOManager::schedule
-            ,iom, fiber, -1));
+    iom->addTimer(timeout_ms, [iom, fiber]() {
+                iom->schedule(fiber);
+            });
     captain::Fiber::YieldToHold();
     return 0;
 }
@@ -291,6 +330,10 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     //如果写事件注册成功（返回值为0），则当前协程切换到其他协程。这样，其他协程就有机会继续执行，而不会被当前协程阻塞。
     //同时，定时器也被取消，以防止后续不必要的超时处理。
     if(rt == 0) {
+        //和do_io一样，注册期间句柄被其他线程关掉了就自己取消
+        if(ctx->isClose()) {
+            iom->cancelEvent(fd, captain::IOManager::WRITE);
+        }
         captain::Fiber::YieldToHold();
         if(timer) {
             timer->cancel();
@@ -327,7 +370,8 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
-    int fd = do_io(s, accept_f, "accept", captain::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    IoRequest req = MakeRequest(IORING_OP_ACCEPT, addr, 0, 0, (uint64_t)addrlen);
+    int fd = do_io(s, accept_f, "accept", captain::IOManager::READ, SO_RCVTIMEO, &req, addr, addrlen);
     if(fd >= 0) {
         captain::FdMgr::GetInstance()->get(fd, true);
     }
@@ -335,43 +379,69 @@ int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
-    return do_io(fd, read_f, "read", captain::IOManager::READ, SO_RCVTIMEO, buf, count);
+    //do_io只处理socket，按recv提交；io_uring对O_NONBLOCK的read会直接返回EAGAIN
+    IoRequest req = MakeRequest(IORING_OP_RECV, buf, count);
+    return do_io(fd, read_f, "read", captain::IOManager::READ, SO_RCVTIMEO, &req, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-    return do_io(fd, readv_f, "readv", captain::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    IoRequest req = MakeRequest(IORING_OP_RECVMSG, &msg, 1);
+    return do_io(fd, readv_f, "readv", captain::IOManager::READ, SO_RCVTIMEO, &req, iov, iovcnt);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-    return do_io(sockfd, recv_f, "recv", captain::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+    IoRequest req = MakeRequest(IORING_OP_RECV, buf, len, flags);
+    return do_io(sockfd, recv_f, "recv", captain::IOManager::READ, SO_RCVTIMEO, &req, buf, len, flags);
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
-    return do_io(sockfd, recvfrom_f, "recvfrom", captain::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+    //完成之后还要回填addrlen，等fd就绪之后重试
+    return do_io(sockfd, recvfrom_f, "recvfrom", captain::IOManager::READ, SO_RCVTIMEO, nullptr, buf, len, flags, src_addr, addrlen);
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
-    return do_io(sockfd, recvmsg_f, "recvmsg", captain::IOManager::READ, SO_RCVTIMEO, msg, flags);
+    IoRequest req = MakeRequest(IORING_OP_RECVMSG, msg, 1, flags);
+    return do_io(sockfd, recvmsg_f, "recvmsg", captain::IOManager::READ, SO_RCVTIMEO, &req, msg, flags);
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
-    return do_io(fd, write_f, "write", captain::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+    IoRequest req = MakeRequest(IORING_OP_SEND, buf, count);
+    return do_io(fd, write_f, "write", captain::IOManager::WRITE, SO_SNDTIMEO, &req, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
-    return do_io(fd, writev_f, "writev", captain::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    IoRequest req = MakeRequest(IORING_OP_SENDMSG, &msg, 1);
+    return do_io(fd, writev_f, "writev", captain::IOManager::WRITE, SO_SNDTIMEO, &req, iov, iovcnt);
 }
 
 ssize_t send(int s, const void *msg, size_t len, int flags) {
-    return do_io(s, send_f, "send", captain::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+    IoRequest req = MakeRequest(IORING_OP_SEND, msg, len, flags);
+    return do_io(s, send_f, "send", captain::IOManager::WRITE, SO_SNDTIMEO, &req, msg, len, flags);
 }
 
 ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
-    return do_io(s, sendto_f, "sendto", captain::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+    msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    iovec iov = {(void*)msg, len};
+    hdr.msg_name = (void*)to;
+    hdr.msg_namelen = tolen;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    IoRequest req = MakeRequest(IORING_OP_SENDMSG, &hdr, 1, flags);
+    return do_io(s, sendto_f, "sendto", captain::IOManager::WRITE, SO_SNDTIMEO, &req, msg, len, flags, to, tolen);
 }
 
 ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
-    return do_io(s, sendmsg_f, "sendmsg", captain::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+    IoRequest req = MakeRequest(IORING_OP_SENDMSG, msg, 1, flags);
+    return do_io(s, sendmsg_f, "sendmsg", captain::IOManager::WRITE, SO_SNDTIMEO, &req, msg, flags);
 }
 
 int close(int fd) {
@@ -381,6 +451,8 @@ int close(int fd) {
 
     captain::FdCtx::ptr ctx = captain::FdMgr::GetInstance()->get(fd);
     if(ctx) {
+        //先标记再取消，cancelAll()之后才注册上的事件由注册的协程自己发现并取消，见do_io
+        ctx->setClose();
         auto iom = captain::IOManager::GetThis();
         if(iom) {
             iom->cancelAll(fd);
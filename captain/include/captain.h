@@ -1,9 +1,15 @@
 #pragma once
 
+#include "channel.h"
 #include "config.h"
 #include "fiber.h"
+#include "fiber_local.h"
+#include "fiber_sync.h"
+#include "future.h"
 #include "log.h"
 #include "macro.h"
+#include "parallel.h"
+#include "profiler.h"
 #include "scheduler.h"
 #include "singleton.h"
 #include "thread.h"
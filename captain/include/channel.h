@@ -0,0 +1,283 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <type_traits>
+#include "fiber.h"
+#include "thread.h"
+#include "noncopyable.h"
+
+namespace captain {
+
+class Scheduler;
+class ChannelBase;
+
+//一次挂起的等待，select时所有通道上的节点共用一个，谁先把fired置为true谁负责唤醒
+struct ChannelWaitState {
+    std::atomic<bool> fired = {false};
+    Scheduler* scheduler = nullptr;
+    Fiber::ptr fiber;
+    ChannelBase* firedBy = nullptr; //唤醒者所在的通道
+    int firedDir = 0;               //唤醒者唤醒的方向
+};
+
+//挂在某个通道等待队列上的节点，放在等待协程的栈上
+struct ChannelWaiter {
+    ChannelWaitState* state = nullptr;
+    ChannelWaiter* prev = nullptr;
+    ChannelWaiter* next = nullptr;
+    bool linked = false;
+};
+
+/* ChannelBase
+Channel<T> 中和元素类型无关的部分：关闭状态、发送方和接收方的等待队列、挂起和唤醒。
+1、通道不满也不空时收发只操作无锁环形队列，只有在有协程等待时才加锁唤醒
+2、操作失败时协程先登记到等待队列，再重试一次，仍然失败才挂起，和唤醒方之间不会丢失通知
+3、被唤醒只是一个提示，醒来后重新尝试，被别人抢先就再次挂起
+ */
+class ChannelBase : Noncopyable {
+public:
+    //等待方向：等待数据的接收方、等待空位的发送方
+    enum Dir {
+        RECV = 0,
+        SEND = 1,
+    };
+
+    //select的一个分支，value指向要发送的元素或接收结果的存放位置
+    struct Case {
+        ChannelBase* channel;
+        int dir;
+        void* value;
+        bool* ok;
+    };
+
+    virtual ~ChannelBase() {}
+
+    //关闭之后不能再发送，接收方取完剩下的元素后返回false，所有等待的协程都被唤醒
+    void close();
+    bool isClosed() const { return m_closed;}
+
+    //依次尝试各个分支，返回完成的分支下标；都不能完成时block为true则挂起等待，否则返回-1
+    //通道已关闭的分支也算完成，ok被置为false
+    static int Select(Case* cases, size_t count, bool block);
+protected:
+    //尝试完成一次收发，不会阻塞。能完成（包括因为通道关闭而失败）时返回true
+    virtual bool tryOp(int dir, void* value, bool* ok) = 0;
+    //唤醒一个dir方向上等待的协程，没有等待者时只读一次原子变量
+    void notify(int dir);
+private:
+    void notifyAll();
+    void enqueue(int dir, ChannelWaiter* waiter);
+    void dequeue(int dir, ChannelWaiter* waiter);
+private:
+    typedef Spinlock MutexType;
+    MutexType m_mutex;
+    ChannelWaiter* m_head[2] = {nullptr, nullptr};
+    ChannelWaiter* m_tail[2] = {nullptr, nullptr};
+    std::atomic<size_t> m_waiting[2] = {{0}, {0}};
+protected:
+    std::atomic<bool> m_closed = {false};
+};
+
+/* Channel
+有界的多生产者多消费者通道，收发在协程里挂起而不是阻塞线程。
+元素存放在 Vyukov 的无锁环形队列里，每个槽位用序号区分可写和可读。
+ */
+template<class T>
+class Channel : public ChannelBase {
+public:
+    typedef std::shared_ptr<Channel> ptr;
+
+    //环形队列靠槽位序号区分可写和可读，容量至少为2
+    Channel(size_t capacity)
+        :m_capacity(capacity < 2 ? 2 : capacity)
+        ,m_cells(new Cell[m_capacity]) {
+        for(size_t i = 0; i < m_capacity; ++i) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~Channel() {
+        size_t tail = m_tail;
+        for(size_t pos = m_head; pos != tail; ++pos) {
+            reinterpret_cast<T*>(&m_cells[pos % m_capacity].storage)->~T();
+        }
+        delete[] m_cells;
+    }
+
+    size_t getCapacity() const { return m_capacity;}
+    //当前元素个数，并发收发时只是近似值
+    size_t getSize() const {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    //通道满时挂起当前协程，通道已关闭返回false
+    bool send(const T& v) {
+        T tmp(v);
+        return send(std::move(tmp));
+    }
+    bool send(T&& v) {
+        bool ok = false;
+        if(tryOp(SEND, &v, &ok)) {
+            return ok;
+        }
+        Case c = {this, SEND, &v, &ok};
+        Select(&c, 1, true);
+        return ok;
+    }
+    //通道空时挂起当前协程，通道已关闭并且取空了返回false
+    bool recv(T& v) {
+        bool ok = false;
+        if(tryOp(RECV, &v, &ok)) {
+            return ok;
+        }
+        Case c = {this, RECV, &v, &ok};
+        Select(&c, 1, true);
+        return ok;
+    }
+
+    //不挂起的版本，不能立即完成时返回false
+    bool trySend(T&& v) {
+        bool ok = false;
+        return tryOp(SEND, &v, &ok) && ok;
+    }
+    bool trySend(const T& v) {
+        T tmp(v);
+        return trySend(std::move(tmp));
+    }
+    bool tryRecv(T& v) {
+        bool ok = false;
+        return tryOp(RECV, &v, &ok) && ok;
+    }
+protected:
+    bool tryOp(int dir, void* value, bool* ok) override {
+        if(dir == SEND) {
+            if(m_closed) {
+                *ok = false;
+                return true;
+            }
+            if(!push(*static_cast<T*>(value))) {
+                return false;
+            }
+            *ok = true;
+            notify(RECV);
+            return true;
+        }
+        T& v = *static_cast<T*>(value);
+        if(pop(v)) {
+            *ok = true;
+            notify(SEND);
+            return true;
+        }
+        if(!m_closed) {
+            return false;
+        }
+        //看到关闭之后再取一次，关闭前发送成功的元素不会被漏掉
+        *ok = pop(v);
+        if(*ok) {
+            notify(SEND);
+        }
+        return true;
+    }
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    //槽位的序号等于写位置时可写，等于写位置+1时可读，读完之后加上容量留给下一圈
+    bool push(T& v) {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        while(true) {
+            cell = &m_cells[pos % m_capacity];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0) {
+                if(m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if(diff < 0) {
+                return false;   //满了
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        new (&cell->storage) T(std::move(v));
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& v) {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        Cell* cell;
+        while(true) {
+            cell = &m_cells[pos % m_capacity];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(diff == 0) {
+                if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if(diff < 0) {
+                return false;   //空了
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+        T* p = reinterpret_cast<T*>(&cell->storage);
+        v = std::move(*p);
+        p->~T();
+        cell->seq.store(pos + m_capacity, std::memory_order_release);
+        return true;
+    }
+private:
+    size_t m_capacity;
+    Cell* m_cells;
+    //读写位置分开放在不同的缓存行，避免收发双方互相干扰
+    char m_pad0[64];
+    std::atomic<size_t> m_head = {0};
+    char m_pad1[64];
+    std::atomic<size_t> m_tail = {0};
+};
+
+/* ChannelSelect
+在多个通道上同时等待，完成其中一个：
+    ChannelSelect sel;
+    sel.recv(ch1, v1).recv(ch2, v2).send(ch3, v3);
+    int idx = sel.wait();   //返回完成的分支下标，按添加顺序从0开始
+多个分支同时可以完成时轮流选择，不会总是偏向第一个
+ */
+class ChannelSelect {
+public:
+    template<class T>
+    ChannelSelect& recv(Channel<T>& ch, T& value, bool* ok = nullptr) {
+        add(&ch, ChannelBase::RECV, &value, ok);
+        return *this;
+    }
+    //发送成功时value被移走
+    template<class T>
+    ChannelSelect& send(Channel<T>& ch, T& value, bool* ok = nullptr) {
+        add(&ch, ChannelBase::SEND, &value, ok);
+        return *this;
+    }
+
+    //挂起直到有一个分支完成
+    int wait() { return ChannelBase::Select(m_cases.data(), m_cases.size(), true);}
+    //相当于Go里带default的select，没有分支可以完成时返回-1
+    int tryWait() { return ChannelBase::Select(m_cases.data(), m_cases.size(), false);}
+private:
+    void add(ChannelBase* ch, int dir, void* value, bool* ok) {
+        ChannelBase::Case c = {ch, dir, value, ok ? ok : &m_ignored};
+        m_cases.push_back(c);
+    }
+private:
+    std::vector<ChannelBase::Case> m_cases;
+    bool m_ignored = false;
+};
+
+}
@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <vector>
+#include <atomic>
 #include "thread.h"
 #include "singleton.h"
 
@@ -19,7 +20,11 @@ public:
     bool isInit() const { return m_isInit;}
     bool isSocket() const { return m_isSocket;}
     bool isClose() const { return m_isClosed;}
+    //hook的close()在取消事件之前标记，其他线程上正在注册事件的协程据此发现句柄已经关闭
+    void setClose() { m_isClosed = true;}
     bool close();
+    //句柄号每次经过hook的close()之后重新创建的上下文都有新的代数，IOManager据此发现句柄号被复用
+    uint64_t getGeneration() const { return m_generation;}
 
     void setUserNonblock(bool v) { m_userNonblock = v;}
     bool getUserNonblock() const { return m_userNonblock;}
@@ -34,8 +39,9 @@ private:
     bool m_isSocket: 1;
     bool m_sysNonblock: 1;
     bool m_userNonblock: 1;
-    bool m_isClosed: 1;
+    std::atomic<bool> m_isClosed;
     int m_fd;
+    uint64_t m_generation;
     uint64_t m_recvTimeout;
     uint64_t m_sendTimeout;
 };
@@ -49,6 +55,9 @@ public:
 
     FdCtx::ptr get(int fd, bool auto_create = false);
     void del(int fd);
+    //句柄当前上下文的代数，没有上下文时返回0。
+    //没有hook的close()和dup2()不会更新代数，复用的句柄号上IOManager会漏掉注册，不支持这种用法
+    uint64_t getGeneration(int fd);
 
 private:
     RWMutexType m_mutex;
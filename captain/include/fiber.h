@@ -1,13 +1,17 @@
 #pragma once
 
 #include <memory>
+#include <atomic>
 #include <functional>
-#include <ucontext.h>
+#include <vector>
 #include "thread.h"
+#include "fiber_context.h"
+#include "stack_profile.h"
 
 namespace captain {
 
 class Scheduler;
+struct SharedStack;
 /* 
 这段代码定义了一个名为 Fiber 的类，该类继承自 std::enable_shared_from_this<Fiber>，
 意味着它具有一些与 std::shared_ptr 相关的特性，主要用于管理共享指针的生命周期。
@@ -25,6 +29,8 @@ class Fiber : public std::enable_shared_from_this<Fiber> {
 friend class Scheduler;
 public:
     typedef std::shared_ptr<Fiber> ptr;
+    //协程局部存储的槽位数上限，见 FiberLocal
+    static const size_t MAX_LOCAL_SLOTS = 128;
 
     enum State {
         INIT,
@@ -40,7 +46,11 @@ private:
     Fiber();
 
 public:
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);
+    //shared_stack为true时在线程的共享栈上执行，切出时只把用到的部分拷贝出来，
+    //适合大量长时间挂起的协程。第一次执行之后只能在同一个线程上恢复，调度时会自动指定线程。
+    //需要汇编的上下文切换，使用ucontext时忽略这个参数
+    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false
+        , bool shared_stack = false);
     ~Fiber();
 
     //重置协程函数，并重置状态
@@ -56,32 +66,92 @@ public:
 
     uint64_t getId() const { return m_id;}
     State getState() const { return m_state;}
+    bool isSharedStack() const { return m_useSharedStack;}
+    //共享栈的协程切出时拷贝出来的栈大小
+    size_t getSavedStackSize() const { return m_savedSize;}
+    size_t getSavedStackCapacity() const { return m_savedCapacity;}
+    //统计这个协程的栈用量，结束时记到profile。需要在切入之前设置，reset之后要重新设置
+    void setStackProfile(StackProfile* profile) { m_profile = profile;}
+    StackProfile* getStackProfile() const { return m_profile;}
+    //协程的入口标签，采样分析时作为调用栈的第一帧。字符串要一直有效，见 Profiler::Tag，reset之后要重新设置
+    void setTag(const char* tag) { m_tag = tag;}
+    const char* getTag() const { return m_tag;}
 public:
     //设置当前协程
     static void SetThis(Fiber* f);
     //返回当前协程
     static Fiber::ptr GetThis();
+    //当前协程的裸指针，线程还没有协程时返回nullptr，不分配内存，可以在信号处理函数里调用
+    static Fiber* PeekThis();
     //协程切换到后台，并且设置为Ready状态
     static void YieldToReady();
-    //协程切换到后台，并且设置为Hold状态
+    //协程切换到后台，状态仍然是EXEC，由Scheduler::run()在切换完成之后设置为HOLD。
+    //调度器之外直接用swapIn()驱动的协程不会变成HOLD，让出之后一直是EXEC
     static void YieldToHold();
     //总协程数
     static uint64_t TotalFibers();
+    //归还当前线程缓存里空闲超过 fiber.stack_idle_ms 的栈的物理内存，线程空闲时调用
+    static void TrimStackCache();
+    //当前线程缓存的空闲栈个数
+    static size_t CachedStacks();
+    //绑定在当前线程共享栈上还没有析构的协程数，不为0时线程不能退出
+    static size_t SharedStackFibers();
+    //从当前线程的空闲列表里取一个结束了的协程，用reset换上新的回调函数，没有时新建一个默认栈大小的协程
+    static Fiber::ptr Create(std::function<void()> cb);
+    //协程结束之后放回当前线程的空闲列表，只有fiber是最后一个引用时才会放回，否则只是释放引用
+    static void Recycle(Fiber::ptr& fiber);
+    //分配一个协程局部存储的槽位，deleter用于释放槽位上的值
+    static size_t AllocLocalSlot(void (*deleter)(void*));
+    //当前协程在槽位上的值，没有设置过返回nullptr
+    static void* GetLocal(size_t slot) {
+        Fiber* cur = GetCurrent();
+        return slot < cur->m_locals.size() ? cur->m_locals[slot] : nullptr;
+    }
+    //设置当前协程在槽位上的值，原来的值用槽位的deleter释放
+    static void SetLocal(size_t slot, void* value);
     //协程的主函数。
     static void MainFunc();
     //调用者的主函数。
     static void CallerMainFunc();
     //获取当前协程的唯一标识符。
     static uint64_t GetFiberId();
+private:
+    //第一次切入时分配栈
+    void allocStack();
+    //从INIT状态切入前准备上下文，需要统计栈用量时先涂栈
+    void prepareStack();
+    //释放所有协程局部存储的值
+    void clearLocals();
+    //当前协程的裸指针，不增加引用计数，线程还没有协程时创建主协程
+    static Fiber* GetCurrent();
+    //共享栈的协程切入前把栈内容拷贝回共享栈，切出后把用到的部分拷贝出来
+    void loadSharedStack();
+    void saveSharedStack();
 private:
     uint64_t m_id = 0;
     uint32_t m_stacksize = 0;
-    State m_state = INIT;
+    //run()保存完上下文后才写HOLD，其他线程读到非EXEC时保证能看到切出时保存的上下文
+    std::atomic<State> m_state{INIT};
+    //取任务时因为协程还没切出来而跳过它的工作线程，切出完成后要叫醒它
+    std::atomic<int> m_skipped{-1};
+    int m_priority = 1; //最近一次被调度执行时的优先级，见 Scheduler::Priority
+    uint64_t m_deadline = 0; //截止时间，见 Scheduler::scheduleWithDeadline
 
-    ucontext_t m_ctx;
+    FiberContext m_ctx;
     void* m_stack = nullptr;
+    bool m_useCaller = false;
+    StackProfile* m_profile = nullptr;
+    const char* m_tag = nullptr;
+    bool m_useSharedStack = false;
+    int m_thread = -1;  //共享栈的协程第一次执行的线程id
+    std::shared_ptr<SharedStack> m_sharedStack;
+    char* m_saved = nullptr;  //切出时拷贝出来的栈内容
+    size_t m_savedSize = 0;
+    size_t m_savedCapacity = 0;
     //协程的回调函数，即协程的执行体。
     std::function<void()> m_cb;
+    //协程局部存储，下标是槽位
+    std::vector<void*> m_locals;
 };
 
 }
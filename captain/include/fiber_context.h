@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+
+/* 协程上下文切换
+1、编译时打开 CAPTAIN_FIBER_ASM 并且是 x86-64 / aarch64 时使用手写汇编，只保存调用约定里
+   被调用者保存的寄存器和栈指针，切换不经过内核
+2、否则退回 ucontext。glibc 的 swapcontext 每次都会调用 rt_sigprocmask 保存恢复信号掩码，
+   每次切换都是一次系统调用
+3、汇编实现不再按协程保存信号掩码，协程里修改的信号掩码属于所在的线程
+ */
+#if defined(CAPTAIN_FIBER_ASM) && (defined(__x86_64__) || defined(__aarch64__))
+#define CAPTAIN_FIBER_USE_ASM 1
+#else
+#include <ucontext.h>
+#endif
+
+namespace captain {
+
+#ifdef CAPTAIN_FIBER_USE_ASM
+extern "C" void captain_swap_context(void** from_sp, void* to_sp);
+
+struct FiberContext {
+    //寄存器都压在协程自己的栈上，这里只记录切出时的栈顶
+    void* sp = nullptr;
+};
+#else
+struct FiberContext {
+    ucontext_t uc;
+};
+#endif
+
+//后端名字，用于日志和测试输出
+const char* FiberContextBackend();
+
+//在[stack, stack + size)上准备一个从entry开始执行的上下文，entry不能返回
+void MakeFiberContext(FiberContext* ctx, void* stack, size_t size, void (*entry)());
+
+//把当前的执行现场保存到from，切换到to
+#ifdef CAPTAIN_FIBER_USE_ASM
+inline void SwapFiberContext(FiberContext* from, FiberContext* to) {
+    captain_swap_context(&from->sp, to->sp);
+}
+#else
+void SwapFiberContext(FiberContext* from, FiberContext* to);
+#endif
+
+}
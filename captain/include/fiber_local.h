@@ -0,0 +1,55 @@
+#pragma once
+
+#include "fiber.h"
+#include "noncopyable.h"
+
+namespace captain {
+
+/* 协程局部存储
+1、每个FiberLocal对象在构造时分配一个全局的槽位下标，每个协程按下标存一个指针，访问是O(1)的数组下标，不加锁
+2、值跟着协程走，协程在线程之间迁移之后仍然能拿到，thread_local做不到
+3、协程reset（包括复用）和析构时释放所有槽位上的值
+4、槽位不会回收，FiberLocal一般定义成静态变量或全局变量，总数不超过 Fiber::MAX_LOCAL_SLOTS
+5、不在协程中时使用线程的主协程
+ */
+template<class T>
+class FiberLocal : Noncopyable {
+public:
+    FiberLocal()
+        :m_slot(Fiber::AllocLocalSlot(&FiberLocal::Delete)) {
+    }
+
+    //当前协程上的值，没有设置过返回nullptr
+    T* get() const {
+        return static_cast<T*>(Fiber::GetLocal(m_slot));
+    }
+
+    //当前协程上的值，没有设置过时默认构造一个
+    T& operator*() const {
+        T* v = get();
+        if(!v) {
+            v = new T();
+            Fiber::SetLocal(m_slot, v);
+        }
+        return *v;
+    }
+
+    T* operator->() const { return &**this;}
+
+    //替换当前协程上的值，原来的值被释放，传入nullptr表示清除
+    void reset(T* v = nullptr) const {
+        Fiber::SetLocal(m_slot, v);
+    }
+
+    void set(const T& v) const {
+        reset(new T(v));
+    }
+private:
+    static void Delete(void* p) {
+        delete static_cast<T*>(p);
+    }
+private:
+    size_t m_slot;
+};
+
+}
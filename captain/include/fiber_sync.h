@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include "fiber.h"
+#include "thread.h"
+#include "noncopyable.h"
+
+namespace captain {
+
+class Scheduler;
+
+/* 协程同步原语
+thread.h 里的锁和信号量在协程里使用时会阻塞整个工作线程，这里的几个类在竞争时只挂起当前协程：
+1、等待者把自己的 Fiber::ptr 和所属的调度器挂到等待队列上，然后切回调度器，线程去执行其他任务
+2、唤醒时把所有权直接交给等待者，再通过它自己的调度器重新调度，竞争的代价是一次协程切换
+3、只能在调度器的协程里等待，唤醒（unlock、notify）可以在任意线程调用
+ */
+
+//等待队列的节点，放在等待协程的栈上，挂起期间一直有效，不需要分配内存
+struct FiberWaiter {
+    Scheduler* scheduler = nullptr;
+    Fiber::ptr fiber;
+    FiberWaiter* next = nullptr;
+
+    //把当前协程登记到节点上，只能在调度器执行的协程里等待
+    void init();
+    //把协程交还给它的调度器，调用时不能持有等待队列的锁
+    void wake();
+    //挂起当前协程直到被wake()
+    static void Suspend();
+};
+
+//FiberWaiter 的单向链表，不负责加锁
+class FiberWaitQueue : Noncopyable {
+public:
+    bool empty() const { return m_head == nullptr;}
+    void push_back(FiberWaiter* waiter);
+    FiberWaiter* pop_front();
+private:
+    FiberWaiter* m_head = nullptr;
+    FiberWaiter* m_tail = nullptr;
+};
+
+//协程互斥锁，解锁时锁直接交给等待最久的协程，不会被后来的协程抢走
+class FiberMutex : Noncopyable {
+public:
+    typedef ScopedLockImpl<FiberMutex> Lock;
+
+    bool tryLock();
+    void lock();
+    void unlock();
+private:
+    friend class FiberCondition;
+    typedef Spinlock MutexType;
+    MutexType m_mutex;
+    bool m_locked = false;
+    FiberWaitQueue m_waiters;
+};
+
+//协程信号量
+class FiberSemaphore : Noncopyable {
+public:
+    FiberSemaphore(size_t count = 0);
+
+    bool tryWait();
+    void wait();
+    void notify();
+
+    size_t getCount() const { return m_count;}
+private:
+    typedef Spinlock MutexType;
+    MutexType m_mutex;
+    size_t m_count;
+    FiberWaitQueue m_waiters;
+};
+
+//协程条件变量，和 FiberMutex 配合使用
+class FiberCondition : Noncopyable {
+public:
+    //调用时必须持有lock，挂起期间释放，被唤醒后重新加锁再返回
+    void wait(FiberMutex::Lock& lock);
+    void notify();
+    void notifyAll();
+private:
+    typedef Spinlock MutexType;
+    MutexType m_mutex;
+    FiberWaitQueue m_waiters;
+};
+
+//等待一组协程结束：启动前add()，结束时done()，wait()挂起直到计数归零
+class WaitGroup : Noncopyable {
+public:
+    WaitGroup(int count = 0);
+
+    void add(int count = 1);
+    void done() { add(-1);}
+    void wait();
+
+    int getCount() const { return m_count;}
+private:
+    typedef Spinlock MutexType;
+    MutexType m_mutex;
+    std::atomic<int> m_count;   //在锁里修改，getCount()可以不加锁读
+    FiberWaitQueue m_waiters;
+};
+
+//协程读写锁，写优先：有写者在等待时新的读者也要等待，写锁释放时先放行所有等待的读者
+class FiberRWMutex : Noncopyable {
+public:
+    typedef ReadScopedLockImpl<FiberRWMutex> ReadLock;
+    typedef WriteScopedLockImpl<FiberRWMutex> WriteLock;
+
+    void rdlock();
+    void wrlock();
+    void unlock();
+private:
+    typedef Spinlock MutexType;
+    MutexType m_mutex;
+    uint32_t m_readers = 0;   //持有读锁的协程数
+    bool m_writer = false;    //是否有协程持有写锁
+    FiberWaitQueue m_readerWaiters;
+    FiberWaitQueue m_writerWaiters;
+};
+
+}
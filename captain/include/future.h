@@ -0,0 +1,236 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include "fiber_sync.h"
+#include "scheduler.h"
+
+namespace captain {
+
+/* FutureStateBase
+Future 和 Promise 共享的状态中和结果类型无关的部分。
+1、get()/wait() 在结果没准备好时挂起当前协程，完成时通过协程自己的调度器重新调度
+2、then() 注册的回调在完成的线程上执行，when_all/when_any 基于它实现
+ */
+class FutureStateBase : Noncopyable {
+public:
+    typedef std::shared_ptr<FutureStateBase> ptr;
+
+    virtual ~FutureStateBase() {}
+
+    bool isReady() const { return m_status == READY;}
+    //挂起当前协程直到结果准备好
+    void wait();
+    //结果准备好之后执行cb，已经准备好了就马上执行
+    void then(std::function<void()> cb);
+    //结果是异常时重新抛出
+    void rethrow() const;
+
+    //设置异常，已经设置过结果返回false
+    bool setException(std::exception_ptr e);
+protected:
+    //抢到设置结果的权利，之后在锁外写入结果再调用complete()
+    bool claim();
+    //标记为完成，唤醒所有等待者并执行回调
+    void complete();
+private:
+    enum Status {
+        PENDING,
+        SETTING,
+        READY,
+    };
+    typedef Spinlock MutexType;
+    MutexType m_mutex;
+    std::atomic<int> m_status = {PENDING};
+    std::exception_ptr m_exception;
+    FiberWaitQueue m_waiters;
+    std::vector<std::function<void()> > m_callbacks;
+};
+
+template<class T>
+class FutureState : public FutureStateBase {
+public:
+    typedef std::shared_ptr<FutureState> ptr;
+
+    ~FutureState() {
+        if(m_hasValue) {
+            reinterpret_cast<T*>(&m_storage)->~T();
+        }
+    }
+
+    template<class U>
+    bool setValue(U&& v) {
+        if(!claim()) {
+            return false;
+        }
+        new (&m_storage) T(std::forward<U>(v));
+        m_hasValue = true;
+        complete();
+        return true;
+    }
+
+    const T& get() {
+        wait();
+        rethrow();
+        return *reinterpret_cast<T*>(&m_storage);
+    }
+private:
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type m_storage;
+    bool m_hasValue = false;
+};
+
+template<>
+class FutureState<void> : public FutureStateBase {
+public:
+    typedef std::shared_ptr<FutureState> ptr;
+
+    bool setValue() {
+        if(!claim()) {
+            return false;
+        }
+        complete();
+        return true;
+    }
+
+    void get() {
+        wait();
+        rethrow();
+    }
+};
+
+/* Future
+异步结果的读取端，可以拷贝，多个协程可以同时等待同一个结果。
+ */
+template<class T>
+class Future {
+public:
+    typedef typename FutureState<T>::ptr StatePtr;
+    typedef typename std::add_lvalue_reference<const T>::type GetType;
+
+    Future() {}
+    explicit Future(StatePtr state)
+        :m_state(state) {
+    }
+
+    bool valid() const { return !!m_state;}
+    bool isReady() const { return m_state->isReady();}
+    void wait() const { m_state->wait();}
+    //挂起直到结果准备好，返回结果的引用（在Future销毁之前有效），结果是异常时重新抛出
+    GetType get() const { return m_state->get();}
+    void then(std::function<void()> cb) const { m_state->then(std::move(cb));}
+
+    const StatePtr& getState() const { return m_state;}
+private:
+    StatePtr m_state;
+};
+
+/* Promise
+异步结果的写入端，结果只能设置一次，之后的设置返回false。
+可以拷贝，方便放进回调函数里。
+ */
+template<class T>
+class Promise {
+public:
+    Promise()
+        :m_state(std::make_shared<FutureState<T> >()) {
+    }
+
+    Future<T> getFuture() const { return Future<T>(m_state);}
+
+    bool setValue(const T& v) { return m_state->setValue(v);}
+    bool setValue(T&& v) { return m_state->setValue(std::move(v));}
+    bool setException(std::exception_ptr e) { return m_state->setException(e);}
+private:
+    typename FutureState<T>::ptr m_state;
+};
+
+template<>
+class Promise<void> {
+public:
+    Promise()
+        :m_state(std::make_shared<FutureState<void> >()) {
+    }
+
+    Future<void> getFuture() const { return Future<void>(m_state);}
+
+    bool setValue() { return m_state->setValue();}
+    bool setException(std::exception_ptr e) { return m_state->setException(e);}
+private:
+    FutureState<void>::ptr m_state;
+};
+
+//所有状态都完成（包括异常）时完成，各自的结果从原来的Future里取
+Future<void> WhenAll(const std::vector<FutureStateBase::ptr>& states);
+//任意一个状态完成时完成，结果是它的下标
+Future<size_t> WhenAny(const std::vector<FutureStateBase::ptr>& states);
+
+template<class T>
+Future<void> when_all(const std::vector<Future<T> >& futures) {
+    std::vector<FutureStateBase::ptr> states;
+    for(auto& i : futures) {
+        states.push_back(i.getState());
+    }
+    return WhenAll(states);
+}
+
+template<class... Ts>
+Future<void> when_all(const Future<Ts>&... futures) {
+    return WhenAll({futures.getState()...});
+}
+
+template<class T>
+Future<size_t> when_any(const std::vector<Future<T> >& futures) {
+    std::vector<FutureStateBase::ptr> states;
+    for(auto& i : futures) {
+        states.push_back(i.getState());
+    }
+    return WhenAny(states);
+}
+
+template<class... Ts>
+Future<size_t> when_any(const Future<Ts>&... futures) {
+    return WhenAny({futures.getState()...});
+}
+
+//执行cb并把返回值或异常写入promise
+template<class T, class F>
+void FulfillPromise(Promise<T>& promise, F& cb) {
+    try {
+        promise.setValue(cb());
+    } catch(...) {
+        promise.setException(std::current_exception());
+    }
+}
+
+template<class F>
+void FulfillPromise(Promise<void>& promise, F& cb) {
+    try {
+        cb();
+        promise.setValue();
+    } catch(...) {
+        promise.setException(std::current_exception());
+    }
+}
+
+//在scheduler上新起一个协程执行cb，返回它的结果。用来把几个后端调用并行发出去：
+//    auto a = async_call(iom, [](){ return queryA();});
+//    auto b = async_call(iom, [](){ return queryB();});
+//    when_all(a, b).wait();
+template<class F>
+Future<typename std::result_of<F()>::type> async_call(Scheduler* scheduler, F cb
+                , Scheduler::Priority priority = Scheduler::DEFAULT) {
+    typedef typename std::result_of<F()>::type R;
+    Promise<R> promise;
+    Future<R> future = promise.getFuture();
+    scheduler->schedule([promise, cb]() mutable {
+        FulfillPromise(promise, cb);
+    }, -1, priority);
+    return future;
+}
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "thread.h"
+#include "noncopyable.h"
+
+namespace captain {
+
+/* io_uring的最小封装，直接用系统调用，不依赖liburing
+1、提交队列由多个线程共享，submit加锁，填好请求之后立即提交
+2、完成队列只能由一个线程消费，IOManager里是当前的轮询线程
+3、需要内核支持IORING_FEAT_EXT_ARG（5.11），等待完成事件时直接带超时
+ */
+class IoUring : Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    IoUring();
+    ~IoUring();
+
+    //entries 提交队列的大小，失败返回false，errno是原因
+    bool init(uint32_t entries);
+    int getFd() const { return m_fd;}
+
+    //把一个请求放进提交队列并提交，0成功，失败返回-errno，失败时请求不会留在队列里
+    int submit(const io_uring_sqe& sqe);
+    //等待至少一个完成事件，timeout_ms为~0ull表示一直等。0成功，失败返回-errno，超时是-ETIME
+    int wait(uint64_t timeout_ms);
+    //把完成队列里的事件拷贝出来并移出队列，最多count个，返回个数
+    int reap(io_uring_cqe* cqes, int count);
+private:
+    int m_fd = -1;
+    MutexType m_mutex;   //保护提交队列
+
+    void* m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    void* m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+    unsigned* m_sqArray = nullptr;
+
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+};
+
+}
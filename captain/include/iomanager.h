@@ -3,25 +3,42 @@
 #include "scheduler.h"
 #include "timer.h"
 
+struct epoll_event;
+struct io_uring_cqe;
+
 namespace captain {
 
+class IoUring;
+
 class IOManager : public Scheduler, public TimerManager {
 public:
     typedef std::shared_ptr<IOManager> ptr;
-    typedef RWMutex RWMutexType;
 
     enum Event {
         NONE    = 0x0,
         READ    = 0x1, //EPOLLIN  读事件
         WRITE   = 0x4, //EPOLLOUT 写事件
     };
+
+    //io_uring后端直接提交的IO操作，字段的含义同io_uring_sqe
+    struct IoRequest {
+        uint8_t opcode = 0;
+        void* addr = nullptr;
+        uint32_t len = 0;
+        uint64_t addr2 = 0;   //accept的addrlen
+        uint32_t flags = 0;   //msg_flags或者accept_flags
+    };
 private:
-    struct FdContext {
+    //对齐到缓存行，相邻句柄的上下文在不同线程上加锁、修改时不会互相影响
+    struct alignas(64) FdContext {
         typedef Mutex MutexType;
         struct EventContext {
             Scheduler* scheduler = nullptr; //事件执行的scheduler
             Fiber::ptr fiber;               //事件协程
             std::function<void()> cb;       //事件的回调函数
+            int* result = nullptr;          //io_uring直接提交的操作，完成时写入结果
+            uint16_t seq = 0;               //io_uring的注册序号，区分已经删除的注册的完成事件
+            int thread = -1;                //分片模式下协程恢复执行的线程
         };
 
         EventContext& getContext(Event event);
@@ -32,16 +49,28 @@ private:
         EventContext write;     //写事件
         int fd = 0;             //事件关联的句柄
         Event events = NONE;    //已经注册的事件
+        Event ready = NONE;     //epoll报告过、还没有协程等待的方向
+        bool registered = false; //已经加入过epoll，两个方向边沿触发
+        uint64_t generation = 0; //加入epoll时句柄的代数（FdCtx::getGeneration），变了说明句柄关掉之后号被复用了
+        int owner = -1;         //分片模式下负责这个句柄的工作线程下标
         MutexType mutex;
     };
 
 public:
     //IOManager构造函数的签名和Scheduler的一样
-    IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "");
+    IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = ""
+            , size_t max_threads = 0);
     ~IOManager();
 
     //0 success, -1 error
     int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+    //io_uring后端：把IO操作直接提交给内核，当前协程在完成时被唤醒，结果（失败时是-errno）写到result。
+    //和addEvent一样占用fd上event方向的注册，可以用cancelEvent取消。0 success, -1 error
+    int submitIO(int fd, Event event, const IoRequest& req, int* result);
+    //是否使用io_uring后端，见 iomanager.backend
+    bool useIoUring() const { return m_ring != nullptr;}
+    //是否每个工作线程一个epoll，见 iomanager.sharded
+    bool isSharded() const { return !m_shardFds.empty();}
     bool delEvent(int fd, Event event);
     bool cancelEvent(int fd, Event event);
 
@@ -49,25 +78,107 @@ public:
 
     static IOManager* GetThis(); //获取当前的IOManager
 
+    //空闲线程的统计，用来调整 iomanager.spin_count
+    struct IdleStats {
+        uint64_t spinHits = 0;        //自旋期间等到任务的次数
+        uint64_t parks = 0;           //在自己的eventfd上休眠的次数
+        uint64_t polls = 0;           //阻塞在epoll_wait上的次数
+        uint64_t wakeups = 0;         //写eventfd唤醒线程的次数
+        uint64_t spuriousWakeups = 0; //醒来之后没有任何事情可做的次数
+    };
+    IdleStats getIdleStats() const;
+
+    static const int EVENTS_HISTOGRAM_SIZE = 16;
+    //每次等到IO事件醒来之后处理的事件数，用来调整 iomanager.max_events
+    struct EventStats {
+        uint64_t fullBatches = 0;  //取满一批的次数，每次都让那个线程的下一批翻倍
+        //histogram[0]是没有IO事件的唤醒（超时或者只被tickle），histogram[i]是处理了[2^(i-1), 2^i)个事件，
+        //最后一个桶包括更多的
+        std::vector<uint64_t> histogram;
+    };
+    EventStats getEventStats() const;
+
 protected:
     //实现Scheduler里的三个虚方法
     void tickle() override;
     bool stopping() override;
     void idle() override;
 
+    void tickleWorker(size_t worker) override;
+    void waitForWakeup(int worker) override;
+    void wakeup(int worker) override;
+
     void onTimerInsertedAtFront() override;
 
-    void contextResize(size_t size);
     bool stopping(uint64_t& timeout);
+private:
+    //自旋等待任务，等到了返回true。claimed表示已经计入了自旋线程数
+    bool spin(bool claimed);
+    //接过tickle()替被唤醒线程占的自旋名额
+    bool takeWakeClaim();
+    //轮询线程阻塞在epoll_wait里时唤醒它，没有轮询线程返回false
+    bool wakePoller();
+
+    int registerEvent(int fd, Event event, std::function<void()> cb
+            , const IoRequest* req, int* result);
+    //句柄的上下文，create为true时所在的段不存在就创建。句柄超出范围返回nullptr
+    FdContext* getFdContext(int fd, bool create);
+    //分配和释放一段句柄上下文
+    static FdContext* CreateSegment(int first_fd);
+    static void DestroySegment(FdContext* segment);
+    //句柄注册在哪个epoll上
+    int epollFdOf(FdContext* fd_ctx) const {
+        return m_shardFds.empty() ? m_epfd : m_shardFds[fd_ctx->owner];
+    }
+    //分片模式下为第一次注册的句柄选择负责的工作线程
+    void assignOwner(FdContext* fd_ctx);
+    //分片模式下空闲线程在自己的epoll上等待并处理就绪的事件
+    void pollShard(int worker);
+    //io_uring后端：提交poll或者IO操作，取消已经提交的请求
+    bool ringSubmit(FdContext* fd_ctx, Event event, uint16_t seq, const IoRequest* req);
+    void ringCancel(FdContext* fd_ctx, Event event);
+    //io_uring后端：监听唤醒用的eventfd
+    void ringArmTickle();
+    //等待IO事件，返回就绪的个数
+    int waitEpoll(int epfd, epoll_event* events, int count, uint64_t timeout);
+    int waitRing(io_uring_cqe* cqes, int count, uint64_t timeout);
+    //处理就绪的IO事件，返回触发的事件数，tickled表示收到了wake_fd上的唤醒
+    int processEpoll(int wake_fd, epoll_event* events, int count, bool& tickled);
+    int processRing(io_uring_cqe* cqes, int count, bool& tickled);
+    //记录一次等待取出的事件数和处理的IO事件数，批取满时本线程的下一批翻倍
+    void recordBatch(int count, int batch, int io_events);
 private:
     int m_epfd = 0;    //epoll 的 fd
-    //一个包含两个整数的数组，用于创建一个管道，用于唤醒事件循环线程
-    //其中一个文件描述符用于写入数据（m_tickleFds[0]），另一个用于读取数据（m_tickleFds[1]）。
-    int m_tickleFds[2]; //pipe的一个传入参数
+    IoUring* m_ring = nullptr;  //io_uring后端，为空时使用epoll
+    bool m_tickleMultishot = true; //唤醒用的poll是否多次触发，内核不支持（5.13之前）时改成每次重新提交
+    //分片模式下每个工作线程一个epoll，句柄只注册在负责它的线程的epoll上，
+    //事件就绪后协程也回到这个线程执行，句柄和连接的状态不会在线程之间来回传递
+    std::vector<int> m_shardFds;
+    //同一时刻只有一个空闲线程（轮询线程）阻塞在epoll_wait上，其余空闲线程在自己的eventfd上休眠，
+    //这样tickle()只会唤醒一个指定的线程，不会所有空闲线程一起醒来
+    int m_tickleFd = -1;             //注册在epoll里，用于唤醒轮询线程
+    std::vector<int> m_wakeFds;      //每个工作线程一个eventfd
+    std::atomic<int> m_poller = {-1};  //轮询线程的下标，-1表示没有
+    std::atomic<bool> m_pollerNotified = {false}; //已经写过m_tickleFd，合并重复的唤醒
+    std::atomic<int> m_spinning = {0};  //正在自旋等待任务的线程数
+    std::atomic<int> m_wakeClaims = {0};  //tickle()替被唤醒线程占的自旋名额
+
+    std::atomic<uint64_t> m_spinHits = {0};
+    std::atomic<uint64_t> m_parks = {0};
+    std::atomic<uint64_t> m_polls = {0};
+    std::atomic<uint64_t> m_wakeups = {0};
+    std::atomic<uint64_t> m_spuriousWakeups = {0};
+    std::atomic<uint64_t> m_fullBatches = {0};
+    std::atomic<uint64_t> m_eventsHistogram[EVENTS_HISTOGRAM_SIZE];
 
     std::atomic<size_t> m_pendingEventCount = {0};  //正在等待执行的事件数量
-    RWMutexType m_mutex;
-    std::vector<FdContext*> m_fdContexts;  //用于存放文件描述符的上下文信息
+    /* 句柄上下文表，两级的分段数组
+    1、每段 FD_SEGMENT_SIZE 个上下文，第一次用到时分配，原子地发布到段表里，之后不再移动和释放
+    2、查找不加锁，扩容只是发布一个新的段，不会阻塞其他线程的查找
+     */
+    static const size_t FD_SEGMENT_SIZE = 256;
+    static const size_t FD_SEGMENT_COUNT = 4096;  //最多支持 FD_SEGMENT_SIZE * FD_SEGMENT_COUNT 个句柄
+    std::atomic<FdContext*> m_fdSegments[FD_SEGMENT_COUNT];
 };
 
 }
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include "scheduler.h"
+
+namespace captain {
+
+/* 并行算法
+在调度器上递归地切分区间：
+1、区间大于粒度时对半切开，右半部分压进共享的待处理栈并投递一个任务去取它，自己继续处理左半部分
+2、调用者处理完自己的部分之后从栈里取剩下的区间来做，而不是空等，最后等待别的线程上还在处理的区间
+3、调用者可以是调度器里的协程（等待时挂起），也可以是普通线程（等待时让出CPU）
+4、区间处理函数抛出的第一个异常在调用者里重新抛出
+ */
+
+//对[begin, end)做并行切分，body处理一个不再切分的子区间[b, e)。grain为0时按线程数自动选择
+void ParallelInvoke(Scheduler* scheduler, size_t begin, size_t end, size_t grain
+                , const std::function<void(size_t, size_t)>& body);
+
+//对[begin, end)中的每个i执行f(i)
+template<class F>
+void parallel_for(Scheduler* scheduler, size_t begin, size_t end, F f, size_t grain = 0) {
+    ParallelInvoke(scheduler, begin, end, grain, [&f](size_t b, size_t e) {
+        for(size_t i = b; i < e; ++i) {
+            f(i);
+        }
+    });
+}
+
+//map(b, e, init) 把子区间[b, e)的结果累加到init上并返回，combine合并两个子区间的结果。
+//子区间的合并顺序不固定，combine需要满足结合律和交换律
+template<class T, class Map, class Combine>
+T parallel_reduce(Scheduler* scheduler, size_t begin, size_t end, T identity
+                , Map map, Combine combine, size_t grain = 0) {
+    Spinlock mutex;
+    T result = identity;
+    ParallelInvoke(scheduler, begin, end, grain, [&](size_t b, size_t e) {
+        T partial = map(b, e, identity);
+        Spinlock::Lock lock(mutex);
+        result = combine(result, partial);
+    });
+    return result;
+}
+
+//先把区间分块并行排序，再一轮一轮两两并行归并
+template<class RandomIt, class Compare>
+void parallel_sort(Scheduler* scheduler, RandomIt first, RandomIt last, Compare comp
+                , size_t grain = 0) {
+    size_t n = last - first;
+    //块数取2的幂，每轮归并都能两两配对
+    size_t workers = scheduler->getThreadCount() + 1;
+    size_t blocks = 1;
+    while(blocks < workers * 2 && n / (blocks * 2) >= std::max(grain, (size_t)1024)) {
+        blocks *= 2;
+    }
+    if(blocks == 1) {
+        std::sort(first, last, comp);
+        return;
+    }
+    auto bound = [first, n, blocks](size_t i) {
+        return first + n * i / blocks;
+    };
+    ParallelInvoke(scheduler, 0, blocks, 1, [&](size_t b, size_t e) {
+        for(size_t i = b; i < e; ++i) {
+            std::sort(bound(i), bound(i + 1), comp);
+        }
+    });
+    for(size_t width = 1; width < blocks; width *= 2) {
+        ParallelInvoke(scheduler, 0, blocks / (width * 2), 1, [&](size_t b, size_t e) {
+            for(size_t i = b; i < e; ++i) {
+                size_t lo = i * width * 2;
+                std::inplace_merge(bound(lo), bound(lo + width), bound(lo + width * 2), comp);
+            }
+        });
+    }
+}
+
+template<class RandomIt>
+void parallel_sort(Scheduler* scheduler, RandomIt first, RandomIt last, size_t grain = 0) {
+    typedef typename std::iterator_traits<RandomIt>::value_type T;
+    parallel_sort(scheduler, first, last, std::less<T>(), grain);
+}
+
+}
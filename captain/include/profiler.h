@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+namespace captain {
+
+/* 认识协程的CPU采样分析器
+1、用ITIMER_PROF定时器按CPU时间发SIGPROF，信号落在正在消耗CPU的线程上
+2、信号处理函数记录当前协程id、入口标签（Fiber::setTag）和调用栈，写进当前线程自己的环形缓冲区，
+   不加锁也不分配内存；缓冲区满了丢弃样本并计数
+3、Dump时把各线程的缓冲区取出来合并，输出folded stack格式，可以直接交给flamegraph.pl，
+   每行的第一帧是协程的入口标签，没有标签的任务协程是"fiber"，线程自己的栈是"thread"
+4、profiler.enable 在运行时打开关闭，不需要重启；也可以直接调用Start/Stop
+5、缓冲区每个线程最多 BUFFER_SAMPLES 个样本，采样期间需要定期Dump，否则会丢样本
+ */
+class Profiler {
+public:
+    //每个样本最多记录的栈帧数
+    static const int MAX_FRAMES = 64;
+    //每个线程缓冲区的样本数
+    static const uint32_t BUFFER_SAMPLES = 1024;
+
+    //开始采样，hz为每秒CPU时间的采样次数，0使用 profiler.hz
+    static bool Start(uint32_t hz = 0);
+    static void Stop();
+    static bool IsRunning();
+    //取出所有线程缓冲区里的样本，返回开始采样以来累计的folded stack。
+    //per_fiber为true时在入口标签下面再按协程id分开
+    static std::string Dump(bool per_fiber = false);
+    //清除累计的样本
+    static void Reset();
+    //累计的样本数和因为缓冲区满了丢弃的样本数
+    static uint64_t GetSamples();
+    static uint64_t GetDropped();
+
+    //把入口标签转换成进程内一直有效的字符串，同样的名字返回同一个指针，用于 Fiber::setTag
+    static const char* Tag(const std::string& name);
+};
+
+}
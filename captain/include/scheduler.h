@@ -3,7 +3,9 @@
 #include <memory>
 #include <vector>
 #include <list>
+#include <atomic>
 #include "fiber.h"
+#include "task.h"
 #include "thread.h"
 
 namespace captain {
@@ -12,11 +14,26 @@ namespace captain {
 2、协程调度器，将协程制定到相应的线程上去执行。
  */
 class Scheduler {
+friend struct FiberWaiter;
+friend class ChannelBase;
 public:
     typedef std::shared_ptr<Scheduler> ptr;
     typedef Mutex MutexType;
+
+    //任务的优先级，数值越小越先执行
+    enum Priority {
+        DEFAULT = -1,       //协程沿用上次执行时的优先级，回调函数为NORMAL
+        CRITICAL = 0,       //延迟敏感的任务，比如处理请求
+        NORMAL = 1,
+        BACKGROUND = 2,     //后台维护任务，比如刷日志、健康检查
+    };
+    static const int PRIORITY_COUNT = 3;
     //use_caller：在某个线程执行了协程调度器的构造函数的时候，如果设置use_caller = true,意味着该线程也会纳入协程调度器中
-    Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = "");
+    //max_threads大于threads时线程数可以在[threads, max_threads]之间伸缩：
+    //任务排队时间超过 scheduler.grow_latency_ms 并且没有空闲线程时增加线程，
+    //线程空闲超过 scheduler.shrink_idle_ms 时退出，两个数都包括use_caller线程
+    Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = ""
+            , size_t max_threads = 0);
     virtual ~Scheduler();
 
     const std::string& getName() const { return m_name;}
@@ -26,36 +43,80 @@ public:
 
     void start();
     void stop();
+
+    //当前协程的截止时间，没有返回0
+    static uint64_t GetDeadline();
+    //当前协程是否已经错过了截止时间，可以据此提前放弃后面的工作
+    static bool IsDeadlineExpired();
+    //执行时已经错过截止时间的任务数，以及其中被丢弃的任务数
+    uint64_t getExpiredCount() const { return m_expiredCount;}
+    uint64_t getDroppedCount() const { return m_droppedCount;}
+
+    //线程池的状态，不包括use_caller线程
+    size_t getThreadCount() const { return m_threadCount;}
+    size_t getMinThreads() const { return m_minThreads;}
+    size_t getMaxThreads() const { return m_maxThreads;}
+    size_t getActiveThreadCount() const { return m_activeThreadCount;}
+    size_t getIdleThreadCount() const { return m_idleThreadCount;}
+    //扩容和缩容的次数
+    uint64_t getGrowCount() const { return m_growCount;}
+    uint64_t getShrinkCount() const { return m_shrinkCount;}
+    //看门狗发现的长时间不让出线程的次数。看门狗默认关闭，scheduler.stall_threshold_ms大于0时开启，
+    //用SIGURG打断卡住的线程采集调用栈；进程自己处理了SIGURG时不覆盖，只报告不采集调用栈
+    uint64_t getStallCount() const { return m_stallCount;}
+    //挂起在协程同步原语、通道、Future上的协程数，它们被唤醒之前stop()不会返回
+    size_t getSuspendedCount() const { return m_suspendedCount;}
     //用于将任务（协程或回调函数）（单个）添加到调度器的任务队列，并触发调度器唤醒（tickle）以执行任务。
+    //在本调度器的工作线程里调用时放入该线程的本地队列，否则放入全局注入队列。
+    //任务节点和小回调函数都不需要堆内存，传入右值或指针可以避免 Fiber::ptr 的引用计数变化
+    //高优先级的任务先执行，低优先级的任务每隔 scheduler.starvation_interval 次会排到最前面一次
     template<class FiberOrCb>
-    void schedule(FiberOrCb fc, int thread = -1) {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            need_tickle = scheduleNoLock(fc, thread);
+    void schedule(FiberOrCb&& fc, int thread = -1, Priority priority = DEFAULT) {
+        Task* task = Task::Create(std::forward<FiberOrCb>(fc), thread);
+        if(!task) {
+            return;
         }
-
-        if(need_tickle) {
+        task->priority = priority;
+        if(push(task)) {
+            tickle();
+        }
+    }
+    //带截止时间的任务，deadline是 GetCurrentMS() 时钟下的绝对时间（毫秒），和定时器用同一个时钟。
+    //这类任务按CRITICAL优先级处理，并且按截止时间从早到晚执行（EDF），
+    //已经过期的任务按 scheduler.drop_expired 的配置丢弃或者照常执行
+    template<class FiberOrCb>
+    void scheduleWithDeadline(FiberOrCb&& fc, uint64_t deadline, int thread = -1) {
+        Task* task = Task::Create(std::forward<FiberOrCb>(fc), thread);
+        if(!task) {
+            return;
+        }
+        task->priority = CRITICAL;
+        task->deadline = deadline;
+        if(push(task)) {
             tickle();
         }
     }
     //用于将一系列任务（协程或回调函数）添加到调度器的任务队列，并触发调度器唤醒（tickle）以执行任务。
     template<class InputIterator>
-    void schedule(InputIterator begin, InputIterator end) {
+    void schedule(InputIterator begin, InputIterator end, Priority priority = DEFAULT) {
         bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            while(begin != end) {
-                need_tickle = scheduleNoLock(&*begin, -1) || need_tickle;
-                ++begin;
+        while(begin != end) {
+            Task* task = Task::Create(&*begin, -1);
+            if(task) {
+                task->priority = priority;
+                need_tickle = push(task) || need_tickle;
             }
+            ++begin;
         }
         if(need_tickle) {
             tickle();
         }
     }
 protected:
+    //唤醒一个正在休眠的工作线程
     virtual void tickle();
+    //唤醒指定的工作线程
+    virtual void tickleWorker(size_t worker);
     void run();  //协程调度器真正的执行函数
     virtual bool stopping(); //子类实现
     virtual void idle();//协程调度器没任务做时又不能让线程终止，就执行这个idle()函数。
@@ -63,61 +124,118 @@ protected:
     void setThis();
 
     bool hasIdleThreads() { return m_idleThreadCount > 0;}
-private:
-    //用于将要调度的任务（协程或回调函数）添加到调度器的任务队列（m_fibers 链表）中，并返回一个布尔值表示是否需要唤醒（tickle）调度器。
-    template<class FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, int thread) {
-        bool need_tickle = m_fibers.empty();
-        FiberAndThread ft(fc, thread);
-        if(ft.fiber || ft.cb) {
-            m_fibers.push_back(ft);
-        }
-        //如果返回值为 true，表示任务队列之前为空，现在有任务可供调度，因此调用者可能需要唤醒调度器以执行任务。
-        return need_tickle;
-    }
-private:
-    struct FiberAndThread {
-        Fiber::ptr fiber;
-        std::function<void()> cb;
-        int thread;  //线程id
-        //传入智能指针的对象  在栈上
-        FiberAndThread(Fiber::ptr f, int thr)
-            :fiber(f), thread(thr) {
-        }
-        //传入智能指针对象的指针（在堆上），swap掉智能指针，防止引用释放问题
-        FiberAndThread(Fiber::ptr* f, int thr)
-            :thread(thr) {
-            fiber.swap(*f);
-        }
-
-        FiberAndThread(std::function<void()> f, int thr)
-            :cb(f), thread(thr) {
-        }
 
-        FiberAndThread(std::function<void()>* f, int thr)
-            :thread(thr) {
-            cb.swap(*f);
-        }
-
-        FiberAndThread()
-            :thread(-1) {
-        }
+    //当前线程在调度器中的工作线程下标，不是工作线程返回-1
+    static int GetWorkerIndex();
+    //工作线程数量（包括use_caller线程）
+    size_t getWorkerCount() const { return m_workers.size();}
+    //工作线程当前的线程id，线程没有启动或者已经退出返回-1
+    int getWorkerThread(size_t worker) const { return m_workers[worker]->threadId;}
+    //当前工作线程是否有可以执行的任务，不包括指定给其他线程的任务
+    bool hasPendingTask();
 
-        void reset() {
-            fiber = nullptr;
-            cb = nullptr;
-            thread = -1;
-        }
+    //当前工作线程登记为休眠并等待唤醒，登记之后发现有任务就直接返回
+    void park();
+    //从休眠列表中取出一个工作线程并唤醒，没有休眠的线程返回false
+    bool wakeSleeper();
+    //唤醒指定的工作线程，它不在休眠返回false
+    bool wakeSleeper(size_t worker);
+    //当前线程空闲了足够长的时间并且线程数大于下限，应该退出idle()让线程结束
+    bool shouldRetire();
+    //当前线程可以休眠的最长时间（毫秒），超过之后需要检查shouldRetire()，~0ull表示不限
+    uint64_t getRetireTimeout();
+    //阻塞等待wakeup()，默认在futex上等待，超时也会返回
+    virtual void waitForWakeup(int worker);
+    //唤醒在waitForWakeup()中等待的工作线程
+    virtual void wakeup(int worker);
+private:
+    static const int STALL_FRAMES = 32;
+    //工作线程私有的任务队列，本线程从队头取任务，空闲线程从队尾窃取
+    struct WorkerQueue {
+        typedef Spinlock MutexType;
+        MutexType mutex;
+        TaskQueue fibers[PRIORITY_COUNT]; //每个优先级一个队列
+        TaskQueue mailbox; //指定在该线程执行的任务，不会被窃取
+        uint32_t ticks = 0; //取任务的次数，只有本线程访问，用于防止低优先级饿死
+        uint64_t idleSince = 0; //开始空闲的时间，只有本线程访问
+        bool retiring = false;  //空闲太久，线程正在退出
+        std::atomic<bool> running = {false}; //有线程在使用这个槽位（不包括use_caller线程）
+        std::atomic<int> threadId = {-1};   //该工作线程的线程id
+        std::atomic<int> parked = {0};      //futex字，1表示正在休眠
+        std::atomic<uint64_t> sliceStart = {0}; //当前任务协程swapIn的时间，0表示没有在执行任务
+        std::atomic<uint64_t> fiberId = {0};    //当前任务协程的id
+        uint64_t reported = 0;  //已经报告过的sliceStart，只有看门狗线程访问
+        void* frames[STALL_FRAMES]; //看门狗信号处理函数采集的调用栈
+        std::atomic<int> frameCount = {-1};
     };
+private:
+    //把任务放入本地队列或全局注入队列，返回是否需要tickle
+    bool push(Task* task);
+    //依次从本线程的信箱和本地队列、全局注入队列、其他线程的队列中取出一个任务
+    //同一优先级先看本地队列再看全局队列，高优先级都没有任务时再看低优先级
+    Task* pop();
+    //从本地队列和全局注入队列中取出一个指定优先级的任务
+    Task* popLane(WorkerQueue& self, int lane);
+    //本次取任务时各优先级的检查顺序
+    void laneOrder(WorkerQueue& self, int order[PRIORITY_COUNT]);
+    //取出截止时间最早的任务
+    Task* popDeadline();
+    //在空闲的槽位上启动一个工作线程，调用者需持有m_mutex
+    void startWorker(size_t worker);
+    //任务排队太久时增加一个线程
+    void maybeGrow(uint64_t latency);
+    //当前线程退出前把自己队列里剩下的任务交给全局队列
+    void retire();
+    //从fibers中取出第一个可执行的任务，调用者需持有对应的锁
+    Task* popFrom(TaskQueue& fibers);
+    //协程是否还在其他线程上执行或者正在切出，是的话登记当前线程，切出后由holdFiber()叫醒
+    bool isSwitching(Fiber* fiber);
+    //协程切回调度器之后，把状态改成HOLD并叫醒切出期间跳过它的线程
+    void holdFiber(Fiber* fiber);
+    //线程id对应的工作线程下标，不属于本调度器返回-1
+    int workerOf(int thread) const;
+    //从其他工作线程的队尾窃取一半任务放到自己的队列中
+    Task* steal();
+    //记录当前工作线程开始和结束执行一个任务协程
+    void beginSlice(Fiber* fiber);
+    void endSlice();
+    //看门狗线程，定期检查每个工作线程的当前任务执行了多久
+    void watchdog();
+    //任务执行超过阈值时采集它的调用栈并报告
+    void checkStall(WorkerQueue& q, uint64_t now, uint64_t threshold);
+    //看门狗信号的处理函数，在卡住的线程上采集调用栈
+    static void OnStallSignal(int sig);
 private:
     MutexType m_mutex;
     std::vector<Thread::ptr> m_threads; //线程池
-    std::list<FiberAndThread> m_fibers; //协程队列 存储要调度的任务（协程或回调函数）以及指定它们执行的线程。
+    std::vector<Thread::ptr> m_retiredThreads; //槽位被重新启动时换下来的已退出线程，扩容之后或者stop()里join
+    TaskQueue m_fibers[PRIORITY_COUNT]; //全局注入队列 存放调度器外部线程提交的任务
+    std::atomic<size_t> m_globalCount[PRIORITY_COUNT]; //全局注入队列中每个优先级的任务数，为0时不加锁
+    std::vector<Task*> m_deadlines; //带截止时间的任务，按截止时间排列的小顶堆，由m_mutex保护
+    std::atomic<size_t> m_deadlineCount = {0};
+    std::atomic<uint64_t> m_expiredCount = {0};
+    std::atomic<uint64_t> m_droppedCount = {0};
+    size_t m_minThreads = 0;    //线程数下限，不包括use_caller线程
+    size_t m_maxThreads = 0;    //线程数上限，不包括use_caller线程
+    std::atomic<uint64_t> m_lastGrowMs = {0};
+    std::atomic<uint64_t> m_growCount = {0};
+    std::atomic<uint64_t> m_shrinkCount = {0};
+    std::vector<std::unique_ptr<WorkerQueue> > m_workers; //每个工作线程一个本地队列
+    std::atomic<size_t> m_taskCount = {0};  //所有队列中的任务总数
+    std::atomic<size_t> m_pinnedCount = {0};  //其中在信箱里的任务数
+    std::atomic<size_t> m_suspendedCount = {0};
+    typedef Spinlock SleeperMutexType;
+    SleeperMutexType m_sleeperMutex;
+    std::vector<int> m_sleepers; //正在休眠的工作线程下标
+    std::atomic<size_t> m_sleeperCount = {0};
+    Thread::ptr m_watchdog;
+    std::atomic<int> m_watchdogStop = {0};  //futex字，1表示看门狗线程应该退出
+    std::atomic<uint64_t> m_stallCount = {0};
     Fiber::ptr m_rootFiber;  //主协程
     std::string m_name;
 protected:
-    std::vector<int> m_threadIds; //存储线程id
-    size_t m_threadCount = 0;  //线程数量
+    std::vector<int> m_threadIds; //存储线程id，按工作线程下标存放，扩容时重新启动的线程更新所在的位置
+    std::atomic<size_t> m_threadCount = {0};  //线程数量，不包括use_caller线程
     std::atomic<size_t> m_activeThreadCount = {0}; //活跃线程数量
     std::atomic<size_t> m_idleThreadCount = {0}; //空闲线程数量
     //执行状态
@@ -126,4 +244,8 @@ protected:
     int m_rootThread = 0; //主线程id  （use_caller id）
 };
 
+//协作式的抢占点：当前任务协程从swapIn开始执行超过 scheduler.time_slice_ms 时让出线程，
+//之后按原来的优先级重新排队。CPU密集的任务可以在循环里调用，不在调度器中时什么都不做
+void maybe_yield();
+
 }
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace captain {
+
+/* 协程栈用量统计
+1、协程的栈在切入之前整块涂成固定的字节，结束之后从栈底往上找第一个被改写的位置，得到栈用量的最高水位
+2、同一个入口（比如同一个TcpServer的连接处理函数）的协程记到同一个StackProfile，按2的幂分桶统计
+3、fiber.stack_profile 打开时所有协程都统计，没有指定入口的记到"default"；
+   也可以只对单个协程调用 Fiber::setStackProfile
+4、涂栈会碰到整个栈，增加常驻内存和开销，用于调试和采样
+ */
+class StackProfile {
+public:
+    //第0个桶是[0, 1KB]，第i个桶是(1KB << (i - 1), 1KB << i]，最后一个桶包括更大的
+    static const int BUCKETS = 16;
+
+    //按名字取统计对象，不存在时创建。对象不会释放，可以长期持有指针
+    static StackProfile* Get(const std::string& name);
+    //没有指定入口的协程记到这里
+    static StackProfile* Default();
+    //是否打开了 fiber.stack_profile
+    static bool IsEnabled();
+    //所有统计对象的直方图
+    static std::string Dump();
+
+    //把栈涂成固定的字节
+    static void Paint(void* stack, size_t size);
+    //从栈底往上找第一个被改写的位置，返回用过的字节数
+    static size_t Measure(const void* stack, size_t size);
+
+    //第i个桶的上界
+    static size_t BucketBound(int i) { return (size_t)1024 << i;}
+
+    void record(size_t used);
+
+    const std::string& getName() const { return m_name;}
+    uint64_t getCount() const { return m_count;}
+    size_t getMax() const { return m_max;}
+    uint64_t getBucket(int i) const { return m_buckets[i];}
+    //百分位数p(0-100)所在桶的上界，没有样本返回0
+    size_t percentile(double p) const;
+    //按百分位数p留出一倍余量，取2的幂作为栈大小，样本少于min_samples时返回0
+    size_t suggestStackSize(double p, uint64_t min_samples) const;
+    std::string toString() const;
+private:
+    StackProfile(const std::string& name);
+private:
+    std::string m_name;
+    std::atomic<uint64_t> m_buckets[BUCKETS];
+    std::atomic<uint64_t> m_count = {0};
+    std::atomic<size_t> m_max = {0};
+};
+
+}
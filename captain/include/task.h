@@ -0,0 +1,165 @@
+#pragma once
+
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include "fiber.h"
+#include "noncopyable.h"
+
+namespace captain {
+
+/* Task
+调度器的任务节点，代替原来的 FiberAndThread + std::list 节点。
+1、节点本身带有前后指针，直接串进 TaskQueue，入队出队不需要再分配链表节点
+2、回调函数存放在节点内部的小缓冲区里，几个指针大小的lambda不需要堆内存
+3、节点由线程本地的空闲链表回收复用，稳定运行后 schedule() 不会调用 malloc
+ */
+class Task : Noncopyable {
+friend class TaskQueue;
+public:
+    //小于等于这个大小的回调函数直接放在节点里
+    static const size_t INLINE_SIZE = 48;
+
+    //根据协程或回调函数创建一个任务，传入空的协程或回调函数时返回nullptr
+    //传入 Fiber::ptr* 或 std::function<void()>* 时会把内容swap进来，避免引用计数变化和拷贝
+    template<class FiberOrCb>
+    static Task* Create(FiberOrCb&& fc, int thread = -1) {
+        Task* task = new (Allocate()) Task(thread);
+        typedef typename std::decay<FiberOrCb>::type Type;
+        if(!task->init(std::forward<FiberOrCb>(fc), Kind<Type>())) {
+            Destroy(task);
+            return nullptr;
+        }
+        return task;
+    }
+
+    //析构并把节点还给空闲链表
+    static void Destroy(Task* task);
+
+    //执行回调函数
+    void call() { m_invoke(m_callable);}
+    bool hasCallback() const { return m_invoke != nullptr;}
+
+    Fiber::ptr fiber;   //要执行的协程，和回调函数二选一
+    int thread;         //指定执行的线程id，-1表示任意线程
+    int priority = -1;  //优先级，见 Scheduler::Priority
+    uint64_t deadline = 0;  //截止时间（毫秒），0表示没有
+    uint64_t enqueued = 0;  //入队时间（毫秒），线程数可以伸缩时才记录
+private:
+    Task(int thr)
+        :thread(thr) {
+    }
+    ~Task();
+
+    static void* Allocate();
+    static void Deallocate(void* p);
+
+    //按传入参数的类型分派到不同的init
+    struct FiberTag {};
+    struct FiberPtrTag {};
+    struct FunctionPtrTag {};
+    struct CallableTag {};
+
+    template<class T>
+    struct Kind : std::conditional<std::is_same<T, Fiber::ptr>::value, FiberTag
+                , typename std::conditional<std::is_same<T, Fiber::ptr*>::value, FiberPtrTag
+                , typename std::conditional<std::is_same<T, std::function<void()>*>::value, FunctionPtrTag
+                , CallableTag>::type>::type>::type {
+    };
+
+    template<class F>
+    bool init(F&& f, FiberTag) {
+        fiber = std::forward<F>(f);
+        return !!fiber;
+    }
+
+    bool init(Fiber::ptr* f, FiberPtrTag) {
+        fiber.swap(*f);
+        return !!fiber;
+    }
+
+    bool init(std::function<void()>* f, FunctionPtrTag) {
+        if(!*f) {
+            return false;
+        }
+        emplace<std::function<void()> >(std::move(*f));
+        *f = nullptr;
+        return true;
+    }
+
+    template<class F>
+    bool init(F&& f, CallableTag) {
+        typedef typename std::decay<F>::type Type;
+        if(IsEmpty(f)) {
+            return false;
+        }
+        emplace<Type>(std::forward<F>(f));
+        return true;
+    }
+
+    template<class T>
+    static bool IsEmpty(const T&) { return false;}
+    static bool IsEmpty(const std::function<void()>& f) { return !f;}
+    static bool IsEmpty(void (*f)()) { return f == nullptr;}
+    static bool IsEmpty(std::nullptr_t) { return true;}
+
+    template<class T, class F>
+    void emplace(F&& f) {
+        if(sizeof(T) <= INLINE_SIZE
+                && alignof(T) <= alignof(InlineStorage)) {
+            m_callable = new (&m_storage) T(std::forward<F>(f));
+            m_destroy = &DestroyInline<T>;
+        } else {
+            m_callable = new T(std::forward<F>(f));
+            m_destroy = &DestroyHeap<T>;
+        }
+        m_invoke = &Invoke<T>;
+    }
+
+    template<class T>
+    static void Invoke(void* p) { (*static_cast<T*>(p))();}
+    template<class T>
+    static void DestroyInline(void* p) { static_cast<T*>(p)->~T();}
+    template<class T>
+    static void DestroyHeap(void* p) { delete static_cast<T*>(p);}
+private:
+    typedef std::aligned_storage<INLINE_SIZE>::type InlineStorage;
+
+    Task* m_prev = nullptr;
+    Task* m_next = nullptr;
+    void (*m_invoke)(void*) = nullptr;
+    void (*m_destroy)(void*) = nullptr;
+    void* m_callable = nullptr;
+    InlineStorage m_storage;
+};
+
+/* TaskQueue
+Task 的侵入式双向链表，不负责加锁，也不拥有节点的所有权。
+ */
+class TaskQueue : Noncopyable {
+public:
+    bool empty() const { return m_head == nullptr;}
+    size_t size() const { return m_size;}
+
+    Task* front() const { return m_head;}
+    Task* back() const { return m_tail;}
+    static Task* Next(Task* task) { return task->m_next;}
+
+    void push_back(Task* task);
+    void push_front(Task* task);
+    Task* pop_front();
+    Task* pop_back();
+    //从队列中摘除task
+    void erase(Task* task);
+    //把other中的节点全部接到队尾
+    void splice(TaskQueue& other);
+    //销毁队列中的所有任务
+    void clear();
+private:
+    Task* m_head = nullptr;
+    Task* m_tail = nullptr;
+    size_t m_size = 0;
+};
+
+}
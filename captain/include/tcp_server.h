@@ -184,6 +184,35 @@ public:
      */
     virtual void setName(const std::string& v) { m_name = v;}
 
+    /**
+     * @brief 连接协程是否使用共享栈
+     */
+    bool isSharedStack() const { return m_sharedStack;}
+
+    /**
+     * @brief 设置连接协程是否使用共享栈，大量长时间空闲的连接时可以显著减少内存
+     * @details 之后接受的连接生效，连接协程会固定在第一次执行它的线程上
+     */
+    void setSharedStack(bool v) { m_sharedStack = v;}
+
+    /**
+     * @brief 是否根据统计到的栈用量自动选择连接协程的栈大小
+     */
+    bool isStackAutoSize() const { return m_stackAutoSize;}
+
+    /**
+     * @brief 设置是否自动选择连接协程的栈大小，start()之前调用
+     * @details 连接协程的栈用量记到名为"tcp_server.<name>"的StackProfile，
+     *          样本足够之后按 tcp_server.stack_auto_percentile 百分位数的两倍选择栈大小，
+     *          之后每16个连接采样一个继续统计
+     */
+    void setStackAutoSize(bool v) { m_stackAutoSize = v;}
+
+    /**
+     * @brief 连接协程的栈用量统计，没有打开统计时为nullptr
+     */
+    StackProfile* getStackProfile() const { return m_stackProfile;}
+
     /**
      * @brief 是否停止
      */
@@ -225,6 +254,16 @@ protected:
     bool m_isStop;
 
     bool m_ssl = false;
+    /// 连接协程是否使用共享栈
+    bool m_sharedStack = false;
+    /// 是否自动选择连接协程的栈大小
+    bool m_stackAutoSize = false;
+    /// 连接协程的栈用量统计
+    StackProfile* m_stackProfile = nullptr;
+    //连接协程的入口标签，采样分析时区分不同的服务
+    const char* m_tag = nullptr;
+    /// 接受的连接数，用于采样
+    uint64_t m_accepted = 0;
 
     TcpServerConf::ptr m_conf;
 };
@@ -5,6 +5,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <atomic>
+#include <string>
 #include "noncopyable.h"
 namespace captain {
 
@@ -17,6 +17,8 @@ uint32_t GetFiberId();
 
 void Backtrace(std::vector<std::string>& bt, int size = 64, int skip = 1);
 std::string BacktraceToString(int size = 64, int skip = 2, const std::string& prefix = "");
+//把已经采集到的返回地址转换成字符串，用于输出其他线程的调用栈
+std::string BacktraceToString(void* const* frames, int size, int skip = 0, const std::string& prefix = "");
 
 //时间ms
 uint64_t GetCurrentMS();
@@ -0,0 +1,151 @@
+#include "include/io_uring.h"
+#include <algorithm>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace captain {
+
+static int io_uring_setup(unsigned entries, io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete
+        , unsigned flags, const void* arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+IoUring::IoUring() {
+}
+
+IoUring::~IoUring() {
+    if(m_sqes) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if(m_cqRing && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if(m_sqRing) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool IoUring::init(uint32_t entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+    m_fd = io_uring_setup(entries, &p);
+    if(m_fd < 0) {
+        return false;
+    }
+    if(!(p.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    //5.4之后两个环形队列可以一次映射
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE
+            , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_sqRing == MAP_FAILED) {
+        m_sqRing = nullptr;
+        return false;
+    }
+    if(single) {
+        m_cqRing = m_sqRing;
+    } else {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE
+                , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if(m_cqRing == MAP_FAILED) {
+            m_cqRing = nullptr;
+            return false;
+        }
+    }
+    m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE
+            , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        return false;
+    }
+    m_sqes = (io_uring_sqe*)sqes;
+
+    char* sq = (char*)m_sqRing;
+    m_sqHead = (unsigned*)(sq + p.sq_off.head);
+    m_sqTail = (unsigned*)(sq + p.sq_off.tail);
+    m_sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    m_sqEntries = p.sq_entries;
+    m_sqArray = (unsigned*)(sq + p.sq_off.array);
+
+    char* cq = (char*)m_cqRing;
+    m_cqHead = (unsigned*)(cq + p.cq_off.head);
+    m_cqTail = (unsigned*)(cq + p.cq_off.tail);
+    m_cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    return true;
+}
+
+int IoUring::submit(const io_uring_sqe& sqe) {
+    MutexType::Lock lock(m_mutex);
+    //每次填好就提交，内核在io_uring_enter里同步取走，队列不会积压
+    unsigned tail = *m_sqTail;
+    if(tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+        return -EBUSY;
+    }
+    unsigned index = tail & m_sqMask;
+    m_sqes[index] = sqe;
+    m_sqArray[index] = index;
+    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+    int rt = 0;
+    do {
+        rt = io_uring_enter(m_fd, 1, 0, 0, nullptr, 0);
+    } while(rt < 0 && errno == EINTR);
+    if(rt == 1) {
+        return 0;
+    }
+    rt = rt < 0 ? -errno : -EAGAIN;
+    //没有SQPOLL时内核只在io_uring_enter里取请求，没取走就撤回，
+    //否则下一次提交时它会被一起取走，调用者以为失败了却会收到它的完成事件
+    if(__atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) == tail) {
+        __atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+    }
+    return rt;
+}
+
+int IoUring::wait(uint64_t timeout_ms) {
+    __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if(timeout_ms != ~0ull) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = timeout_ms % 1000 * 1000000;
+        arg.ts = (uint64_t)&ts;
+    }
+    int rt = io_uring_enter(m_fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG
+            , &arg, sizeof(arg));
+    return rt < 0 ? -errno : 0;
+}
+
+int IoUring::reap(io_uring_cqe* cqes, int count) {
+    unsigned head = *m_cqHead;
+    unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    for(; head != tail && n < count; ++head, ++n) {
+        cqes[n] = m_cqes[head & m_cqMask];
+    }
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+}
@@ -1,10 +1,17 @@
 #include "include/iomanager.h"
+#include "include/config.h"
 #include "include/macro.h"
 #include "include/log.h"
+#include "include/io_uring.h"
+#include "include/fd_manager.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -12,6 +19,67 @@ namespace captain {
 
 static captain::Logger::ptr g_logger = CAPTAIN_LOG_NAME("system");
 
+static ConfigVar<uint32_t>::ptr g_iomanager_spin_count =
+    Config::Lookup<uint32_t>("iomanager.spin_count", 1000, "idle spin count before sleeping");
+
+static ConfigVar<std::string>::ptr g_iomanager_backend =
+    Config::Lookup<std::string>("iomanager.backend", "epoll", "io backend of new IOManager: epoll or io_uring");
+
+static ConfigVar<uint32_t>::ptr g_iomanager_uring_entries =
+    Config::Lookup<uint32_t>("iomanager.uring_entries", 256, "io_uring submission queue size");
+
+static ConfigVar<bool>::ptr g_iomanager_sharded =
+    Config::Lookup<bool>("iomanager.sharded", false, "one epoll per worker thread in new IOManager, fds stay on the worker that registered them");
+
+static ConfigVar<uint32_t>::ptr g_iomanager_max_events =
+    Config::Lookup<uint32_t>("iomanager.max_events", 64, "io events taken by one wait, doubled while batches come back full");
+
+static ConfigVar<uint32_t>::ptr g_iomanager_max_events_limit =
+    Config::Lookup<uint32_t>("iomanager.max_events_limit", 4096, "upper bound of the adaptive io event batch");
+
+static ConfigVar<uint32_t>::ptr g_iomanager_max_timeout =
+    Config::Lookup<uint32_t>("iomanager.max_timeout_ms", 3000, "longest single wait for io events");
+
+//每个线程的事件缓冲区和当前的批大小，轮询和分片模式下的休眠共用
+static thread_local std::vector<epoll_event> t_events;
+static thread_local std::vector<io_uring_cqe> t_cqes;
+static thread_local size_t t_batch = 0;
+
+//本次等待最多取多少个事件：不少于 iomanager.max_events，不超过 iomanager.max_events_limit
+static size_t PrepareBatch(bool ring) {
+    size_t base = std::max(g_iomanager_max_events->getValue(), (uint32_t)1);
+    size_t limit = std::max((size_t)g_iomanager_max_events_limit->getValue(), base);
+    t_batch = std::min(std::max(t_batch, base), limit);
+    if(ring) {
+        if(t_cqes.size() < t_batch) {
+            t_cqes.resize(t_batch);
+        }
+    } else if(t_events.size() < t_batch) {
+        t_events.resize(t_batch);
+    }
+    return t_batch;
+}
+
+/* io_uring完成事件的user_data
+低3位是事件类型，中间是FdContext的地址，高16位是注册序号；0表示不需要处理，TICKLE_DATA是唤醒用的eventfd
+ */
+static const uint64_t TICKLE_DATA = 0x2;
+static const uint64_t RING_EVENT_MASK = 0x7;
+static const uint64_t RING_PTR_MASK = ((1ull << 48) - 1) & ~RING_EVENT_MASK;
+
+static uint64_t MakeRingData(void* fd_ctx, IOManager::Event event, uint16_t seq) {
+    return (uint64_t)seq << 48 | (uint64_t)fd_ctx | event;
+}
+
+//自旋等待时让出流水线，减少对同一核上另一个超线程的影响
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
 //根据给定的事件类型，返回相应的事件上下文
 IOManager::FdContext::EventContext& IOManager::FdContext::getContext(IOManager::Event event) {
     switch(event) {
@@ -29,6 +97,8 @@ void IOManager::FdContext::resetContext(EventContext& ctx) {
     ctx.scheduler = nullptr;
     ctx.fiber.reset();
     ctx.cb = nullptr;
+    ctx.result = nullptr;
+    ctx.thread = -1;
 }
 
 void IOManager::FdContext::triggerEvent(IOManager::Event event) {
@@ -37,79 +107,174 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event) {
     EventContext& ctx = getContext(event); //获取指定事件的上下文
     if(ctx.cb) {
         //有回调函数，则使用调度器将回调函数提交到调度器进行执行
-        ctx.scheduler->schedule(&ctx.cb);
+        ctx.scheduler->schedule(&ctx.cb, ctx.thread);
     } else {
         //使用调度器将关联的协程提交到调度器进行执行。
-        ctx.scheduler->schedule(&ctx.fiber);
+        ctx.scheduler->schedule(&ctx.fiber, ctx.thread);
     }
     //清空事件上下文中的调度器，以避免出现悬挂的情况。
     ctx.scheduler = nullptr;
+    ctx.thread = -1;
     return;
 }
 
-IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
-    :Scheduler(threads, use_caller, name) {
-    m_epfd = epoll_create(5000);
-    CAPTAIN_ASSERT(m_epfd > 0);
-    //创建一个管道，用于唤醒事件循环线程。m_tickleFds 数组保存管道两端的文件描述符
-    int rt = pipe(m_tickleFds);
-    CAPTAIN_ASSERT(!rt);
+IOManager::IOManager(size_t threads, bool use_caller, const std::string& name
+                    , size_t max_threads)
+    :Scheduler(threads, use_caller, name, max_threads) {
+    //创建一个eventfd，用于唤醒阻塞在epoll_wait上的轮询线程。非阻塞，读一次就清空计数
+    m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    CAPTAIN_ASSERT(m_tickleFd >= 0);
+
+    const std::string& backend = g_iomanager_backend->getValue();
+    if(backend == "io_uring") {
+        m_ring = new IoUring;
+        if(!m_ring->init(g_iomanager_uring_entries->getValue())) {
+            //内核太老或者被seccomp禁用了
+            CAPTAIN_LOG_WARN(g_logger) << "IOManager name=" << name
+                << " io_uring init fail errno=" << errno << " errstr=" << strerror(errno)
+                << ", fallback to epoll";
+            delete m_ring;
+            m_ring = nullptr;
+        }
+    } else if(backend != "epoll") {
+        CAPTAIN_LOG_WARN(g_logger) << "unknown iomanager.backend=" << backend << ", use epoll";
+    }
+
+    //其余空闲线程阻塞读自己的eventfd，写哪个就只唤醒哪个
+    for(size_t i = 0; i < getWorkerCount(); ++i) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        CAPTAIN_ASSERT(fd >= 0);
+        m_wakeFds.push_back(fd);
+    }
 
-    epoll_event event;
-    memset(&event, 0, sizeof(epoll_event)); //初始化
-    event.events = EPOLLIN | EPOLLET;  //边缘触发模式  只通知一次 要一次性处理完所有数据
-    event.data.fd = m_tickleFds[0];//监听管道的读端文件描述符 m_tickleFds[0] 上的可读事件。
+    bool sharded = g_iomanager_sharded->getValue();
+    if(m_ring) {
+        if(sharded) {
+            CAPTAIN_LOG_WARN(g_logger) << "IOManager name=" << name
+                << " iomanager.sharded only works with epoll backend, ignored";
+        }
+        m_epfd = -1;
+        ringArmTickle();
+    } else if(sharded) {
+        //每个工作线程的eventfd注册在自己的epoll里，休眠和轮询都等在这个epoll上
+        m_epfd = -1;
+        for(size_t i = 0; i < getWorkerCount(); ++i) {
+            int epfd = epoll_create(5000);
+            CAPTAIN_ASSERT(epfd > 0);
+            epoll_event event;
+            memset(&event, 0, sizeof(epoll_event));
+            event.events = EPOLLIN | EPOLLET;
+            event.data.fd = m_wakeFds[i];
+            int rt = epoll_ctl(epfd, EPOLL_CTL_ADD, m_wakeFds[i], &event);
+            CAPTAIN_ASSERT(!rt);
+            m_shardFds.push_back(epfd);
+        }
+    } else {
+        m_epfd = epoll_create(5000);
+        CAPTAIN_ASSERT(m_epfd > 0);
 
-    //设置管道读端为非阻塞模式，以确保读操作不会阻塞。  fcntl 函数用于获取或设置文件描述符的属性
-    //O_NONBLOCK 表示非阻塞模式
-    rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-    CAPTAIN_ASSERT(!rt);
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event)); //初始化
+        event.events = EPOLLIN | EPOLLET;  //边缘触发模式  只通知一次 要一次性处理完所有数据
+        event.data.fd = m_tickleFd;
 
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-    CAPTAIN_ASSERT(!rt);
+        int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
+        CAPTAIN_ASSERT(!rt);
+    }
 
-    //初始化文件描述符上下文数组
-    contextResize(32);
+    for(auto& i : m_fdSegments) {
+        i = nullptr;
+    }
+    for(auto& i : m_eventsHistogram) {
+        i = 0;
+    }
     
     start(); //Scheduler::start  创建好了就默认启动
 }
 
 IOManager::~IOManager() {
     stop(); //Scheduler::stop 
-    close(m_epfd); //关闭 epoll 文件描述符
-    close(m_tickleFds[0]); //关闭管道描述符
-    close(m_tickleFds[1]);
+    if(m_epfd >= 0) {
+        close(m_epfd); //关闭 epoll 文件描述符
+    }
+    delete m_ring;
+    for(auto fd : m_shardFds) {
+        close(fd);
+    }
+    close(m_tickleFd); //关闭唤醒用的eventfd
+    for(auto fd : m_wakeFds) {
+        close(fd);
+    }
     //释放内存
-    for(size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if(m_fdContexts[i]) { //如果某个上下文存在（不为 nullptr），则释放其内存。
-            delete m_fdContexts[i];
+    for(auto& i : m_fdSegments) {
+        FdContext* segment = i;
+        if(segment) {
+            DestroySegment(segment);
         }
     }
 }
 
-//确保 m_fdContexts 数组能够容纳指定大小的句柄上下文对象，并在需要时创建新的对象。
-void IOManager::contextResize(size_t size) {
-    m_fdContexts.resize(size);
+//分配一段缓存行对齐的句柄上下文，C++11的new不保证超过16字节的对齐
+IOManager::FdContext* IOManager::CreateSegment(int first_fd) {
+    void* mem = nullptr;
+    if(posix_memalign(&mem, alignof(FdContext), sizeof(FdContext) * FD_SEGMENT_SIZE)) {
+        return nullptr;
+    }
+    FdContext* segment = (FdContext*)mem;
+    for(size_t i = 0; i < FD_SEGMENT_SIZE; ++i) {
+        new (&segment[i]) FdContext;
+        segment[i].fd = first_fd + i;
+    }
+    return segment;
+}
+
+void IOManager::DestroySegment(FdContext* segment) {
+    for(size_t i = 0; i < FD_SEGMENT_SIZE; ++i) {
+        segment[i].~FdContext();
+    }
+    free(segment);
+}
 
-    for(size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if(!m_fdContexts[i]) { //创建新的句柄上下文
-            m_fdContexts[i] = new FdContext;
-            m_fdContexts[i]->fd = i; //将句柄上下文的 fd 属性设置为当前数组索引值 i
+IOManager::FdContext* IOManager::getFdContext(int fd, bool create) {
+    if(fd < 0 || (size_t)fd >= FD_SEGMENT_SIZE * FD_SEGMENT_COUNT) {
+        return nullptr;
+    }
+    std::atomic<FdContext*>& slot = m_fdSegments[fd / FD_SEGMENT_SIZE];
+    FdContext* segment = slot.load(std::memory_order_acquire);
+    if(!segment) {
+        if(!create) {
+            return nullptr;
+        }
+        //多个线程同时创建同一段时只有一个能发布成功，其余的释放自己创建的，用发布了的那个
+        FdContext* created = CreateSegment(fd - fd % FD_SEGMENT_SIZE);
+        if(!created) {
+            return nullptr;
+        }
+        if(slot.compare_exchange_strong(segment, created
+                    , std::memory_order_acq_rel, std::memory_order_acquire)) {
+            segment = created;
+        } else {
+            DestroySegment(created);
         }
     }
+    return &segment[fd % FD_SEGMENT_SIZE];
 }
 
 int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-    FdContext* fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-    } else {
-        lock.unlock();
-        RWMutexType::WriteLock lock2(m_mutex);
-        contextResize(fd * 1.5);
-        fd_ctx = m_fdContexts[fd];
+    return registerEvent(fd, event, std::move(cb), nullptr, nullptr);
+}
+
+int IOManager::submitIO(int fd, Event event, const IoRequest& req, int* result) {
+    CAPTAIN_ASSERT(m_ring);
+    return registerEvent(fd, event, nullptr, &req, result);
+}
+
+int IOManager::registerEvent(int fd, Event event, std::function<void()> cb
+        , const IoRequest* req, int* result) {
+    FdContext* fd_ctx = getFdContext(fd, true);
+    if(!fd_ctx) {
+        CAPTAIN_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " out of range or no memory";
+        return -1;
     }
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
@@ -120,30 +285,55 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
                     << " fd_ctx.event=" << fd_ctx->events;
         CAPTAIN_ASSERT(!(fd_ctx->events & event));
     }
-    //根据 fd_ctx->events 的值判断是要添加新事件还是修改已有事件
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent; //用于设置要注册的事件的相关属性
-    //EPOLLET 表示使用边缘触发模式；fd_ctx->events 表示已经注册的事件；event 表示待添加或修改的事件。
-    epevent.events = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx;
-    //向 epoll 实例注册或修改事件 失败：返回-1  成功：返回0
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt) {
-        CAPTAIN_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << "," << fd << "," << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return -1;
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    if(m_ring) {
+        //每个方向单独提交一个poll或者IO操作，不需要修改另一个方向的注册
+        if(!ringSubmit(fd_ctx, event, event_ctx.seq + 1, req)) {
+            return -1;
+        }
+        ++event_ctx.seq;
+    } else {
+        //两个方向一次注册，之后等待不需要epoll_ctl。句柄可能没有经过这个IOManager的cancelAll()就被关掉了
+        //（其他线程或其他IOManager上的close），内核已经删掉了注册，靠代数发现句柄号被复用，重新注册
+        uint64_t generation = FdMgr::GetInstance()->getGeneration(fd);
+        if(!fd_ctx->registered || fd_ctx->generation != generation) {
+            //第一次注册时由这次注册的线程负责这个句柄，直到cancelAll()
+            if(!fd_ctx->registered && isSharded()) {
+                assignOwner(fd_ctx);
+            }
+            epoll_event epevent;
+            epevent.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            epevent.data.ptr = fd_ctx;
+            int rt = epoll_ctl(epollFdOf(fd_ctx), EPOLL_CTL_ADD, fd, &epevent);
+            //句柄的上下文在注册之后才创建时代数也会变，这时注册还在，返回EEXIST
+            if(rt && errno != EEXIST) {
+                CAPTAIN_LOG_ERROR(g_logger) << "epoll_ctl(" << epollFdOf(fd_ctx) << ", "
+                    << EPOLL_CTL_ADD << "," << fd << "," << epevent.events << "):"
+                    << rt << " (" << errno << ") (" << strerror(errno) << ")";
+                return -1;
+            }
+            if(rt == 0) {
+                //新加入的注册，之前缓存的边沿属于已经关掉的句柄
+                fd_ctx->ready = NONE;
+            }
+            fd_ctx->registered = true;
+            fd_ctx->generation = generation;
+        }
     }
 
     ++m_pendingEventCount; //有一个新的事件要被处理。
     fd_ctx->events = (Event)(fd_ctx->events | event); //将新事件添加到已有的事件集合中。
-    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
     //确保在添加事件时，事件上下文是空的
     CAPTAIN_ASSERT(!event_ctx.scheduler
                 && !event_ctx.fiber
                 && !event_ctx.cb);
 
     event_ctx.scheduler = Scheduler::GetThis();
+    event_ctx.result = result;
+    //事件在负责句柄的线程上就绪，协程也回到这个线程执行
+    if(isSharded() && event_ctx.scheduler == this) {
+        event_ctx.thread = getWorkerThread(fd_ctx->owner);
+    }
     if(cb) {  //如果传入的回调函数 cb 不为空，将其与事件上下文中的回调函数进行交换。这意味着当事件就绪时，将执行这个回调函数。
         event_ctx.cb.swap(cb);
     } else {
@@ -152,18 +342,22 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         //使用断言确保当前协程的状态为 正在执行状态。
         CAPTAIN_ASSERT(event_ctx.fiber->getState() == Fiber::EXEC);
     }
+    //上次等待之后已经有过边沿，不用再等epoll，直接唤醒。
+    //这个边沿可能已经被读写消耗掉了，协程醒来重试一次拿到EAGAIN再等
+    if(fd_ctx->ready & event) {
+        fd_ctx->ready = (Event)(fd_ctx->ready & ~event);
+        fd_ctx->triggerEvent(event);
+        --m_pendingEventCount;
+    }
     return 0; //0 success, -1 error
 }
 
 //从文件描述符上下文中删除一个已注册的事件
 bool IOManager::delEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if(!fd_ctx) {
         return false;
     }
-    //获取文件描述符上下文（FdContext）的指针
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
     //fd_ctx->events 表示文件描述符上已经注册的事件集合  event表示要删除的事件。
@@ -172,19 +366,11 @@ bool IOManager::delEvent(int fd, Event event) {
     }
     //计算出新的事件集合，其中排除了要删除的事件。
     Event new_events = (Event)(fd_ctx->events & ~event);
-    //根据新的事件集合是否为空，决定采用 EPOLL_CTL_MOD 还是 EPOLL_CTL_DEL 操作。
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-    //使用 epoll_ctl 函数执行删除或修改操作。
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt) {
-        CAPTAIN_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << "," << fd << "," << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
+    if(m_ring) {
+        //取消之后的完成事件因为注册已经删除了会被忽略
+        ringCancel(fd_ctx, event);
     }
+    //epoll里的注册保留，之后的就绪只记在ready里
     //在删除事件后对相应的数据进行更新和重置
     --m_pendingEventCount;
     fd_ctx->events = new_events; //已删除特定事件后的事件集合
@@ -194,32 +380,21 @@ bool IOManager::delEvent(int fd, Event event) {
 }
 
 bool IOManager::cancelEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if(!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
     if(!(fd_ctx->events & event)) { //检查要取消的事件是否存在
         return false;
     }
-    //计算取消特定事件后的新事件集合。
-    Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt) {
-        CAPTAIN_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << "," << fd << "," << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
+    if(m_ring) {
+        //被取消的请求完成时（结果是-ECANCELED）再唤醒等待的协程
+        ringCancel(fd_ctx, event);
+        return true;
     }
-
+    //epoll里的注册保留，只唤醒等待的协程
     fd_ctx->triggerEvent(event);
     --m_pendingEventCount;
     return true;
@@ -227,29 +402,38 @@ bool IOManager::cancelEvent(int fd, Event event) {
 
 //取消一个句柄上的所有事件的操作
 bool IOManager::cancelAll(int fd) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if(!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    //句柄要关闭了，把一直保留的注册也删掉，同样的句柄号之后可能是另一个文件
+    if(fd_ctx->registered) {
+        epoll_event epevent;
+        epevent.events = 0;
+        epevent.data.ptr = fd_ctx;
+        int rt = epoll_ctl(epollFdOf(fd_ctx), EPOLL_CTL_DEL, fd, &epevent);
+        if(rt) {
+            CAPTAIN_LOG_ERROR(g_logger) << "epoll_ctl(" << epollFdOf(fd_ctx) << ", "
+                << EPOLL_CTL_DEL << "," << fd << "," << epevent.events << "):"
+                << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        }
+        //删除失败说明句柄已经关闭了，注册也跟着没了
+        fd_ctx->registered = false;
+        fd_ctx->ready = NONE;
+    }
     if(!fd_ctx->events) { //如果句柄没有任何事件，直接返回 false
         return false;
     }
-
-    int op = EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = 0; //删除该句柄上的所有事件。
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt) {
-        CAPTAIN_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << "," << fd << "," << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
+    if(m_ring) {
+        if(fd_ctx->events & READ) {
+            ringCancel(fd_ctx, READ);
+        }
+        if(fd_ctx->events & WRITE) {
+            ringCancel(fd_ctx, WRITE);
+        }
+        return true;
     }
     //取消指定句柄上的所有事件，并触发已注册事件的回调或协程
     if(fd_ctx->events & READ) {
@@ -271,14 +455,128 @@ IOManager* IOManager::GetThis() {
     return dynamic_cast<IOManager*>(Scheduler::GetThis());
 }
 
+IOManager::IdleStats IOManager::getIdleStats() const {
+    IdleStats stats;
+    stats.spinHits = m_spinHits;
+    stats.parks = m_parks;
+    stats.polls = m_polls;
+    stats.wakeups = m_wakeups;
+    stats.spuriousWakeups = m_spuriousWakeups;
+    return stats;
+}
+
 void IOManager::tickle() {
-    if(hasIdleThreads()) { //检查是否有空闲的线程
-        //有空闲线程，说明有线程可以执行任务，所以函数直接返回，不执行后续的唤醒操作。
+    //已经有线程在自旋，或者刚被叫醒还没开始自旋，它会拿到这个任务
+    int spinning = 0;
+    if(!m_spinning.compare_exchange_strong(spinning, 1)) {
+        return;
+    }
+    //替被唤醒的线程先占一个自旋名额，避免连续的tickle()一次叫醒多个线程。
+    //优先唤醒在eventfd上休眠的线程，轮询线程继续等IO事件
+    ++m_wakeClaims;
+    if(wakeSleeper()) {
+        return;
+    }
+    //名额可能已经被刚醒来的线程接走了，那就由它负责归还
+    if(takeWakeClaim()) {
+        --m_spinning;
+    }
+    wakePoller();
+}
+
+bool IOManager::takeWakeClaim() {
+    int claims = m_wakeClaims;
+    while(claims > 0) {
+        if(m_wakeClaims.compare_exchange_weak(claims, claims - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void IOManager::tickleWorker(size_t worker) {
+    if(wakeSleeper(worker)) {
+        return;
+    }
+    if(m_poller == (int)worker) {
+        wakePoller();
+    }
+}
+
+bool IOManager::wakePoller() {
+    if(m_poller == -1) {
+        return false;
+    }
+    //轮询线程醒来之前，多次唤醒只需要写一次
+    if(!m_pollerNotified.exchange(true)) {
+        //分片模式下轮询线程等在自己的epoll上，写它的eventfd。
+        //轮询线程刚好换了的话多唤醒一次原来的线程，新的轮询线程开始等待之前会重新检查定时器
+        int fd = m_tickleFd;
+        if(isSharded()) {
+            int poller = m_poller;
+            if(poller == -1) {
+                m_pollerNotified = false;
+                return false;
+            }
+            fd = m_wakeFds[poller];
+        }
+        uint64_t one = 1;
+        int rt = write(fd, &one, sizeof(one));
+        CAPTAIN_ASSERT(rt == sizeof(one));
+        ++m_wakeups;
+    }
+    return true;
+}
+
+void IOManager::waitForWakeup(int worker) {
+    //轮询线程空缺时不能休眠，回去接替它，否则没有线程处理IO事件
+    if(m_poller == -1) {
         return;
     }
-    //写入一个字节到管道中的方式，唤醒其中一个 IO 线程
-    int rt = write(m_tickleFds[1], "T", 1);
-    CAPTAIN_ASSERT(rt == 1);
+    if(isSharded()) {
+        pollShard(worker);
+        return;
+    }
+    //线程数大于下限时最多睡到该退出的时候
+    uint64_t timeout = getRetireTimeout();
+    pollfd pfd;
+    pfd.fd = m_wakeFds[worker];
+    pfd.events = POLLIN;
+    int rt = 0;
+    do {
+        rt = poll(&pfd, 1, timeout == ~0ull ? -1 : (int)timeout);
+    } while(rt < 0 && errno == EINTR);
+    if(rt > 0) {
+        uint64_t dummy;
+        rt = read(m_wakeFds[worker], &dummy, sizeof(dummy));
+    }
+}
+
+void IOManager::wakeup(int worker) {
+    uint64_t one = 1;
+    int rt = write(m_wakeFds[worker], &one, sizeof(one));
+    CAPTAIN_ASSERT(rt == sizeof(one));
+    ++m_wakeups;
+}
+
+bool IOManager::spin(bool claimed) {
+    uint32_t count = g_iomanager_spin_count->getValue();
+    if(!claimed) {
+        ++m_spinning;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        if(hasPendingTask()) {
+            ++m_spinHits;
+            //最后一个自旋的线程拿到了任务，再叫醒一个线程来自旋，任务多时逐个把线程叫起来
+            if(--m_spinning == 0) {
+                tickle();
+            }
+            return true;
+        }
+        CpuRelax();
+    }
+    --m_spinning;
+    return false;
 }
 
 //如果没有定时器、没有待处理事件，而且调度器也正在停止，那么函数返回 true，表示 IO 管理器应该停止。
@@ -297,40 +595,74 @@ bool IOManager::stopping() {
 }
 
 void IOManager::idle() {
-    //分配一个大小为 64 的 epoll_event 数组
-    epoll_event* events = new epoll_event[64]();
-    //使用 std::shared_ptr 来确保在函数结束时自动释放内存。
-    //第二个参数是一个 lambda 函数，用于在共享指针的引用计数归零时执行释放操作
-    std::shared_ptr<epoll_event> shared_events(events, [](epoll_event* ptr){
-        delete[] ptr;
-    });
-
+    int worker = GetWorkerIndex();
+    bool woken = false;   //刚从eventfd上被唤醒
+    bool claimed = false; //已经接过了tickle()占的自旋名额
+    bool retiring = false; //空闲太久，线程要退出
     while(true) {
         uint64_t next_timeout = 0;
         if(stopping(next_timeout)) {
             CAPTAIN_LOG_INFO(g_logger) << "name=" << getName()
                                      << " idle stopping exit";
+            if(claimed) {
+                --m_spinning;
+            }
+            break;
+        }
+
+        //先自旋一小段时间，任务很快到来时省掉休眠和唤醒的系统调用
+        bool found = spin(claimed);
+        claimed = false;
+        if(found) {
+            woken = false;
+            Fiber::YieldToHold();
+            continue;
+        }
+        //被唤醒之后自旋也没有等到任务，轮询线程的位置也有人占着
+        if(woken && m_poller != -1) {
+            ++m_spuriousWakeups;
+        }
+        woken = false;
+
+        //分片模式下线程数不收缩，线程退出之后它负责的句柄就没有线程等待了
+        if(!isSharded() && shouldRetire()) {
+            retiring = true;
             break;
         }
+        //自旋没等到任务，要休眠了，顺便归还空闲协程栈的物理内存
+        Fiber::TrimStackCache();
+
+        //已经有轮询线程了，在自己的eventfd上休眠，等tickle()指定唤醒
+        int poller = -1;
+        if(!m_poller.compare_exchange_strong(poller, worker)) {
+            ++m_parks;
+            park();
+            //被tickle()叫醒的线程接过它占的自旋名额，直接去自旋，拿到任务之前不能让出
+            claimed = takeWakeClaim();
+            woken = true;
+            continue;
+        }
 
+        //成为轮询线程之后再检查一次任务、定时器和是否要退出，避免错过之前的tickle。
+        //上一轮留下的通知标志清零之前，wakePoller()以为已经通知过了，不会写eventfd，
+        //这期间stop()的唤醒只能靠这里的stopping()发现，否则要等到epoll超时
+        m_pollerNotified = false;
+        next_timeout = getNextTimer();
         int rt = 0;
-        do {
-            static const int MAX_TIMEOUT = 3000; //用于限制最大的等待时间
-            if(next_timeout != ~0ull) { //有超时时间
-                //取较小的那个值作为等待时间。
-                next_timeout = (int)next_timeout > MAX_TIMEOUT
-                                ? MAX_TIMEOUT : next_timeout;
-            } else {
-                //没有定时器事件
-                next_timeout = MAX_TIMEOUT;
-            }
-            rt = epoll_wait(m_epfd, events, 64, (int)next_timeout);
-            //如果rt < 0 && errno == EINTR，表示在等待过程中被中断，这种情况下不需要处理，直接继续下一次循环。否则，就是等待过程正常结束，可以退出循环。
-            if(rt < 0 && errno == EINTR) {
-            } else {
-                break;
-            }
-        } while(true);
+        int batch = 0;
+        bool waited = !hasPendingTask() && !stopping();
+        if(waited) {
+            ++m_polls;
+            //没有定时器时是~0ull，同样取较小的那个值作为等待时间
+            next_timeout = std::min(next_timeout, (uint64_t)g_iomanager_max_timeout->getValue());
+            //io_uring后端在轮询线程的位置上把完成事件拷贝出来，让出位置之后再处理
+            batch = PrepareBatch(m_ring);
+            rt = m_ring ? waitRing(t_cqes.data(), batch, next_timeout)
+                        : waitEpoll(isSharded() ? m_shardFds[worker] : m_epfd
+                                    , t_events.data(), batch, next_timeout);
+        }
+        //先让出轮询的位置，处理事件时唤醒的线程可以接替
+        m_poller = -1;
 
         //处理已经过期的定时器回调任务
         std::vector<std::function<void()> > cbs;
@@ -339,62 +671,20 @@ void IOManager::idle() {
             //CAPTAIN_LOG_DEBUG(g_logger) << "on timer cbs.size=" << cbs.size();
             //这些过期任务放入调度队列，以便后续调度执行
             schedule(cbs.begin(), cbs.end());
-            cbs.clear();
         }
 
-        for(int i = 0; i < rt; ++i) { //循环遍历就绪的事件数组 events，rt 表示就绪的事件数量。
-            epoll_event& event = events[i];
-            if(event.data.fd == m_tickleFds[0]) { //m_tickleFds[0]，则说明这是管道的读端（用于通知唤醒）的事件。
-                uint8_t dummy;
-                while(read(m_tickleFds[0], &dummy, 1) == 1);
-                continue; //读到没有数据就继续下面
-            }
-            //处理非管道事件
-            FdContext* fd_ctx = (FdContext*)event.data.ptr;
-            FdContext::MutexType::Lock lock(fd_ctx->mutex);
-            //如果事件的标志中包含了 EPOLLERR 或 EPOLLHUP，说明发生了错误或挂起事件
-            if(event.events & (EPOLLERR | EPOLLHUP)) {
-                //将 EPOLLIN 和 EPOLLOUT 事件也加入到 event.events 标志中，以确保错误或挂起事件被同时处理。
-                //这样做的原因是，当发生错误或挂起事件时，通常也需要读取或写入数据来清除错误状态。通过将 EPOLLIN 和 
-                //EPOLLOUT 事件加入到事件标志中，确保了在处理错误或挂起事件时，也能够正确地读取或写入数据，
-                //以便将文件描述符的状态恢复到正常。
-                event.events |= EPOLLIN | EPOLLOUT;
-            }
-            //根据 event.events 的值，将实际的事件类型存储在 real_events 变量中
-            int real_events = NONE;
-            //如果 event.events 包含 EPOLLIN 标志，就将 READ 事件添加到 real_events 中
-            if(event.events & EPOLLIN) {
-                real_events |= READ;
-            }
-            if(event.events & EPOLLOUT) {
-                real_events |= WRITE;
-            }
-            
-            if((fd_ctx->events & real_events) == NONE) {//判断当前事件类型是否在文件描述符上下文的事件集合中
-                continue;
-            }
-            //首先计算出剩余关注的事件类型，即从 fd_ctx->events 中排除掉当前已经触发的 real_events。
-            int left_events = (fd_ctx->events & ~real_events);
-            //根据剩余的事件类型，判断是应该修改还是删除当前文件描述符上的事件监听。
-            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            event.events = EPOLLET | left_events;
-
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if(rt2) {
-                CAPTAIN_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                    << op << "," << fd_ctx->fd << "," << event.events << "):"
-                    << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
-                continue;
-            }
+        bool tickled = false;
+        int io_events = m_ring ? processRing(t_cqes.data(), rt, tickled)
+                               : processEpoll(isSharded() ? m_wakeFds[worker] : m_tickleFd
+                                    , t_events.data(), rt, tickled);
+        if(waited) {
+            recordBatch(rt, batch, io_events);
+        }
 
-            if(real_events & READ) {
-                fd_ctx->triggerEvent(READ);
-                --m_pendingEventCount;
-            }
-            if(real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
-                --m_pendingEventCount;
-            }
+        //只被tickle()叫醒，却没有任务、定时器和IO事件要处理
+        if(tickled && !io_events && cbs.empty()
+                && !hasPendingTask() && !stopping()) {
+            ++m_spuriousWakeups;
         }
         
         //在协程调度的框架下，实现协程的切换，从而实现多个协程在单线程中并发执行。
@@ -405,10 +695,234 @@ void IOManager::idle() {
 
         raw_ptr->swapOut();
     }
+    if(retiring) {
+        return;
+    }
+    //调度器要退出了，叫醒其他还在休眠的线程
+    while(wakeSleeper()) {
+    }
+    wakePoller();
+}
+
+int IOManager::waitEpoll(int epfd, epoll_event* events, int count, uint64_t timeout) {
+    int rt = 0;
+    do {
+        rt = epoll_wait(epfd, events, count, (int)timeout);
+        //如果rt < 0 && errno == EINTR，表示在等待过程中被中断，这种情况下不需要处理，直接继续下一次循环。否则，就是等待过程正常结束，可以退出循环。
+    } while(rt < 0 && errno == EINTR);
+    return rt;
+}
+
+int IOManager::processEpoll(int wake_fd, epoll_event* events, int count, bool& tickled) {
+    int io_events = 0;
+    for(int i = 0; i < count; ++i) { //循环遍历就绪的事件数组 events，count 表示就绪的事件数量。
+        epoll_event& event = events[i];
+        if(event.data.fd == wake_fd) { //tickle()写入的唤醒事件，读一次清空计数
+            uint64_t dummy;
+            while(read(wake_fd, &dummy, sizeof(dummy)) == sizeof(dummy));
+            tickled = true;
+            continue;
+        }
+        ++io_events;
+        //处理非管道事件
+        FdContext* fd_ctx = (FdContext*)event.data.ptr;
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        //如果事件的标志中包含了 EPOLLERR 或 EPOLLHUP，说明发生了错误或挂起事件
+        if(event.events & (EPOLLERR | EPOLLHUP)) {
+            //将 EPOLLIN 和 EPOLLOUT 事件也加入到 event.events 标志中，以确保错误或挂起事件被同时处理。
+            //这样做的原因是，当发生错误或挂起事件时，通常也需要读取或写入数据来清除错误状态。通过将 EPOLLIN 和 
+            //EPOLLOUT 事件加入到事件标志中，确保了在处理错误或挂起事件时，也能够正确地读取或写入数据，
+            //以便将文件描述符的状态恢复到正常。
+            event.events |= EPOLLIN | EPOLLOUT;
+        }
+        //根据 event.events 的值，将实际的事件类型存储在 real_events 变量中
+        int real_events = NONE;
+        //如果 event.events 包含 EPOLLIN 标志，就将 READ 事件添加到 real_events 中
+        if(event.events & EPOLLIN) {
+            real_events |= READ;
+        }
+        if(event.events & EPOLLOUT) {
+            real_events |= WRITE;
+        }
+        
+        //没有协程在等的方向记下来，下次注册时直接唤醒，边沿触发不会再报告一次
+        fd_ctx->ready = (Event)(fd_ctx->ready | (real_events & ~fd_ctx->events));
+        //出错或者挂起时两个方向都报告了，只触发注册过的方向
+        real_events &= fd_ctx->events;
+        if(real_events == NONE) {//判断当前事件类型是否在文件描述符上下文的事件集合中
+            continue;
+        }
+        //注册一直保留，不需要epoll_ctl
+
+        if(real_events & READ) {
+            fd_ctx->triggerEvent(READ);
+            --m_pendingEventCount;
+        }
+        if(real_events & WRITE) {
+            fd_ctx->triggerEvent(WRITE);
+            --m_pendingEventCount;
+        }
+    }
+    return io_events;
+}
+
+void IOManager::assignOwner(FdContext* fd_ctx) {
+    //use_caller线程在stop()之前不进入调度，不能负责句柄
+    size_t offset = m_rootThread == -1 ? 0 : 1;
+    int worker = GetWorkerIndex();
+    if(Scheduler::GetThis() == this && worker >= (int)offset) {
+        fd_ctx->owner = worker;
+        return;
+    }
+    //调度器外的线程注册时按句柄分到正在运行的线程上，分片模式下线程不会退出，它们的下标是连续的
+    size_t threads = m_threadCount;
+    fd_ctx->owner = threads ? offset + fd_ctx->fd % threads : 0;
+}
+
+void IOManager::pollShard(int worker) {
+    //定时器由轮询线程负责，这里只等自己负责的句柄和唤醒
+    int batch = PrepareBatch(false);
+    int rt = waitEpoll(m_shardFds[worker], t_events.data(), batch
+            , g_iomanager_max_timeout->getValue());
+    bool tickled = false;
+    int io_events = processEpoll(m_wakeFds[worker], t_events.data(), rt, tickled);
+    recordBatch(rt, batch, io_events);
+}
+
+void IOManager::recordBatch(int count, int batch, int io_events) {
+    //一批取满了说明还有事件没取出来，本线程下次多取一倍，少走几趟Scheduler::run
+    if(count >= batch) {
+        ++m_fullBatches;
+        t_batch = batch * 2;
+    }
+    int bucket = io_events > 0 ? 32 - __builtin_clz(io_events) : 0;
+    ++m_eventsHistogram[std::min(bucket, EVENTS_HISTOGRAM_SIZE - 1)];
+}
+
+IOManager::EventStats IOManager::getEventStats() const {
+    EventStats stats;
+    stats.fullBatches = m_fullBatches;
+    for(auto& i : m_eventsHistogram) {
+        stats.histogram.push_back(i);
+    }
+    return stats;
+}
+
+bool IOManager::ringSubmit(FdContext* fd_ctx, Event event, uint16_t seq, const IoRequest* req) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = fd_ctx->fd;
+    sqe.user_data = MakeRingData(fd_ctx, event, seq);
+    if(req) {
+        sqe.opcode = req->opcode;
+        sqe.addr = (uint64_t)req->addr;
+        sqe.len = req->len;
+        sqe.addr2 = req->addr2;
+        sqe.msg_flags = req->flags;
+    } else {
+        //单次的poll，触发之后自动移除，和epoll路径触发之后删除注册一样
+        sqe.opcode = IORING_OP_POLL_ADD;
+        sqe.poll32_events = event == READ ? POLLIN : POLLOUT;
+    }
+    int rt = m_ring->submit(sqe);
+    if(rt) {
+        CAPTAIN_LOG_ERROR(g_logger) << "io_uring submit(" << fd_ctx->fd << ", "
+            << (int)sqe.opcode << "): (" << -rt << ") (" << strerror(-rt) << ")";
+        return false;
+    }
+    return true;
+}
+
+void IOManager::ringCancel(FdContext* fd_ctx, Event event) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = -1;
+    sqe.addr = MakeRingData(fd_ctx, event, fd_ctx->getContext(event).seq);
+    int rt = m_ring->submit(sqe);
+    if(rt) {
+        CAPTAIN_LOG_ERROR(g_logger) << "io_uring cancel(" << fd_ctx->fd << ", "
+            << event << "): (" << -rt << ") (" << strerror(-rt) << ")";
+    }
+}
+
+void IOManager::ringArmTickle() {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    //多次触发的poll，一次提交一直有效，被内核结束时再重新提交。
+    //不支持多次触发时是单次的poll，每次唤醒之后重新提交
+    sqe.opcode = IORING_OP_POLL_ADD;
+    sqe.fd = m_tickleFd;
+    sqe.poll32_events = POLLIN;
+    if(m_tickleMultishot) {
+        sqe.len = IORING_POLL_ADD_MULTI;
+    }
+    sqe.user_data = TICKLE_DATA;
+    int rt = m_ring->submit(sqe);
+    CAPTAIN_ASSERT2(!rt, "io_uring arm tickle fd fail");
+}
+
+int IOManager::waitRing(io_uring_cqe* cqes, int count, uint64_t timeout) {
+    int n = m_ring->reap(cqes, count);
+    if(n) {
+        return n;
+    }
+    int rt = 0;
+    do {
+        rt = m_ring->wait(timeout);
+    } while(rt == -EINTR);
+    return m_ring->reap(cqes, count);
+}
+
+int IOManager::processRing(io_uring_cqe* cqes, int count, bool& tickled) {
+    int io_events = 0;
+    for(int i = 0; i < count; ++i) {
+        io_uring_cqe& cqe = cqes[i];
+        if(!cqe.user_data) { //取消请求自己的完成事件
+            continue;
+        }
+        if(cqe.user_data == TICKLE_DATA) {
+            if(cqe.res == -EINVAL && m_tickleMultishot) {
+                //IORING_POLL_ADD_MULTI要5.13，5.11和5.12上马上以EINVAL结束，
+                //照原样重新提交的话轮询线程会一直空转
+                CAPTAIN_LOG_WARN(g_logger) << "IOManager name=" << getName()
+                    << " io_uring multishot poll not supported, re-arm tickle poll on every wakeup";
+                m_tickleMultishot = false;
+            } else {
+                uint64_t dummy;
+                while(read(m_tickleFd, &dummy, sizeof(dummy)) == sizeof(dummy));
+                tickled = true;
+            }
+            if(!(cqe.flags & IORING_CQE_F_MORE)) {
+                ringArmTickle();
+            }
+            continue;
+        }
+        ++io_events;
+        FdContext* fd_ctx = (FdContext*)(cqe.user_data & RING_PTR_MASK);
+        Event event = (Event)(cqe.user_data & RING_EVENT_MASK);
+        uint16_t seq = cqe.user_data >> 48;
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+        //注册已经被delEvent删除了
+        if(!(fd_ctx->events & event) || event_ctx.seq != seq) {
+            continue;
+        }
+        if(event_ctx.result) {
+            *event_ctx.result = cqe.res;
+            event_ctx.result = nullptr;
+        }
+        fd_ctx->triggerEvent(event);
+        --m_pendingEventCount;
+    }
+    return io_events;
 }
 
 void IOManager::onTimerInsertedAtFront() {
-    tickle();
+    //只有轮询线程需要重新计算epoll_wait的超时时间
+    if(!wakePoller()) {
+        tickle();
+    }
 }
 
 }
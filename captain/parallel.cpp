@@ -0,0 +1,115 @@
+#include "include/parallel.h"
+#include "include/fiber_sync.h"
+#include "include/log.h"
+#include "include/macro.h"
+#include <exception>
+#include <sched.h>
+
+namespace captain {
+
+namespace {
+
+//一次并行调用的共享状态。投递出去的任务可能在调用者返回之后才执行，所以用shared_ptr持有，
+//那时待处理栈已经空了，任务不会再访问body
+struct ParallelContext : public std::enable_shared_from_this<ParallelContext> {
+    typedef std::shared_ptr<ParallelContext> ptr;
+    typedef Spinlock MutexType;
+
+    ParallelContext(Scheduler* s, size_t g, const std::function<void(size_t, size_t)>& b)
+        :scheduler(s)
+        ,grain(g)
+        ,body(b) {
+    }
+
+    //处理[b, e)，大于粒度时把右半部分留给别的线程
+    void process(size_t b, size_t e) {
+        while(e - b > grain) {
+            size_t mid = b + (e - b) / 2;
+            push(mid, e);
+            e = mid;
+        }
+        try {
+            body(b, e);
+        } catch(...) {
+            MutexType::Lock lock(mutex);
+            if(!exception) {
+                exception = std::current_exception();
+            }
+        }
+    }
+
+    void push(size_t b, size_t e) {
+        wg.add();
+        {
+            MutexType::Lock lock(mutex);
+            ranges.push_back(std::make_pair(b, e));
+        }
+        ParallelContext::ptr self = shared_from_this();
+        scheduler->schedule([self]() {
+            self->help();
+        });
+    }
+
+    //后压进去的区间更小，也更可能还在缓存里，先取它
+    bool pop(std::pair<size_t, size_t>& range) {
+        MutexType::Lock lock(mutex);
+        if(ranges.empty()) {
+            return false;
+        }
+        range = ranges.back();
+        ranges.pop_back();
+        return true;
+    }
+
+    //把待处理栈里的区间做完
+    void help() {
+        std::pair<size_t, size_t> range;
+        while(pop(range)) {
+            process(range.first, range.second);
+            wg.done();
+        }
+    }
+
+    Scheduler* scheduler;
+    size_t grain;
+    const std::function<void(size_t, size_t)>& body;
+    MutexType mutex;
+    std::vector<std::pair<size_t, size_t> > ranges;
+    std::exception_ptr exception;
+    WaitGroup wg;
+};
+
+}
+
+void ParallelInvoke(Scheduler* scheduler, size_t begin, size_t end, size_t grain
+                , const std::function<void(size_t, size_t)>& body) {
+    if(begin >= end) {
+        return;
+    }
+    if(grain == 0) {
+        //每个线程大约分到8块，负载不均匀时也能互相分担
+        size_t workers = scheduler->getThreadCount() + 1;
+        grain = std::max((end - begin) / (workers * 8), (size_t)1);
+    }
+    if(end - begin <= grain) {
+        body(begin, end);
+        return;
+    }
+
+    ParallelContext::ptr ctx = std::make_shared<ParallelContext>(scheduler, grain, body);
+    ctx->process(begin, end);
+    ctx->help();
+    //剩下的区间都已经被别的线程取走了，等它们做完
+    if(Scheduler::GetThis() && Fiber::GetThis().get() != Scheduler::GetMainFiber()) {
+        ctx->wg.wait();
+    } else {
+        while(ctx->wg.getCount() > 0) {
+            sched_yield();
+        }
+    }
+    if(ctx->exception) {
+        std::rethrow_exception(ctx->exception);
+    }
+}
+
+}
@@ -0,0 +1,335 @@
+#include "include/profiler.h"
+#include "include/config.h"
+#include "include/fiber.h"
+#include "include/log.h"
+#include "include/thread.h"
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace captain {
+
+static Logger::ptr g_logger = CAPTAIN_LOG_NAME("system");
+
+static ConfigVar<bool>::ptr g_profiler_enable =
+    Config::Lookup<bool>("profiler.enable", false, "sample cpu with SIGPROF, can be switched at runtime");
+static ConfigVar<uint32_t>::ptr g_profiler_hz =
+    Config::Lookup<uint32_t>("profiler.hz", 99, "profiler samples per second of cpu time");
+
+//跳过信号处理函数和信号返回的栈帧
+static const int SKIP_FRAMES = 2;
+
+namespace {
+
+struct Sample {
+    uint64_t fiberId;
+    const char* tag;
+    int depth;
+    void* frames[Profiler::MAX_FRAMES];
+};
+
+/* 每个线程一个的环形缓冲区
+1、只有所属线程的信号处理函数写head，只有持有锁的Dump读tail，不需要加锁
+2、用mmap分配，信号处理函数里第一次采到这个线程时创建，挂到全局链表上之后不再释放
+3、线程退出之后缓冲区留给新的线程接着用
+ */
+struct SampleBuffer {
+    std::atomic<pid_t> owner;
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    SampleBuffer* next;
+    Sample samples[Profiler::BUFFER_SAMPLES];
+};
+
+struct StackKey {
+    const char* tag;
+    uint64_t fiberId;
+    std::vector<void*> frames;
+
+    bool operator<(const StackKey& rhs) const {
+        if(tag != rhs.tag) {
+            return tag < rhs.tag;
+        }
+        if(fiberId != rhs.fiberId) {
+            return fiberId < rhs.fiberId;
+        }
+        return frames < rhs.frames;
+    }
+};
+
+struct ProfilerData {
+    typedef Mutex MutexType;
+    MutexType mutex;
+    bool installed = false;
+    std::map<StackKey, uint64_t> stacks;
+    std::set<std::string> tags;
+};
+
+static ProfilerData& GetData() {
+    //信号处理函数和退出中的线程还可能用到标签字符串，不释放
+    static ProfilerData* s_data = new ProfilerData;
+    return *s_data;
+}
+
+}
+
+static std::atomic<SampleBuffer*> s_buffers {nullptr};
+static thread_local SampleBuffer* t_buffer = nullptr;
+static std::atomic<bool> s_running {false};
+static std::atomic<uint64_t> s_samples {0};
+static std::atomic<uint64_t> s_dropped {0};
+
+//在信号处理函数里调用，只能用系统调用和原子操作
+static SampleBuffer* AcquireBuffer() {
+    pid_t tid = syscall(SYS_gettid);
+    pid_t pid = getpid();
+    for(SampleBuffer* b = s_buffers.load(std::memory_order_acquire); b; b = b->next) {
+        pid_t owner = b->owner.load(std::memory_order_relaxed);
+        //原来的线程还在就不能用
+        if(owner != tid && syscall(SYS_tgkill, pid, owner, 0) == 0) {
+            continue;
+        }
+        if(b->owner.compare_exchange_strong(owner, tid)) {
+            t_buffer = b;
+            return b;
+        }
+    }
+    void* p = mmap(nullptr, sizeof(SampleBuffer), PROT_READ | PROT_WRITE
+            , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        return nullptr;
+    }
+    //mmap出来的内存已经清零
+    SampleBuffer* b = (SampleBuffer*)p;
+    b->owner.store(tid, std::memory_order_relaxed);
+    SampleBuffer* head = s_buffers.load(std::memory_order_relaxed);
+    do {
+        b->next = head;
+    } while(!s_buffers.compare_exchange_weak(head, b
+                , std::memory_order_release, std::memory_order_relaxed));
+    t_buffer = b;
+    return b;
+}
+
+static void OnProfSignal(int sig) {
+    if(!s_running.load(std::memory_order_relaxed)) {
+        return;
+    }
+    int saved_errno = errno;
+    SampleBuffer* b = t_buffer ? t_buffer : AcquireBuffer();
+    uint32_t head = b ? b->head.load(std::memory_order_relaxed) : 0;
+    if(!b || head - b->tail.load(std::memory_order_acquire) >= Profiler::BUFFER_SAMPLES) {
+        ++s_dropped;
+    } else {
+        Sample& s = b->samples[head % Profiler::BUFFER_SAMPLES];
+        Fiber* fiber = Fiber::PeekThis();
+        s.fiberId = fiber ? fiber->getId() : 0;
+        s.tag = fiber ? fiber->getTag() : nullptr;
+        s.depth = ::backtrace(s.frames, Profiler::MAX_FRAMES);
+        b->head.store(head + 1, std::memory_order_release);
+        ++s_samples;
+    }
+    errno = saved_errno;
+}
+
+//把各线程缓冲区里的样本合并到stacks，需要持有锁
+static void Drain(ProfilerData& data) {
+    StackKey key;
+    for(SampleBuffer* b = s_buffers.load(std::memory_order_acquire); b; b = b->next) {
+        uint32_t tail = b->tail.load(std::memory_order_relaxed);
+        uint32_t head = b->head.load(std::memory_order_acquire);
+        for(; tail != head; ++tail) {
+            const Sample& s = b->samples[tail % Profiler::BUFFER_SAMPLES];
+            key.tag = s.tag;
+            key.fiberId = s.fiberId;
+            if(s.depth > SKIP_FRAMES) {
+                key.frames.assign(s.frames + SKIP_FRAMES, s.frames + s.depth);
+            } else {
+                key.frames.clear();
+            }
+            ++data.stacks[key];
+        }
+        b->tail.store(tail, std::memory_order_release);
+    }
+}
+
+//函数名，没有符号时用模块名加偏移。返回地址指向调用的下一条指令，查符号时减1
+static std::string Symbolize(void* addr, bool return_address) {
+    void* lookup = return_address ? (char*)addr - 1 : addr;
+    Dl_info info;
+    std::string name;
+    if(dladdr(lookup, &info) && info.dli_sname) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        name = status == 0 && demangled ? demangled : info.dli_sname;
+        free(demangled);
+    } else if(info.dli_fname) {
+        const char* base = strrchr(info.dli_fname, '/');
+        std::stringstream ss;
+        ss << (base ? base + 1 : info.dli_fname) << "+0x" << std::hex
+           << ((char*)lookup - (char*)info.dli_fbase);
+        name = ss.str();
+    } else {
+        std::stringstream ss;
+        ss << addr;
+        name = ss.str();
+    }
+    //folded格式用分号分隔栈帧
+    for(auto& c : name) {
+        if(c == ';') {
+            c = ':';
+        }
+    }
+    return name;
+}
+
+bool Profiler::Start(uint32_t hz) {
+    ProfilerData& data = GetData();
+    ProfilerData::MutexType::Lock lock(data.mutex);
+    if(!hz) {
+        hz = g_profiler_hz->getValue();
+    }
+    hz = std::max(hz, (uint32_t)1);
+    if(!data.installed) {
+        //backtrace()第一次调用时会加载libgcc，先在正常的上下文里调用一次
+        void* frame;
+        ::backtrace(&frame, 1);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &OnProfSignal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if(sigaction(SIGPROF, &sa, nullptr)) {
+            CAPTAIN_LOG_ERROR(g_logger) << "Profiler install SIGPROF handler fail errno=" << errno
+                << " errstr=" << strerror(errno);
+            return false;
+        }
+        //停止之后可能还有没处理的SIGPROF，处理函数一直保留，否则默认动作会结束进程
+        data.installed = true;
+    }
+    struct itimerval timer;
+    uint32_t usec = std::max(1000000 / hz, (uint32_t)1);
+    timer.it_interval.tv_sec = usec / 1000000;
+    timer.it_interval.tv_usec = usec % 1000000;
+    timer.it_value = timer.it_interval;
+    s_running = true;
+    if(setitimer(ITIMER_PROF, &timer, nullptr)) {
+        s_running = false;
+        CAPTAIN_LOG_ERROR(g_logger) << "Profiler setitimer fail errno=" << errno
+            << " errstr=" << strerror(errno);
+        return false;
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "Profiler start hz=" << hz;
+    return true;
+}
+
+void Profiler::Stop() {
+    ProfilerData& data = GetData();
+    ProfilerData::MutexType::Lock lock(data.mutex);
+    if(!s_running) {
+        return;
+    }
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    s_running = false;
+    Drain(data);
+    CAPTAIN_LOG_INFO(g_logger) << "Profiler stop samples=" << s_samples
+        << " dropped=" << s_dropped;
+}
+
+bool Profiler::IsRunning() {
+    return s_running;
+}
+
+std::string Profiler::Dump(bool per_fiber) {
+    ProfilerData& data = GetData();
+    ProfilerData::MutexType::Lock lock(data.mutex);
+    Drain(data);
+
+    std::map<void*, std::string> names;
+    std::map<std::string, uint64_t> folded;
+    for(auto& i : data.stacks) {
+        const StackKey& key = i.first;
+        std::stringstream ss;
+        ss << (key.tag ? key.tag : (key.fiberId ? "fiber" : "thread"));
+        if(per_fiber && key.fiberId) {
+            ss << ";fiber#" << key.fiberId;
+        }
+        //调用栈从外往里输出，最后一帧是被打断的位置
+        for(size_t n = key.frames.size(); n > 0; --n) {
+            void* addr = key.frames[n - 1];
+            auto it = names.find(addr);
+            if(it == names.end()) {
+                it = names.insert(std::make_pair(addr, Symbolize(addr, n > 1))).first;
+            }
+            ss << ";" << it->second;
+        }
+        folded[ss.str()] += i.second;
+    }
+
+    std::stringstream ss;
+    for(auto& i : folded) {
+        ss << i.first << " " << i.second << std::endl;
+    }
+    return ss.str();
+}
+
+void Profiler::Reset() {
+    ProfilerData& data = GetData();
+    ProfilerData::MutexType::Lock lock(data.mutex);
+    Drain(data);
+    data.stacks.clear();
+    s_samples = 0;
+    s_dropped = 0;
+}
+
+uint64_t Profiler::GetSamples() {
+    return s_samples;
+}
+
+uint64_t Profiler::GetDropped() {
+    return s_dropped;
+}
+
+const char* Profiler::Tag(const std::string& name) {
+    ProfilerData& data = GetData();
+    ProfilerData::MutexType::Lock lock(data.mutex);
+    return data.tags.insert(name).first->c_str();
+}
+
+struct _ProfilerIniter {
+    _ProfilerIniter() {
+        g_profiler_enable->addListener([](const bool& old_value, const bool& new_value){
+                if(new_value) {
+                    Profiler::Start();
+                } else {
+                    Profiler::Stop();
+                }
+        });
+        g_profiler_hz->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+                if(Profiler::IsRunning()) {
+                    Profiler::Start(new_value);
+                }
+        });
+    }
+};
+
+static _ProfilerIniter s_profiler_initer;
+
+}
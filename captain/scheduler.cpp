@@ -2,23 +2,173 @@
 #include "include/log.h"
 #include "include/macro.h"
 #include "include/hook.h"
+#include "include/config.h"
+#include "include/util.h"
+#include <algorithm>
+#include <execinfo.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 namespace captain {
 
 static captain::Logger::ptr g_logger = CAPTAIN_LOG_NAME("system");
+
+static ConfigVar<uint32_t>::ptr g_scheduler_starvation_interval =
+    Config::Lookup<uint32_t>("scheduler.starvation_interval", 8,
+            "lane i is served first once every interval^i pops");
+
+static ConfigVar<bool>::ptr g_scheduler_drop_expired =
+    Config::Lookup<bool>("scheduler.drop_expired", false,
+            "drop tasks whose deadline has passed instead of running them");
+
+static ConfigVar<uint32_t>::ptr g_scheduler_grow_latency =
+    Config::Lookup<uint32_t>("scheduler.grow_latency_ms", 20,
+            "add a thread when a task waited longer than this in the queue");
+
+static ConfigVar<uint32_t>::ptr g_scheduler_grow_interval =
+    Config::Lookup<uint32_t>("scheduler.grow_interval_ms", 100,
+            "minimum time between two thread additions");
+
+static ConfigVar<uint32_t>::ptr g_scheduler_shrink_idle =
+    Config::Lookup<uint32_t>("scheduler.shrink_idle_ms", 30000,
+            "a thread idle for longer than this exits");
+
+static ConfigVar<uint32_t>::ptr g_scheduler_stall_threshold =
+    Config::Lookup<uint32_t>("scheduler.stall_threshold_ms", 0,
+            "report a task that runs longer than this without yielding, 0 (default) disables the watchdog. "
+            "the watchdog sends SIGURG to a stalled thread to capture its stack, unless the process already handles SIGURG");
+
+static ConfigVar<uint32_t>::ptr g_scheduler_time_slice =
+    Config::Lookup<uint32_t>("scheduler.time_slice_ms", 10,
+            "maybe_yield() gives up the thread after a task has run this long");
+
+//取任务的热路径上不读ConfigVar，配置变化时通过监听器更新
+static uint32_t s_starvation_interval = 8;
+static bool s_drop_expired = false;
+static uint32_t s_grow_latency = 20;
+static uint32_t s_grow_interval = 100;
+static uint32_t s_shrink_idle = 30000;
+static uint32_t s_stall_threshold = 0;
+static uint32_t s_time_slice = 10;
+struct _SchedulerIniter {
+    _SchedulerIniter() {
+        s_starvation_interval = g_scheduler_starvation_interval->getValue();
+        s_drop_expired = g_scheduler_drop_expired->getValue();
+        s_grow_latency = g_scheduler_grow_latency->getValue();
+        s_grow_interval = g_scheduler_grow_interval->getValue();
+        s_shrink_idle = g_scheduler_shrink_idle->getValue();
+        s_stall_threshold = g_scheduler_stall_threshold->getValue();
+        s_time_slice = g_scheduler_time_slice->getValue();
+        g_scheduler_starvation_interval->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+                CAPTAIN_LOG_INFO(g_logger) << "scheduler starvation interval changed from "
+                                         << old_value << " to " << new_value;
+                s_starvation_interval = new_value;
+        });
+        g_scheduler_drop_expired->addListener([](const bool& old_value, const bool& new_value){
+                CAPTAIN_LOG_INFO(g_logger) << "scheduler drop expired changed from "
+                                         << old_value << " to " << new_value;
+                s_drop_expired = new_value;
+        });
+        g_scheduler_grow_latency->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+                s_grow_latency = new_value;
+        });
+        g_scheduler_grow_interval->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+                s_grow_interval = new_value;
+        });
+        g_scheduler_shrink_idle->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+                s_shrink_idle = new_value;
+        });
+        g_scheduler_stall_threshold->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+                s_stall_threshold = new_value;
+        });
+        g_scheduler_time_slice->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+                s_time_slice = new_value;
+        });
+    }
+};
+
+static _SchedulerIniter s_scheduler_initer;
 //当前线程所属的调度器对象的指针
 static thread_local Scheduler* t_scheduler = nullptr;
 //当前协程的主协程函数
 static thread_local Fiber* t_fiber = nullptr;
+//当前线程在所属调度器中的工作线程下标，-1表示不是工作线程
+static thread_local int t_worker = -1;
+//当前任务协程swapIn的时间，0表示没有在执行任务，maybe_yield()用它判断时间片
+static thread_local uint64_t t_slice_start = 0;
+//当前协程是因为时间片用完才让出的，run()把它重新入队时放到全局队列
+static thread_local bool t_slice_yielded = false;
+
+//时间片用粗粒度的单调时钟，精度是几毫秒，但是读一次只要几纳秒
+static uint64_t GetSliceMS() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+}
+
+//看门狗用这个信号打断卡住的线程来采集调用栈，SIGURG只在socket收到带外数据时产生，默认被忽略
+static const int STALL_SIGNAL = SIGURG;
+//信号处理函数装上了才发信号，否则只报告不采集调用栈
+static bool s_stall_signal = false;
+
+static bool InstallStallHandler(void (*handler)(int)) {
+    //用户自己处理了SIGURG（比如用带外数据）就不覆盖
+    struct sigaction old;
+    if(sigaction(STALL_SIGNAL, nullptr, &old) != 0) {
+        return false;
+    }
+    if((old.sa_flags & SA_SIGINFO) || (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN)) {
+        CAPTAIN_LOG_WARN(g_logger) << "SIGURG already has a handler, the stall watchdog "
+            "reports stalled tasks without their call stack";
+        return false;
+    }
+    //backtrace()第一次调用时会加载libgcc，先在正常的上下文里调用一次
+    void* frame;
+    ::backtrace(&frame, 1);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(STALL_SIGNAL, &sa, nullptr) == 0;
+}
+
+//截止时间晚的排在堆的下面
+static bool DeadlineLater(const Task* a, const Task* b) {
+    return a->deadline > b->deadline;
+}
+
+//在回调协程里执行任务节点中的回调函数，结束后（包括抛出异常）回收节点
+static void RunTask(Task* task) {
+    struct Guard {
+        Task* task;
+        ~Guard() { Task::Destroy(task);}
+    } guard = {task};
+    task->call();
+}
 
-Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name
+                    , size_t max_threads)
     :m_name(name) {
     CAPTAIN_ASSERT(threads > 0);
+    if(max_threads < threads) {
+        max_threads = threads;
+    }
+    for(auto& i : m_globalCount) {
+        i = 0;
+    }
 
     if(use_caller) { //当前线程将执行协程调度器的任务。
         //如果该线程没有协程，GetThis()会初始化一个主协程
         captain::Fiber::GetThis();//创建当前线程的根协程（root fiber）并将其与当前线程绑定，以便当前线程能够参与协程调度。
         --threads; //因为当前线程已经作为调度器的一个工作线程。
+        --max_threads;
         
         //确保在当前线程之前没有设置调度器对象。因为一个线程只能有一个调度器对象。
         CAPTAIN_ASSERT(GetThis() == nullptr);
@@ -36,11 +186,36 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
         m_rootThread = -1;
     }
     m_threadCount = threads;
+    m_minThreads = threads;
+    m_maxThreads = max_threads;
+
+    //每个工作线程（包括use_caller线程）一个本地队列，按线程数上限分配，线程退出后槽位可以复用
+    size_t workers = m_maxThreads + (use_caller ? 1 : 0);
+    for(size_t i = 0; i < workers; ++i) {
+        m_workers.emplace_back(new WorkerQueue);
+    }
+    //use_caller线程固定使用下标0
+    if(use_caller) {
+        m_workers[0]->threadId = m_rootThread;
+    }
 }
 
 Scheduler::~Scheduler() {
     //在析构函数中，应该确保调度器处于停止状态，以避免在调度器还在运行时被析构。
     CAPTAIN_ASSERT(m_stopping);
+    for(auto& i : m_fibers) {
+        i.clear();
+    }
+    for(auto i : m_deadlines) {
+        Task::Destroy(i);
+    }
+    m_deadlines.clear();
+    for(auto& i : m_workers) {
+        for(auto& j : i->fibers) {
+            j.clear();
+        }
+        i->mailbox.clear();
+    }
     if(GetThis() == this) { //当前调度器对象是否是当前线程的调度器对象
         t_scheduler = nullptr;
     }
@@ -63,12 +238,20 @@ void Scheduler::start() {
     m_stopping = false;//调度器正在运行中。
     CAPTAIN_ASSERT(m_threads.empty());
     //创建线程池 m_threads：根据之前设置的线程数量 m_threadCount，创建对应数量的线程，并将其存储在 m_threads 容器中。
-    m_threads.resize(m_threadCount);
-    //将线程 ID 添加到 m_threadIds
+    //按线程数上限留出位置，扩容时启动的线程放在后面
+    m_threads.resize(m_maxThreads);
+    //use_caller线程占用下标0，其余线程依次排在后面
+    size_t offset = m_rootThread == -1 ? 0 : 1;
+    m_threadIds.resize(m_workers.size(), -1);
     for(size_t i = 0; i < m_threadCount; ++i) {
-        m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this)
-                            , m_name + "_" + std::to_string(i)));
-        m_threadIds.push_back(m_threads[i]->getId());
+        startWorker(i + offset);
+    }
+    //看门狗在启动时按配置决定要不要开，之后阈值改成0只是不再报告
+    if(s_stall_threshold) {
+        static bool s_installed = InstallStallHandler(&Scheduler::OnStallSignal);
+        s_stall_signal = s_installed;
+        m_watchdogStop = 0;
+        m_watchdog.reset(new Thread(std::bind(&Scheduler::watchdog, this), m_name + "_wd"));
     }
     lock.unlock();
 
@@ -140,10 +323,21 @@ void Scheduler::stop() {
     {
         MutexType::Lock lock(m_mutex);
         thrs.swap(m_threads);
+        thrs.insert(thrs.end(), m_retiredThreads.begin(), m_retiredThreads.end());
+        m_retiredThreads.clear();
     }
 
     for(auto& i : thrs) {
-        i->join();
+        //没有启动过的槽位是空的，已经退出的线程join会马上返回
+        if(i) {
+            i->join();
+        }
+    }
+    if(m_watchdog) {
+        m_watchdogStop = 1;
+        syscall(SYS_futex, &m_watchdogStop, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+        m_watchdog->join();
+        m_watchdog.reset();
     }
     //if(exit_on_this_fiber) {
     //}
@@ -164,6 +358,10 @@ void Scheduler::run() {
     CAPTAIN_LOG_INFO(g_logger) << "run";
     set_hook_enable(true);
     setThis();
+    if(captain::GetThreadId() == m_rootThread) {
+        t_worker = 0;
+    }
+    CAPTAIN_ASSERT(t_worker >= 0 && t_worker < (int)m_workers.size());
     //return;
     //检查当前线程的 ID 是否等于调度器的根线程 ID
     if(captain::GetThreadId() != m_rootThread) {
@@ -173,77 +371,93 @@ void Scheduler::run() {
     Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
     Fiber::ptr cb_fiber; //回调函数  function函数的协程
 
-    FiberAndThread ft;
     while(true) {
-        ft.reset();
-        bool tickle_me = false;
-        bool is_active = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            auto it = m_fibers.begin();
-            while(it != m_fibers.end()) {
-                if(it->thread != -1 && it->thread != captain::GetThreadId()) {
-                    ++it;
-                    tickle_me = true;
-                    continue;
-                }
+        Task* task = pop();
+        bool is_active = task != nullptr;
 
-                CAPTAIN_ASSERT(it->fiber || it->cb);
-                if(it->fiber && it->fiber->getState() == Fiber::EXEC) {
-                    ++it;
-                    continue;
-                }
-
-                ft = *it;
-                m_fibers.erase(it);
-                ++m_activeThreadCount;
-                is_active = true;
-                break;
+        if(task) {
+            m_workers[t_worker]->idleSince = 0;
+            if(task->enqueued) {
+                maybeGrow(GetCurrentMS() - task->enqueued);
             }
         }
 
-        if(tickle_me) {
-            tickle();
+        if(task && task->deadline && task->deadline < GetCurrentMS()) {
+            ++m_expiredCount;
+            //还没开始执行的任务直接丢弃，已经执行了一半的协程只能让它继续
+            if(s_drop_expired && (!task->fiber || task->fiber->getState() == Fiber::INIT)) {
+                ++m_droppedCount;
+                Task::Destroy(task);
+                --m_activeThreadCount;
+                continue;
+            }
         }
 
-        if(ft.fiber && (ft.fiber->getState() != Fiber::TERM
-                        && ft.fiber->getState() != Fiber::EXCEPT)) {
-            ft.fiber->swapIn();
+        if(task && task->fiber && (task->fiber->getState() != Fiber::TERM
+                        && task->fiber->getState() != Fiber::EXCEPT)) {
+            //把协程从任务节点里swap出来，节点马上回收，整个过程没有引用计数变化
+            Fiber::ptr fiber;
+            fiber.swap(task->fiber);
+            //协程记住这次的优先级，之后被IO事件或定时器唤醒时沿用
+            fiber->m_priority = task->priority;
+            fiber->m_deadline = task->deadline;
+            Task::Destroy(task);
+
+            beginSlice(fiber.get());
+            fiber->swapIn();
+            endSlice();
             --m_activeThreadCount;
 
-            if(ft.fiber->getState() == Fiber::READY) {
-                schedule(ft.fiber);
-            } else if(ft.fiber->getState() != Fiber::TERM
-                    && ft.fiber->getState() != Fiber::EXCEPT) {
-                ft.fiber->m_state = Fiber::HOLD;
+            if(fiber->getState() == Fiber::READY) {
+                schedule(&fiber);
+            } else if(fiber->getState() != Fiber::TERM
+                    && fiber->getState() != Fiber::EXCEPT) {
+                holdFiber(fiber.get());
+            } else {
+                //结束了的协程留给之后的回调函数复用
+                Fiber::Recycle(fiber);
             }
-            ft.reset();
-        } else if(ft.cb) {
+        } else if(task && task->hasCallback()) {
+            //回调函数留在任务节点里，由协程执行完之后回收节点。
+            //lambda只捕获一个指针，std::function 不需要分配堆内存
+            std::function<void()> cb = [task]() {
+                RunTask(task);
+            };
             if(cb_fiber) {
-                cb_fiber->reset(ft.cb);
+                cb_fiber->reset(cb);
             } else {
-                cb_fiber.reset(new Fiber(ft.cb));
+                cb_fiber = Fiber::Create(cb);
             }
-            ft.reset();
+            cb_fiber->m_priority = task->priority;
+            cb_fiber->m_deadline = task->deadline;
+            beginSlice(cb_fiber.get());
             cb_fiber->swapIn();
+            endSlice();
             --m_activeThreadCount;
             if(cb_fiber->getState() == Fiber::READY) {
-                schedule(cb_fiber);
+                schedule(&cb_fiber);
                 cb_fiber.reset();
             } else if(cb_fiber->getState() == Fiber::EXCEPT
                     || cb_fiber->getState() == Fiber::TERM) {
                 cb_fiber->reset(nullptr);
             } else {//if(cb_fiber->getState() != Fiber::TERM) {
-                cb_fiber->m_state = Fiber::HOLD;
+                holdFiber(cb_fiber.get());
                 cb_fiber.reset();
             }
         } else {
+            if(task) {
+                Task::Destroy(task);
+            }
             if(is_active) {
                 --m_activeThreadCount;
                 continue;
             }
             if(idle_fiber->getState() == Fiber::TERM) {
                 CAPTAIN_LOG_INFO(g_logger) << "idle fiber term";
+                if(m_workers[t_worker]->retiring) {
+                    retire();
+                }
+                t_worker = -1;
                 break;
             }
 
@@ -258,21 +472,608 @@ void Scheduler::run() {
     }
 }
 
+int Scheduler::workerOf(int thread) const {
+    //工作线程数很少，直接遍历比维护一张需要加锁的映射表更便宜
+    for(size_t i = 0; i < m_workers.size(); ++i) {
+        if(m_workers[i]->threadId == thread) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool Scheduler::push(Task* task) {
+    //时间片用完让出的协程排到全局队列末尾，放回本地队列的话会马上又被取出来，其他任务还是等不到
+    bool yielded = t_slice_yielded;
+    t_slice_yielded = false;
+    if(task->priority == DEFAULT) {
+        task->priority = task->fiber ? task->fiber->m_priority : NORMAL;
+    }
+    //协程被IO事件或定时器唤醒时沿用原来的截止时间
+    if(!task->deadline && task->fiber) {
+        task->deadline = task->fiber->m_deadline;
+    }
+    CAPTAIN_ASSERT(task->priority >= 0 && task->priority < PRIORITY_COUNT);
+    //线程数可以伸缩时记录入队时间，取出时根据排队时间决定是否扩容
+    if(m_maxThreads > m_minThreads) {
+        task->enqueued = GetCurrentMS();
+    }
+    //共享栈的协程只能回到第一次执行它的线程
+    if(task->thread == -1 && task->fiber && task->fiber->m_thread != -1) {
+        task->thread = task->fiber->m_thread;
+    }
+    //先计数再入队，保证stopping()不会在任务可见之前看到空队列
+    ++m_taskCount;
+    if(task->thread != -1) {
+        //指定了线程的任务直接投递到目标线程的信箱，只唤醒这一个线程
+        int worker = workerOf(task->thread);
+        if(worker != -1) {
+            WorkerQueue& q = *m_workers[worker];
+            bool pushed = false;
+            {
+                WorkerQueue::MutexType::Lock lock(q.mutex);
+                //加锁之后再确认一次，线程可能刚刚退出
+                if(q.threadId == task->thread) {
+                    q.mailbox.push_back(task);
+                    ++m_pinnedCount;
+                    pushed = true;
+                }
+            }
+            if(pushed) {
+                if(t_scheduler != this || t_worker != worker) {
+                    tickleWorker(worker);
+                }
+                return false;
+            }
+        }
+        //线程不属于本调度器，退化为不指定线程
+        CAPTAIN_LOG_WARN(g_logger) << "schedule to unknown thread=" << task->thread
+                                 << " name=" << m_name;
+        task->thread = -1;
+    }
+
+    if(task->deadline) {
+        //带截止时间的任务放在全局的堆里，所有线程按截止时间从早到晚取
+        MutexType::Lock lock(m_mutex);
+        bool need_tickle = m_deadlines.empty();
+        m_deadlines.push_back(task);
+        std::push_heap(m_deadlines.begin(), m_deadlines.end(), DeadlineLater);
+        ++m_deadlineCount;
+        return need_tickle || hasIdleThreads();
+    }
+
+    if(t_scheduler == this && t_worker != -1 && !yielded) {
+        WorkerQueue& q = *m_workers[t_worker];
+        WorkerQueue::MutexType::Lock lock(q.mutex);
+        q.fibers[task->priority].push_back(task);
+        //本线程稍后自己会处理，只有存在空闲线程时才唤醒它们来窃取
+        return hasIdleThreads();
+    }
+
+    MutexType::Lock lock(m_mutex);
+    bool need_tickle = m_fibers[task->priority].empty();
+    m_fibers[task->priority].push_back(task);
+    ++m_globalCount[task->priority];
+    //如果返回值为 true，表示任务队列之前为空，现在有任务可供调度，因此调用者可能需要唤醒调度器以执行任务。
+    //有线程在休眠时也唤醒一个，让外部提交的任务尽快并行起来
+    return need_tickle || hasIdleThreads();
+}
+
+Task* Scheduler::popFrom(TaskQueue& fibers) {
+    for(Task* task = fibers.front(); task; task = TaskQueue::Next(task)) {
+        //协程还没有从其他线程上切出来，暂时不能执行
+        if(task->fiber && isSwitching(task->fiber.get())) {
+            continue;
+        }
+        fibers.erase(task);
+        //先增加活跃线程数再减少任务数，和stopping()的判断顺序对应
+        ++m_activeThreadCount;
+        --m_taskCount;
+        return task;
+    }
+    return nullptr;
+}
+
+bool Scheduler::isSwitching(Fiber* fiber) {
+    if(fiber->getState() != Fiber::EXEC) {
+        return false;
+    }
+    //先登记再复查，和holdFiber()先写状态再看登记的顺序相反，两边至少有一边能看到对方
+    fiber->m_skipped = t_worker;
+    return fiber->getState() == Fiber::EXEC;
+}
+
+void Scheduler::holdFiber(Fiber* fiber) {
+    //上下文已经保存好，写HOLD之后其他线程才可以恢复它
+    fiber->m_state = Fiber::HOLD;
+    int worker = fiber->m_skipped.exchange(-1);
+    if(worker >= 0) {
+        //跳过它的线程可能已经休眠，叫醒它重新取任务
+        tickleWorker(worker);
+    }
+}
+
+Task* Scheduler::steal() {
+    size_t n = m_workers.size();
+    for(size_t i = 1; i < n; ++i) {
+        WorkerQueue& victim = *m_workers[(t_worker + i) % n];
+        TaskQueue stolen;
+        int lane = 0;
+        {
+            WorkerQueue::MutexType::Lock lock(victim.mutex);
+            //只偷最高的非空优先级，从队尾拿走一半，减少和队列主人在队头的竞争
+            while(lane < PRIORITY_COUNT && victim.fibers[lane].empty()) {
+                ++lane;
+            }
+            if(lane == PRIORITY_COUNT) {
+                continue;
+            }
+            size_t count = (victim.fibers[lane].size() + 1) / 2;
+            while(count-- > 0) {
+                stolen.push_front(victim.fibers[lane].pop_back());
+            }
+        }
+        WorkerQueue& self = *m_workers[t_worker];
+        WorkerQueue::MutexType::Lock lock(self.mutex);
+        self.fibers[lane].splice(stolen);
+        Task* task = popFrom(self.fibers[lane]);
+        if(task) {
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void Scheduler::laneOrder(WorkerQueue& self, int order[PRIORITY_COUNT]) {
+    //第i个优先级每 interval^i 次排到最前面一次，队列积压时低优先级也能得到一定比例的执行机会
+    int first = CRITICAL;
+    uint32_t interval = s_starvation_interval;
+    if(interval > 1) {
+        uint32_t tick = ++self.ticks;
+        uint64_t period = interval;
+        for(int lane = CRITICAL + 1; lane < PRIORITY_COUNT; ++lane) {
+            if(tick % period != 0) {
+                break;
+            }
+            first = lane;
+            period *= interval;
+        }
+    }
+    order[0] = first;
+    for(int lane = 0, i = 1; lane < PRIORITY_COUNT; ++lane) {
+        if(lane != first) {
+            order[i++] = lane;
+        }
+    }
+}
+
+Task* Scheduler::popLane(WorkerQueue& self, int lane) {
+    Task* task = nullptr;
+    {
+        WorkerQueue::MutexType::Lock lock(self.mutex);
+        task = popFrom(self.fibers[lane]);
+    }
+    if(!task && m_globalCount[lane] > 0) {
+        MutexType::Lock lock(m_mutex);
+        task = popFrom(m_fibers[lane]);
+        if(task) {
+            --m_globalCount[lane];
+        }
+    }
+    return task;
+}
+
+Task* Scheduler::popDeadline() {
+    if(m_deadlineCount == 0) {
+        return nullptr;
+    }
+    MutexType::Lock lock(m_mutex);
+    if(m_deadlines.empty()) {
+        return nullptr;
+    }
+    Task* task = m_deadlines.front();
+    //协程还没有从其他线程上切出来，这次先不取
+    if(task->fiber && isSwitching(task->fiber.get())) {
+        return nullptr;
+    }
+    std::pop_heap(m_deadlines.begin(), m_deadlines.end(), DeadlineLater);
+    m_deadlines.pop_back();
+    --m_deadlineCount;
+    ++m_activeThreadCount;
+    --m_taskCount;
+    return task;
+}
+
+Task* Scheduler::pop() {
+    if(m_taskCount == 0) {
+        return nullptr;
+    }
+    WorkerQueue& self = *m_workers[t_worker];
+    Task* task = nullptr;
+    {
+        //指定线程的任务一般是恢复执行的协程，先处理
+        WorkerQueue::MutexType::Lock lock(self.mutex);
+        task = popFrom(self.mailbox);
+        if(task) {
+            --m_pinnedCount;
+            return task;
+        }
+    }
+    int order[PRIORITY_COUNT];
+    laneOrder(self, order);
+    for(int i = 0; i < PRIORITY_COUNT && !task; ++i) {
+        //CRITICAL优先级里先执行截止时间最早的任务
+        if(order[i] == CRITICAL) {
+            task = popDeadline();
+            if(task) {
+                break;
+            }
+        }
+        task = popLane(self, order[i]);
+    }
+    if(!task) {
+        task = steal();
+    }
+    return task;
+}
+
 void Scheduler::tickle() {
-    CAPTAIN_LOG_INFO(g_logger) << "tickle";
+    wakeSleeper();
+}
+
+void Scheduler::tickleWorker(size_t worker) {
+    //没有在休眠，它处理完手上的任务就会来看信箱
+    wakeSleeper(worker);
+}
+
+uint64_t Scheduler::GetDeadline() {
+    return Fiber::GetThis()->m_deadline;
+}
+
+bool Scheduler::IsDeadlineExpired() {
+    uint64_t deadline = GetDeadline();
+    return deadline && deadline < GetCurrentMS();
+}
+
+void Scheduler::beginSlice(Fiber* fiber) {
+    WorkerQueue& self = *m_workers[t_worker];
+    t_slice_start = GetSliceMS();
+    self.fiberId.store(fiber->getId(), std::memory_order_relaxed);
+    self.sliceStart.store(t_slice_start, std::memory_order_release);
+}
+
+void Scheduler::endSlice() {
+    t_slice_start = 0;
+    m_workers[t_worker]->sliceStart.store(0, std::memory_order_release);
+}
+
+void Scheduler::OnStallSignal(int sig) {
+    //只做采集，符号化和写日志交给看门狗线程，信号处理函数里不能加锁也不能分配内存
+    Scheduler* self = t_scheduler;
+    int worker = t_worker;
+    if(!self || worker < 0 || worker >= (int)self->m_workers.size()) {
+        return;
+    }
+    int saved_errno = errno;
+    WorkerQueue& q = *self->m_workers[worker];
+    int n = ::backtrace(q.frames, STALL_FRAMES);
+    q.frameCount.store(n, std::memory_order_release);
+    errno = saved_errno;
+}
+
+void Scheduler::watchdog() {
+    while(!m_watchdogStop) {
+        uint64_t threshold = s_stall_threshold;
+        //检查间隔取阈值的1/4，报告的时间最多比阈值晚25%
+        uint64_t interval = threshold ? std::min(std::max(threshold / 4, (uint64_t)10), (uint64_t)1000) : 1000;
+        timespec ts = {(time_t)(interval / 1000), (long)(interval % 1000 * 1000000)};
+        syscall(SYS_futex, &m_watchdogStop, FUTEX_WAIT_PRIVATE, 0, &ts, nullptr, 0);
+        if(m_watchdogStop || !threshold) {
+            continue;
+        }
+        uint64_t now = GetSliceMS();
+        for(auto& i : m_workers) {
+            checkStall(*i, now, threshold);
+        }
+    }
+}
+
+void Scheduler::checkStall(WorkerQueue& q, uint64_t now, uint64_t threshold) {
+    uint64_t start = q.sliceStart.load(std::memory_order_acquire);
+    //同一次执行只报告一次
+    if(!start || start == q.reported || now < start + threshold) {
+        return;
+    }
+    int tid = q.threadId;
+    if(tid == -1) {
+        return;
+    }
+    q.reported = start;
+    ++m_stallCount;
+    uint64_t fiber_id = q.fiberId.load(std::memory_order_relaxed);
+
+    q.frameCount.store(-1, std::memory_order_relaxed);
+    if(s_stall_signal && syscall(SYS_tgkill, getpid(), tid, STALL_SIGNAL) == 0) {
+        //最多等100ms，线程可能正阻塞在屏蔽了信号的地方
+        for(int i = 0; i < 100 && q.frameCount.load(std::memory_order_acquire) < 0; ++i) {
+            usleep(1000);
+        }
+    }
+    int frames = q.frameCount.load(std::memory_order_acquire);
+
+    std::stringstream ss;
+    ss << "scheduler " << m_name << " fiber id=" << fiber_id
+       << " has been running for " << now - start << "ms on thread " << tid
+       << " without yielding";
+    //采集调用栈时协程已经让出了线程，栈就不是它的了
+    if(frames > 0 && q.sliceStart.load(std::memory_order_acquire) == start) {
+        //跳过信号处理函数和信号返回的栈帧
+        ss << std::endl << BacktraceToString(q.frames, frames, 2, "    ");
+    }
+    CAPTAIN_LOG_WARN(g_logger) << ss.str();
+}
+
+void maybe_yield() {
+    if(!t_slice_start || GetSliceMS() - t_slice_start < s_time_slice) {
+        return;
+    }
+    t_slice_yielded = true;
+    Fiber::YieldToReady();
+}
+
+int Scheduler::GetWorkerIndex() {
+    return t_worker;
+}
+
+bool Scheduler::hasPendingTask() {
+    //指定给其他线程的任务这里拿不到，不算在内
+    if(m_taskCount > m_pinnedCount) {
+        return true;
+    }
+    if(t_worker == -1) {
+        return false;
+    }
+    WorkerQueue& self = *m_workers[t_worker];
+    WorkerQueue::MutexType::Lock lock(self.mutex);
+    return !self.mailbox.empty();
+}
+
+bool Scheduler::wakeSleeper() {
+    //和park()里先登记再检查任务数的顺序对应，这里读到0时休眠的线程一定能看到新任务
+    if(m_sleeperCount == 0) {
+        return false;
+    }
+    int worker = -1;
+    {
+        SleeperMutexType::Lock lock(m_sleeperMutex);
+        if(m_sleepers.empty()) {
+            return false;
+        }
+        //唤醒最后休眠的线程，它的缓存最热
+        worker = m_sleepers.back();
+        m_sleepers.pop_back();
+        --m_sleeperCount;
+        m_workers[worker]->parked = 0;
+    }
+    wakeup(worker);
+    return true;
+}
+
+bool Scheduler::wakeSleeper(size_t worker) {
+    {
+        SleeperMutexType::Lock lock(m_sleeperMutex);
+        auto it = std::find(m_sleepers.begin(), m_sleepers.end(), (int)worker);
+        if(it == m_sleepers.end()) {
+            return false;
+        }
+        m_sleepers.erase(it);
+        --m_sleeperCount;
+        m_workers[worker]->parked = 0;
+    }
+    wakeup(worker);
+    return true;
+}
+
+void Scheduler::park() {
+    WorkerQueue& self = *m_workers[t_worker];
+    {
+        SleeperMutexType::Lock lock(m_sleeperMutex);
+        self.parked = 1;
+        m_sleepers.push_back(t_worker);
+        ++m_sleeperCount;
+    }
+
+    //登记之后再检查一次，避免错过登记之前投递的任务
+    if(!hasPendingTask() && !stopping()) {
+        waitForWakeup(t_worker);
+    }
+
+    //超时返回或者自己发现了任务，要把自己从休眠列表里移出
+    SleeperMutexType::Lock lock(m_sleeperMutex);
+    if(self.parked) {
+        self.parked = 0;
+        auto it = std::find(m_sleepers.begin(), m_sleepers.end(), t_worker);
+        if(it != m_sleepers.end()) {
+            m_sleepers.erase(it);
+            --m_sleeperCount;
+        }
+    }
+}
+
+void Scheduler::startWorker(size_t worker) {
+    size_t offset = m_rootThread == -1 ? 0 : 1;
+    size_t idx = worker - offset;
+    WorkerQueue& q = *m_workers[worker];
+    CAPTAIN_ASSERT(!q.running && idx < m_threads.size());
+    q.running = true;
+    //槽位上之前的线程已经退出了调度循环，但可能还没从run()返回，留给调用者join
+    if(m_threads[idx]) {
+        m_retiredThreads.push_back(m_threads[idx]);
+    }
+    m_threads[idx].reset(new Thread([this, worker]() {
+                            t_worker = worker;
+                            run();
+                        }, m_name + "_" + std::to_string(idx)));
+    m_threadIds[worker] = m_threads[idx]->getId();
+    {
+        WorkerQueue::MutexType::Lock lock(q.mutex);
+        q.threadId = m_threads[idx]->getId();
+    }
+}
+
+void Scheduler::maybeGrow(uint64_t latency) {
+    //有空闲线程说明排队不是因为线程不够
+    if(latency < s_grow_latency || m_idleThreadCount > 0
+            || m_threadCount >= m_maxThreads) {
+        return;
+    }
+    //扩容之后留一段时间观察效果，避免一次延迟高峰就扩到上限
+    uint64_t now = GetCurrentMS();
+    uint64_t last = m_lastGrowMs;
+    if(now - last < s_grow_interval
+            || !m_lastGrowMs.compare_exchange_strong(last, now)) {
+        return;
+    }
+    std::vector<Thread::ptr> retired;
+    {
+        MutexType::Lock lock(m_mutex);
+        //stop()已经把m_threads交换走了
+        if(m_stopping || m_threads.empty() || m_threadCount >= m_maxThreads) {
+            return;
+        }
+        size_t offset = m_rootThread == -1 ? 0 : 1;
+        for(size_t i = offset; i < m_workers.size(); ++i) {
+            if(!m_workers[i]->running) {
+                ++m_threadCount;
+                ++m_growCount;
+                startWorker(i);
+                CAPTAIN_LOG_INFO(g_logger) << "scheduler " << m_name << " grow to "
+                    << m_threadCount << " threads, queue latency=" << latency << "ms";
+                break;
+            }
+        }
+        retired.swap(m_retiredThreads);
+    }
+    //换下来的线程已经退出了调度循环，很快就会结束，在锁外join
+    for(auto& i : retired) {
+        i->join();
+    }
+}
+
+bool Scheduler::shouldRetire() {
+    if(t_worker == -1 || m_threadCount <= m_minThreads
+            || (m_rootThread != -1 && t_worker == 0)) {
+        return false;
+    }
+    //还有协程的栈内容在这个线程的共享栈上，线程退出之后它们就没法恢复了
+    if(Fiber::SharedStackFibers() > 0) {
+        return false;
+    }
+    WorkerQueue& self = *m_workers[t_worker];
+    uint64_t now = GetCurrentMS();
+    if(self.idleSince == 0) {
+        self.idleSince = now;
+        return false;
+    }
+    if(now - self.idleSince < s_shrink_idle) {
+        return false;
+    }
+    //多个线程同时到期时只有减少线程数成功的那些退出，不会低于下限
+    size_t count = m_threadCount;
+    if(count <= m_minThreads
+            || !m_threadCount.compare_exchange_strong(count, count - 1)) {
+        return false;
+    }
+    self.retiring = true;
+    return true;
+}
+
+uint64_t Scheduler::getRetireTimeout() {
+    if(t_worker == -1 || m_threadCount <= m_minThreads
+            || (m_rootThread != -1 && t_worker == 0)) {
+        return ~0ull;
+    }
+    WorkerQueue& self = *m_workers[t_worker];
+    uint64_t now = GetCurrentMS();
+    if(self.idleSince == 0) {
+        self.idleSince = now;
+    }
+    uint64_t elapsed = now - self.idleSince;
+    return elapsed >= s_shrink_idle ? 0 : s_shrink_idle - elapsed;
+}
+
+void Scheduler::retire() {
+    WorkerQueue& self = *m_workers[t_worker];
+    TaskQueue left;
+    {
+        //先让指定给本线程的任务投递失败，再取走剩下的任务
+        WorkerQueue::MutexType::Lock lock(self.mutex);
+        self.threadId = -1;
+        for(Task* task = self.mailbox.front(); task; task = TaskQueue::Next(task)) {
+            task->thread = -1;
+            --m_pinnedCount;
+        }
+        left.splice(self.mailbox);
+        for(auto& i : self.fibers) {
+            left.splice(i);
+        }
+    }
+    bool need_tickle = !left.empty();
+    if(need_tickle) {
+        MutexType::Lock lock(m_mutex);
+        while(Task* task = left.pop_front()) {
+            m_fibers[task->priority].push_back(task);
+            ++m_globalCount[task->priority];
+        }
+    }
+    ++m_shrinkCount;
+    CAPTAIN_LOG_INFO(g_logger) << "scheduler " << m_name << " shrink to "
+        << m_threadCount << " threads";
+    self.retiring = false;
+    self.idleSince = 0;
+    //最后一步，之后这个槽位可以被重新启动
+    self.running = false;
+    if(need_tickle) {
+        tickle();
+    }
+}
+
+void Scheduler::waitForWakeup(int worker) {
+    static const uint64_t MAX_PARK_TIMEOUT = 3000;
+    uint64_t timeout = std::min(MAX_PARK_TIMEOUT, getRetireTimeout());
+    timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000 * 1000;
+    //只有parked仍然为1时才会睡下去，wakeSleeper()先清零再唤醒，不会丢失
+    syscall(SYS_futex, &m_workers[worker]->parked, FUTEX_WAIT_PRIVATE, 1, &ts, nullptr, 0);
+}
+
+void Scheduler::wakeup(int worker) {
+    syscall(SYS_futex, &m_workers[worker]->parked, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
 }
 
 bool Scheduler::stopping() {
-    MutexType::Lock lock(m_mutex);
-    return m_autoStop && m_stopping
-        && m_fibers.empty() && m_activeThreadCount == 0;
+    //先读任务数再读活跃线程数，见popFrom()。
+    //挂起的协程被唤醒时先入队再减计数，所以挂起数要在任务数之前读
+    return m_autoStop && m_stopping && m_suspendedCount == 0
+        && m_taskCount == 0 && m_activeThreadCount == 0;
 }
 
+//没有任务时在futex上休眠，直到tickle()唤醒或者超时，不再空转占满CPU
 void Scheduler::idle() {
     CAPTAIN_LOG_INFO(g_logger) << "idle";
     while(!stopping()) {
+        //要休眠了，顺便归还空闲协程栈的物理内存
+        Fiber::TrimStackCache();
+        park();
+        if(shouldRetire()) {
+            return;
+        }
         captain::Fiber::YieldToHold();
     }
+    //调度器要退出了，叫醒其他还在休眠的线程
+    while(wakeSleeper()) {
+    }
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,149 @@
+#include "include/stack_profile.h"
+#include "include/config.h"
+#include "include/thread.h"
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string.h>
+
+namespace captain {
+
+static ConfigVar<bool>::ptr g_fiber_stack_profile =
+    Config::Lookup<bool>("fiber.stack_profile", false, "paint fiber stacks and record high-water mark");
+
+//涂栈用的字节
+static const uint8_t PAINT_BYTE = 0xA5;
+static const uint64_t PAINT_WORD = 0xA5A5A5A5A5A5A5A5ull;
+
+namespace {
+
+struct ProfileRegistry {
+    typedef Mutex MutexType;
+    MutexType mutex;
+    std::map<std::string, StackProfile*> profiles;
+};
+
+static ProfileRegistry& GetRegistry() {
+    //统计对象一直存活到进程退出，线程退出时还可能在记录
+    static ProfileRegistry* s_registry = new ProfileRegistry;
+    return *s_registry;
+}
+
+}
+
+StackProfile::StackProfile(const std::string& name)
+    :m_name(name) {
+    for(int i = 0; i < BUCKETS; ++i) {
+        m_buckets[i] = 0;
+    }
+}
+
+StackProfile* StackProfile::Get(const std::string& name) {
+    ProfileRegistry& registry = GetRegistry();
+    ProfileRegistry::MutexType::Lock lock(registry.mutex);
+    StackProfile*& profile = registry.profiles[name];
+    if(!profile) {
+        profile = new StackProfile(name);
+    }
+    return profile;
+}
+
+StackProfile* StackProfile::Default() {
+    static StackProfile* s_default = Get("default");
+    return s_default;
+}
+
+bool StackProfile::IsEnabled() {
+    return g_fiber_stack_profile->getValue();
+}
+
+std::string StackProfile::Dump() {
+    std::stringstream ss;
+    ProfileRegistry& registry = GetRegistry();
+    ProfileRegistry::MutexType::Lock lock(registry.mutex);
+    for(auto& i : registry.profiles) {
+        if(i.second->getCount()) {
+            ss << i.second->toString();
+        }
+    }
+    return ss.str();
+}
+
+void StackProfile::Paint(void* stack, size_t size) {
+    memset(stack, PAINT_BYTE, size);
+}
+
+size_t StackProfile::Measure(const void* stack, size_t size) {
+    const uint64_t* p = (const uint64_t*)stack;
+    size_t words = size / sizeof(uint64_t);
+    size_t i = 0;
+    while(i < words && p[i] == PAINT_WORD) {
+        ++i;
+    }
+    return size - i * sizeof(uint64_t);
+}
+
+void StackProfile::record(size_t used) {
+    int bucket = 0;
+    while(bucket < BUCKETS - 1 && used > BucketBound(bucket)) {
+        ++bucket;
+    }
+    ++m_buckets[bucket];
+    ++m_count;
+    size_t max = m_max;
+    while(used > max && !m_max.compare_exchange_weak(max, used)) {
+    }
+}
+
+size_t StackProfile::percentile(double p) const {
+    uint64_t count = m_count;
+    if(count == 0) {
+        return 0;
+    }
+    //向上取整，p=100时一定落在最大值所在的桶
+    uint64_t rank = (uint64_t)(count * p / 100 + 0.999999);
+    rank = std::max(rank, (uint64_t)1);
+    uint64_t seen = 0;
+    for(int i = 0; i < BUCKETS; ++i) {
+        seen += m_buckets[i];
+        if(seen >= rank) {
+            //最后一个桶没有上界，用观察到的最大值
+            return i == BUCKETS - 1 ? (size_t)m_max : std::min(BucketBound(i), (size_t)m_max);
+        }
+    }
+    return m_max;
+}
+
+size_t StackProfile::suggestStackSize(double p, uint64_t min_samples) const {
+    if(m_count < std::max(min_samples, (uint64_t)1)) {
+        return 0;
+    }
+    size_t need = percentile(p) * 2;
+    size_t size = 4096;
+    while(size < need) {
+        size <<= 1;
+    }
+    return size;
+}
+
+std::string StackProfile::toString() const {
+    std::stringstream ss;
+    ss << "stack_profile name=" << m_name
+       << " count=" << getCount()
+       << " max=" << getMax()
+       << " p50=" << percentile(50)
+       << " p90=" << percentile(90)
+       << " p99=" << percentile(99)
+       << std::endl;
+    for(int i = 0; i < BUCKETS; ++i) {
+        uint64_t n = m_buckets[i];
+        if(!n) {
+            continue;
+        }
+        ss << "    " << (i == BUCKETS - 1 ? ">" : "<=")
+           << (BucketBound(i == BUCKETS - 1 ? i - 1 : i) >> 10) << "KB: " << n << std::endl;
+    }
+    return ss.str();
+}
+
+}
@@ -0,0 +1,189 @@
+#include "include/task.h"
+#include "include/thread.h"
+#include "include/log.h"
+#include "include/macro.h"
+
+namespace captain {
+
+//空闲节点复用节点自身的内存串成单链表
+struct FreeNode {
+    FreeNode* next;
+};
+
+//线程本地缓存的节点数上限，超过之后一半还给全局链表
+static const size_t LOCAL_CACHE_MAX = 256;
+
+//全局空闲链表，线程本地缓存空了或满了时成批地和它交换
+struct GlobalTaskPool {
+    Spinlock mutex;
+    FreeNode* head = nullptr;
+    size_t count = 0;
+};
+
+static GlobalTaskPool& GetGlobalPool() {
+    static GlobalTaskPool* s_pool = new GlobalTaskPool;
+    return *s_pool;
+}
+
+struct LocalTaskCache {
+    FreeNode* head = nullptr;
+    size_t count = 0;
+
+    //线程退出时把缓存的节点还给全局链表，留给其他线程使用
+    ~LocalTaskCache() {
+        if(!head) {
+            return;
+        }
+        FreeNode* tail = head;
+        while(tail->next) {
+            tail = tail->next;
+        }
+        GlobalTaskPool& pool = GetGlobalPool();
+        Spinlock::Lock lock(pool.mutex);
+        tail->next = pool.head;
+        pool.head = head;
+        pool.count += count;
+        head = nullptr;
+        count = 0;
+    }
+};
+
+static thread_local LocalTaskCache t_cache;
+
+void* Task::Allocate() {
+    if(!t_cache.head) {
+        //从全局链表一次拿一批
+        GlobalTaskPool& pool = GetGlobalPool();
+        Spinlock::Lock lock(pool.mutex);
+        while(pool.head && t_cache.count < LOCAL_CACHE_MAX / 2) {
+            FreeNode* node = pool.head;
+            pool.head = node->next;
+            --pool.count;
+            node->next = t_cache.head;
+            t_cache.head = node;
+            ++t_cache.count;
+        }
+    }
+    if(t_cache.head) {
+        FreeNode* node = t_cache.head;
+        t_cache.head = node->next;
+        --t_cache.count;
+        return node;
+    }
+    return ::operator new(sizeof(Task));
+}
+
+void Task::Deallocate(void* p) {
+    FreeNode* node = static_cast<FreeNode*>(p);
+    node->next = t_cache.head;
+    t_cache.head = node;
+    ++t_cache.count;
+    if(t_cache.count <= LOCAL_CACHE_MAX) {
+        return;
+    }
+    //生产任务和执行任务的往往不是同一个线程，多出来的一半交给全局链表
+    FreeNode* head = t_cache.head;
+    FreeNode* tail = head;
+    for(size_t i = 1; i < LOCAL_CACHE_MAX / 2; ++i) {
+        tail = tail->next;
+    }
+    t_cache.head = tail->next;
+    t_cache.count -= LOCAL_CACHE_MAX / 2;
+
+    GlobalTaskPool& pool = GetGlobalPool();
+    Spinlock::Lock lock(pool.mutex);
+    tail->next = pool.head;
+    pool.head = head;
+    pool.count += LOCAL_CACHE_MAX / 2;
+}
+
+Task::~Task() {
+    if(m_destroy) {
+        m_destroy(m_callable);
+    }
+}
+
+void Task::Destroy(Task* task) {
+    CAPTAIN_ASSERT(!task->m_prev && !task->m_next);
+    task->~Task();
+    Deallocate(task);
+}
+
+void TaskQueue::push_back(Task* task) {
+    task->m_prev = m_tail;
+    task->m_next = nullptr;
+    if(m_tail) {
+        m_tail->m_next = task;
+    } else {
+        m_head = task;
+    }
+    m_tail = task;
+    ++m_size;
+}
+
+void TaskQueue::push_front(Task* task) {
+    task->m_prev = nullptr;
+    task->m_next = m_head;
+    if(m_head) {
+        m_head->m_prev = task;
+    } else {
+        m_tail = task;
+    }
+    m_head = task;
+    ++m_size;
+}
+
+Task* TaskQueue::pop_front() {
+    Task* task = m_head;
+    if(task) {
+        erase(task);
+    }
+    return task;
+}
+
+Task* TaskQueue::pop_back() {
+    Task* task = m_tail;
+    if(task) {
+        erase(task);
+    }
+    return task;
+}
+
+void TaskQueue::erase(Task* task) {
+    if(task->m_prev) {
+        task->m_prev->m_next = task->m_next;
+    } else {
+        m_head = task->m_next;
+    }
+    if(task->m_next) {
+        task->m_next->m_prev = task->m_prev;
+    } else {
+        m_tail = task->m_prev;
+    }
+    task->m_prev = task->m_next = nullptr;
+    --m_size;
+}
+
+void TaskQueue::splice(TaskQueue& other) {
+    if(other.empty()) {
+        return;
+    }
+    if(m_tail) {
+        m_tail->m_next = other.m_head;
+        other.m_head->m_prev = m_tail;
+    } else {
+        m_head = other.m_head;
+    }
+    m_tail = other.m_tail;
+    m_size += other.m_size;
+    other.m_head = other.m_tail = nullptr;
+    other.m_size = 0;
+}
+
+void TaskQueue::clear() {
+    while(Task* task = pop_front()) {
+        Task::Destroy(task);
+    }
+}
+
+}
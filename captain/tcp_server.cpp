@@ -1,6 +1,7 @@
 #include "include/tcp_server.h"
 #include "include/config.h"
 #include "include/log.h"
+#include "include/profiler.h"
 
 namespace captain {
 
@@ -8,6 +9,21 @@ static captain::ConfigVar<uint64_t>::ptr g_tcp_server_read_timeout =
     captain::Config::Lookup("tcp_server.read_timeout", (uint64_t)(60 * 1000 * 2),
             "tcp server read timeout");
 
+static captain::ConfigVar<bool>::ptr g_tcp_server_shared_stack =
+    captain::Config::Lookup("tcp_server.shared_stack", false,
+            "tcp server handle client in shared stack fiber");
+
+static captain::ConfigVar<bool>::ptr g_tcp_server_stack_auto_size =
+    captain::Config::Lookup("tcp_server.stack_auto_size", false,
+            "tcp server choose client fiber stack size from observed usage");
+
+static captain::ConfigVar<double>::ptr g_tcp_server_stack_auto_percentile =
+    captain::Config::Lookup("tcp_server.stack_auto_percentile", 100.0,
+            "tcp server stack usage percentile used to choose stack size");
+
+//自动选择栈大小之前至少需要的样本数
+static const uint64_t STACK_AUTO_MIN_SAMPLES = 100;
+
 static captain::Logger::ptr g_logger = CAPTAIN_LOG_NAME("system");
 
 TcpServer::TcpServer(captain::IOManager* worker,
@@ -18,7 +34,9 @@ TcpServer::TcpServer(captain::IOManager* worker,
     ,m_acceptWorker(accept_worker)
     ,m_recvTimeout(g_tcp_server_read_timeout->getValue())
     ,m_name("captain/1.0.0")
-    ,m_isStop(true) {
+    ,m_isStop(true)
+    ,m_sharedStack(g_tcp_server_shared_stack->getValue())
+    ,m_stackAutoSize(g_tcp_server_stack_auto_size->getValue()) {
 }
 
 TcpServer::~TcpServer() {
@@ -82,8 +100,35 @@ void TcpServer::startAccept(Socket::ptr sock) {
         Socket::ptr client = sock->accept();
         if(client) {
             client->setRecvTimeout(m_recvTimeout);
-            m_ioWorker->schedule(std::bind(&TcpServer::handleClient,
-                        shared_from_this(), client));
+            //处理请求的协程放在最高优先级，后台任务不会增加请求的延迟
+            if(m_sharedStack) {
+                //共享栈的协程挂起时只保留用到的那部分栈
+                Fiber::ptr fiber(new Fiber(std::bind(&TcpServer::handleClient,
+                            shared_from_this(), client), 0, false, true));
+                fiber->setTag(m_tag);
+                m_ioWorker->schedule(std::move(fiber), -1, Scheduler::CRITICAL);
+            } else if(m_stackProfile) {
+                //样本不够时用默认的栈大小，每个连接都统计；之后按统计结果选择，
+                //没有打开 fiber.stack_profile 时只采样一部分
+                size_t size = m_stackAutoSize ? m_stackProfile->suggestStackSize(
+                        g_tcp_server_stack_auto_percentile->getValue(), STACK_AUTO_MIN_SAMPLES) : 0;
+                Fiber::ptr fiber(new Fiber(std::bind(&TcpServer::handleClient,
+                            shared_from_this(), client), size));
+                if(!size || StackProfile::IsEnabled() || (++m_accepted & 15) == 0) {
+                    fiber->setStackProfile(m_stackProfile);
+                }
+                fiber->setTag(m_tag);
+                m_ioWorker->schedule(std::move(fiber), -1, Scheduler::CRITICAL);
+            } else if(Profiler::IsRunning()) {
+                //采样时连接协程带上入口标签
+                Fiber::ptr fiber = Fiber::Create(std::bind(&TcpServer::handleClient,
+                            shared_from_this(), client));
+                fiber->setTag(m_tag);
+                m_ioWorker->schedule(std::move(fiber), -1, Scheduler::CRITICAL);
+            } else {
+                m_ioWorker->schedule(std::bind(&TcpServer::handleClient,
+                            shared_from_this(), client), -1, Scheduler::CRITICAL);
+            }
         } else {
             CAPTAIN_LOG_ERROR(g_logger) << "accept errno=" << errno
                 << " errstr=" << strerror(errno);
@@ -96,6 +141,11 @@ bool TcpServer::start() {
         return true;
     }
     m_isStop = false;
+    m_tag = Profiler::Tag("tcp_server." + m_name);
+    //打开了栈用量统计或者需要自动选择栈大小时，连接协程单独统计
+    if(!m_sharedStack && (m_stackAutoSize || StackProfile::IsEnabled())) {
+        m_stackProfile = StackProfile::Get("tcp_server." + m_name);
+    }
     for(auto& sock : m_socks) {
         m_acceptWorker->schedule(std::bind(&TcpServer::startAccept,
                     shared_from_this(), sock));
@@ -57,6 +57,20 @@ std::string BacktraceToString(int size, int skip, const std::string& prefix) {
     return ss.str();
 }
 
+std::string BacktraceToString(void* const* frames, int size, int skip, const std::string& prefix) {
+    std::stringstream ss;
+    char** strings = backtrace_symbols(frames, size);
+    if(strings == NULL) {
+        CAPTAIN_LOG_ERROR(g_logger) << "backtrace_synbols error";
+        return ss.str();
+    }
+    for(int i = skip; i < size; ++i) {
+        ss << prefix << strings[i] << std::endl;
+    }
+    free(strings);
+    return ss.str();
+}
+
 //获取当前时间的函数，返回以【毫秒】为单位的时间戳
 uint64_t GetCurrentMS() {
     struct timeval tv;
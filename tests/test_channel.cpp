@@ -0,0 +1,151 @@
+#include "captain/include/captain.h"
+#include "captain/include/iomanager.h"
+#include "captain/include/channel.h"
+#include <atomic>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+//结果不对的用例数，不为0时进程返回1
+static int s_failed = 0;
+
+static void check(bool ok, const char* name) {
+    if(!ok) {
+        ++s_failed;
+        CAPTAIN_LOG_ERROR(g_logger) << name << " failed";
+    }
+}
+
+//只有一个工作线程，容量为2的通道上两个协程来回传递，收发都只挂起协程
+void test_ping_pong() {
+    static captain::Channel<int> s_ping(2);
+    static captain::Channel<int> s_pong(2);
+    static int s_last = 0;
+    int rounds = 10000;
+    uint64_t begin = captain::GetCurrentUS();
+    {
+        captain::IOManager iom(1, false, "pingpong");
+        iom.schedule([rounds](){
+            int v = 0;
+            for(int i = 0; i < rounds; ++i) {
+                s_ping.send(i);
+                s_pong.recv(v);
+            }
+            s_last = v;
+        });
+        iom.schedule([rounds](){
+            int v = 0;
+            for(int i = 0; i < rounds; ++i) {
+                s_ping.recv(v);
+                s_pong.send(v + 1);
+            }
+        });
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_ping_pong last=" << s_last << " expect=" << rounds
+        << " used=" << captain::GetCurrentUS() - begin << "us";
+    check(s_last == rounds, "test_ping_pong");
+}
+
+//多个生产者和消费者，最后一个生产者关闭通道，消费者取完剩下的元素后退出
+void test_mpmc(size_t capacity) {
+    static captain::Channel<int>* s_chan = nullptr;
+    static std::atomic<int> s_producers {0};
+    static std::atomic<long> s_sum {0};
+    static std::atomic<int> s_count {0};
+    captain::Channel<int> chan(capacity);
+    s_chan = &chan;
+    s_sum = 0;
+    s_count = 0;
+    int producers = 4;
+    int consumers = 4;
+    int count = 100000;
+    s_producers = producers;
+
+    uint64_t begin = captain::GetCurrentUS();
+    {
+        captain::IOManager iom(4, false, "mpmc");
+        for(int i = 0; i < consumers; ++i) {
+            iom.schedule([](){
+                int v;
+                while(s_chan->recv(v)) {
+                    s_sum += v;
+                    ++s_count;
+                }
+            });
+        }
+        for(int i = 0; i < producers; ++i) {
+            iom.schedule([count](){
+                for(int j = 1; j <= count; ++j) {
+                    s_chan->send(j);
+                }
+                if(--s_producers == 0) {
+                    s_chan->close();
+                }
+            });
+        }
+    }
+    long expect = (long)producers * count * (count + 1) / 2;
+    CAPTAIN_LOG_INFO(g_logger) << "test_mpmc capacity=" << capacity
+        << " count=" << s_count << " sum=" << s_sum << " expect=" << expect
+        << " used=" << captain::GetCurrentUS() - begin << "us";
+    //丢了或者重复取到元素时和与个数都对不上
+    check(s_sum == expect && s_count == producers * count, "test_mpmc");
+}
+
+//一个协程在两个通道和一个关闭通知上select
+void test_select() {
+    static captain::Channel<int> s_a(4);
+    static captain::Channel<std::string> s_b(4);
+    static captain::Channel<int> s_quit(2);
+    static int s_from_a = 0;
+    static int s_from_b = 0;
+    static std::atomic<int> s_senders {2};
+    {
+        captain::IOManager iom(2, false, "select");
+        iom.schedule([](){
+            int a;
+            std::string b;
+            int q;
+            captain::ChannelSelect sel;
+            sel.recv(s_a, a).recv(s_b, b).recv(s_quit, q);
+            while(true) {
+                int idx = sel.wait();
+                if(idx == 0) {
+                    ++s_from_a;
+                } else if(idx == 1) {
+                    ++s_from_b;
+                } else {
+                    break;
+                }
+            }
+        });
+        iom.schedule([](){
+            for(int i = 0; i < 1000; ++i) {
+                s_a.send(i);
+            }
+            --s_senders;
+        });
+        iom.schedule([](){
+            for(int i = 0; i < 1000; ++i) {
+                s_b.send(std::to_string(i));
+            }
+            --s_senders;
+            //等a也发完并且都被取走再通知退出
+            while(s_senders || s_a.getSize() || s_b.getSize()) {
+                usleep(1000);
+            }
+            s_quit.send(0);
+        });
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_select from_a=" << s_from_a << " from_b=" << s_from_b;
+    check(s_from_a == 1000 && s_from_b == 1000, "test_select");
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    test_ping_pong();
+    test_mpmc(2);
+    test_mpmc(64);
+    test_mpmc(1024);
+    test_select();
+    return s_failed ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+#include "captain/include/captain.h"
+#include "captain/include/iomanager.h"
+#include "captain/include/fiber_local.h"
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+//统计存活的对象数，协程reset和析构之后应该都释放了
+struct Counted {
+    Counted() { ++s_alive;}
+    ~Counted() { --s_alive;}
+    static std::atomic<int> s_alive;
+};
+std::atomic<int> Counted::s_alive {0};
+
+static captain::FiberLocal<std::string> s_request_id;
+static captain::FiberLocal<Counted> s_counted;
+
+static std::atomic<int> s_done {0};
+static std::atomic<int> s_mismatch {0};
+static std::atomic<int> s_migrated {0};
+
+//协程挂起之后可能在别的线程上恢复，协程局部存储的值不变
+void handle_request(int id) {
+    std::string expect = "req-" + std::to_string(id);
+    s_request_id.set(expect);
+    *s_counted;
+    int thread = captain::GetThreadId();
+    for(int i = 0; i < 5; ++i) {
+        usleep((id % 7 + 1) * 1000);
+        if(*s_request_id != expect) {
+            ++s_mismatch;
+        }
+        if(captain::GetThreadId() != thread) {
+            ++s_migrated;
+            thread = captain::GetThreadId();
+        }
+    }
+    ++s_done;
+}
+
+void test_isolation() {
+    {
+        captain::IOManager iom(3, false, "local");
+        for(int i = 0; i < 200; ++i) {
+            iom.schedule([i]() {
+                handle_request(i);
+            });
+        }
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_isolation done=" << s_done
+        << " mismatch=" << s_mismatch
+        << " migrated=" << s_migrated
+        << " alive=" << Counted::s_alive;
+}
+
+static thread_local int t_value = 0;
+
+//协程局部存储的访问开销，和thread_local对比
+void bench_get() {
+    static const int N = 10000000;
+    captain::FiberLocal<int> local;
+    *local = 0;
+    uint64_t begin = captain::GetCurrentUS();
+    for(int i = 0; i < N; ++i) {
+        ++*local.get();
+    }
+    uint64_t local_used = captain::GetCurrentUS() - begin;
+    begin = captain::GetCurrentUS();
+    for(int i = 0; i < N; ++i) {
+        ++t_value;
+        asm volatile("" : : : "memory");
+    }
+    uint64_t tls_used = captain::GetCurrentUS() - begin;
+    CAPTAIN_LOG_INFO(g_logger) << "bench_get fiber_local=" << local_used * 1000 / N << "ns"
+        << " thread_local=" << tls_used * 1000 / N << "ns"
+        << " value=" << *local;
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    test_isolation();
+    bench_get();
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include "captain/include/captain.h"
+#include "captain/include/fiber_sync.h"
+#include <string.h>
+#include <sys/resource.h>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+static const size_t PAGE_SIZE = sysconf(_SC_PAGESIZE);
+
+static size_t rss_kb() {
+    FILE* fp = fopen("/proc/self/statm", "r");
+    size_t size = 0, resident = 0;
+    if(fp) {
+        if(fscanf(fp, "%zu %zu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(fp);
+    }
+    return resident * PAGE_SIZE / 1024;
+}
+
+//主线程不在调度器里，不能挂起，轮询等待
+static void wait_for(captain::WaitGroup& wg) {
+    while(wg.getCount() > 0) {
+        usleep(1000);
+    }
+}
+
+static long minor_faults() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+//协程执行一次再销毁的开销，栈在第一次切入时分配。缓存为0时每个协程都要mmap/mprotect/munmap
+void bench_churn(captain::Scheduler& sc, uint32_t cache_size) {
+    captain::Config::Lookup<uint32_t>("fiber.stack_cache_size")->setValue(cache_size);
+    captain::Config::Lookup<uint32_t>("fiber.free_list_size")->setValue(0);
+    static const int N = 100000;
+    static std::atomic<int> s_done {0};
+    s_done = 0;
+    long faults = minor_faults();
+    uint64_t begin = captain::GetCurrentUS();
+    for(int i = 0; i < N; ++i) {
+        sc.schedule(captain::Fiber::ptr(new captain::Fiber([]() {
+            ++s_done;
+        })));
+        while(i - s_done > 256) {
+            usleep(100);
+        }
+    }
+    while(s_done < N) {
+        usleep(1000);
+    }
+    uint64_t used = captain::GetCurrentUS() - begin;
+    CAPTAIN_LOG_INFO(g_logger) << "bench_churn stack_cache_size=" << cache_size
+        << " " << used * 1000 / N << "ns/fiber"
+        << " faults=" << minor_faults() - faults;
+}
+
+//每个回调函数都让出一次，执行它的协程不能直接留给下一个回调函数用，
+//复用结束了的协程之后不用再创建协程、分配栈
+void bench_recycle(captain::Scheduler& sc, uint32_t free_list_size) {
+    captain::Config::Lookup<uint32_t>("fiber.free_list_size")->setValue(free_list_size);
+    static const int N = 100000;
+    static std::atomic<int> s_done {0};
+    s_done = 0;
+    long faults = minor_faults();
+    uint64_t begin = captain::GetCurrentUS();
+    for(int i = 0; i < N; ++i) {
+        sc.schedule([]() {
+            captain::Fiber::YieldToReady();
+            ++s_done;
+        });
+        //控制并发的请求数，不让所有回调函数都同时挂起
+        while(i - s_done > 256) {
+            usleep(100);
+        }
+    }
+    while(s_done < N) {
+        usleep(1000);
+    }
+    uint64_t used = captain::GetCurrentUS() - begin;
+    CAPTAIN_LOG_INFO(g_logger) << "bench_recycle free_list_size=" << free_list_size
+        << " " << used * 1000 / N << "ns/request"
+        << " faults=" << minor_faults() - faults;
+}
+
+static void touch_stack() {
+    char buf[256 * 1024];
+    memset(buf, 1, sizeof(buf));
+    asm volatile("" : : "r"(buf) : "memory");
+}
+
+//64个协程各用掉256K的栈，结束后栈留在缓存里，空闲超过fiber.stack_idle_ms之后物理内存被归还
+void test_rss(captain::Scheduler& sc) {
+    captain::Config::Lookup<uint32_t>("fiber.stack_cache_size")->setValue(64);
+    captain::Config::Lookup<uint32_t>("fiber.stack_idle_ms")->setValue(100);
+    size_t before = rss_kb();
+    captain::WaitGroup wg;
+    wg.add();
+    sc.schedule([&wg, &sc]() {
+        std::vector<captain::Fiber::ptr> fibers;
+        captain::WaitGroup inner;
+        for(int i = 0; i < 64; ++i) {
+            inner.add();
+            fibers.push_back(captain::Fiber::ptr(new captain::Fiber([&inner]() {
+                touch_stack();
+                inner.done();
+            })));
+            sc.schedule(fibers.back());
+        }
+        inner.wait();
+        //等协程都切出去之后再释放
+        while(true) {
+            bool done = true;
+            for(auto& i : fibers) {
+                done = done && i->getState() == captain::Fiber::TERM;
+            }
+            if(done) {
+                break;
+            }
+            captain::Fiber::YieldToReady();
+        }
+        fibers.clear();
+        CAPTAIN_LOG_INFO(g_logger) << "test_rss cached_stacks=" << captain::Fiber::CachedStacks();
+        wg.done();
+    });
+    wait_for(wg);
+    size_t used = rss_kb();
+
+    //工作线程空闲一段时间，再投递一个任务把它叫醒，下次休眠前归还物理内存
+    usleep(300 * 1000);
+    sc.schedule([](){});
+    usleep(100 * 1000);
+    size_t trimmed = rss_kb();
+    CAPTAIN_LOG_INFO(g_logger) << "test_rss before=" << before << "KB"
+        << " after_run=" << used << "KB"
+        << " after_idle=" << trimmed << "KB";
+}
+
+//limit足够大，实际上会一直递归下去
+static int recurse(int depth, int limit) {
+    char buf[1024];
+    memset(buf, depth, sizeof(buf));
+    asm volatile("" : : "r"(buf) : "memory");
+    if(depth >= limit) {
+        return buf[0];
+    }
+    return recurse(depth + 1, limit) + buf[0];
+}
+
+//栈溢出时写到保护页上，进程直接收到SIGSEGV
+void test_overflow(captain::Scheduler& sc) {
+    sc.schedule([]() {
+        CAPTAIN_LOG_INFO(g_logger) << "test_overflow recurse=" << recurse(0, 1 << 30);
+    });
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    captain::Scheduler sc(1, false, "stack");
+    sc.start();
+    if(argc > 1 && strcmp(argv[1], "overflow") == 0) {
+        test_overflow(sc);
+    } else {
+        bench_churn(sc, 0);
+        bench_churn(sc, 64);
+        bench_recycle(sc, 0);
+        bench_recycle(sc, 64);
+        test_rss(sc);
+    }
+    sc.stop();
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "captain/include/captain.h"
+#include "captain/include/fiber_context.h"
+#include <ucontext.h>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+static const int N = 1000000;
+static const size_t STACK_SIZE = 64 * 1024;
+
+//编译进库里的后端：两个上下文来回切换，一次往返是两次切换
+static captain::FiberContext s_main_ctx;
+static captain::FiberContext s_co_ctx;
+
+static void backend_entry() {
+    while(true) {
+        captain::SwapFiberContext(&s_co_ctx, &s_main_ctx);
+    }
+}
+
+static uint64_t bench_backend() {
+    std::vector<char> stack(STACK_SIZE);
+    captain::MakeFiberContext(&s_co_ctx, &stack[0], stack.size(), &backend_entry);
+    uint64_t begin = captain::GetCurrentUS();
+    for(int i = 0; i < N; ++i) {
+        captain::SwapFiberContext(&s_main_ctx, &s_co_ctx);
+    }
+    return captain::GetCurrentUS() - begin;
+}
+
+//直接用glibc的swapcontext作为对照
+static ucontext_t s_main_uc;
+static ucontext_t s_co_uc;
+
+static void ucontext_entry() {
+    while(true) {
+        swapcontext(&s_co_uc, &s_main_uc);
+    }
+}
+
+static uint64_t bench_ucontext() {
+    std::vector<char> stack(STACK_SIZE);
+    getcontext(&s_co_uc);
+    s_co_uc.uc_link = nullptr;
+    s_co_uc.uc_stack.ss_sp = &stack[0];
+    s_co_uc.uc_stack.ss_size = stack.size();
+    makecontext(&s_co_uc, &ucontext_entry, 0);
+    uint64_t begin = captain::GetCurrentUS();
+    for(int i = 0; i < N; ++i) {
+        swapcontext(&s_main_uc, &s_co_uc);
+    }
+    return captain::GetCurrentUS() - begin;
+}
+
+//经过调度器的一次让出再恢复，包含入队出队的开销
+static uint64_t bench_scheduler() {
+    uint64_t used = 0;
+    captain::Scheduler sc(1, false, "switch");
+    sc.start();
+    sc.schedule([&used]() {
+        uint64_t begin = captain::GetCurrentUS();
+        for(int i = 0; i < N; ++i) {
+            captain::Fiber::YieldToReady();
+        }
+        used = captain::GetCurrentUS() - begin;
+    });
+    sc.stop();
+    return used;
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+
+    uint64_t backend = bench_backend();
+    uint64_t uc = bench_ucontext();
+    uint64_t sched = bench_scheduler();
+    CAPTAIN_LOG_INFO(g_logger) << "round trips=" << N;
+    CAPTAIN_LOG_INFO(g_logger) << captain::FiberContextBackend() << ": "
+        << backend * 1000 / N << "ns/round trip";
+    CAPTAIN_LOG_INFO(g_logger) << "swapcontext: " << uc * 1000 / N << "ns/round trip";
+    CAPTAIN_LOG_INFO(g_logger) << "scheduler yield(" << captain::FiberContextBackend() << "): "
+        << sched * 1000 / N << "ns/round trip";
+    return 0;
+}
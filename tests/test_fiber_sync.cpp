@@ -0,0 +1,174 @@
+#include "captain/include/captain.h"
+#include "captain/include/iomanager.h"
+#include <atomic>
+#include <deque>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+//只有一个工作线程，持有锁的协程sleep时让出线程，另一个协程等锁时只挂起自己。
+//换成 captain::Mutex 的话第二个协程会把唯一的线程阻塞住，第一个协程永远醒不过来
+void test_mutex_single_thread() {
+    static captain::FiberMutex s_mutex;
+    static std::vector<int> s_order;
+    s_order.clear();
+    {
+        captain::IOManager iom(1, false, "mutex1");
+        iom.schedule([](){
+            captain::FiberMutex::Lock lock(s_mutex);
+            s_order.push_back(1);
+            usleep(50 * 1000);
+            s_order.push_back(2);
+        });
+        iom.schedule([](){
+            captain::FiberMutex::Lock lock(s_mutex);
+            s_order.push_back(3);
+        });
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_mutex_single_thread order=" << s_order[0]
+        << s_order[1] << s_order[2];
+    CAPTAIN_ASSERT(s_order.size() == 3 && s_order[0] == 1 && s_order[1] == 2 && s_order[2] == 3);
+}
+
+//多个线程上的协程竞争同一把锁
+void test_mutex_counter() {
+    static captain::FiberMutex s_mutex;
+    static int s_count = 0;
+    s_count = 0;
+    int fibers = 100;
+    int loops = 1000;
+    {
+        captain::IOManager iom(4, false, "mutex4");
+        for(int i = 0; i < fibers; ++i) {
+            iom.schedule([loops](){
+                for(int j = 0; j < loops; ++j) {
+                    captain::FiberMutex::Lock lock(s_mutex);
+                    ++s_count;
+                    if(j % 100 == 0) {
+                        //持有锁时让出线程，制造竞争
+                        captain::Fiber::YieldToReady();
+                    }
+                }
+            });
+        }
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_mutex_counter count=" << s_count
+        << " expect=" << fibers * loops;
+    CAPTAIN_ASSERT(s_count == fibers * loops);
+}
+
+//信号量限制同时执行的协程数
+void test_semaphore() {
+    static captain::FiberSemaphore s_sem(2);
+    static std::atomic<int> s_running {0};
+    static std::atomic<int> s_max {0};
+    {
+        captain::IOManager iom(4, false, "sem");
+        for(int i = 0; i < 10; ++i) {
+            iom.schedule([](){
+                s_sem.wait();
+                int n = ++s_running;
+                int m = s_max;
+                while(n > m && !s_max.compare_exchange_weak(m, n)) {
+                }
+                usleep(10 * 1000);
+                --s_running;
+                s_sem.notify();
+            });
+        }
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_semaphore max_concurrency=" << s_max;
+    CAPTAIN_ASSERT(s_max <= 2);
+}
+
+//条件变量实现的生产者消费者队列
+void test_condition() {
+    static captain::FiberMutex s_mutex;
+    static captain::FiberCondition s_cond;
+    static std::deque<int> s_queue;
+    static int s_sum = 0;
+    static int s_done = 0;
+    int consumers = 3;
+    int count = 1000;
+    {
+        captain::IOManager iom(2, false, "cond");
+        for(int i = 0; i < consumers; ++i) {
+            iom.schedule([](){
+                captain::FiberMutex::Lock lock(s_mutex);
+                while(true) {
+                    while(s_queue.empty() && !s_done) {
+                        s_cond.wait(lock);
+                    }
+                    if(s_queue.empty()) {
+                        break;
+                    }
+                    s_sum += s_queue.front();
+                    s_queue.pop_front();
+                }
+            });
+        }
+        iom.schedule([count](){
+            for(int i = 1; i <= count; ++i) {
+                captain::FiberMutex::Lock lock(s_mutex);
+                s_queue.push_back(i);
+                s_cond.notify();
+            }
+            captain::FiberMutex::Lock lock(s_mutex);
+            s_done = 1;
+            s_cond.notifyAll();
+        });
+    }
+    int expect = count * (count + 1) / 2;
+    CAPTAIN_LOG_INFO(g_logger) << "test_condition sum=" << s_sum
+        << " expect=" << expect;
+    CAPTAIN_ASSERT(s_sum == expect);
+}
+
+//读锁可以同时持有，写锁独占
+void test_rwmutex() {
+    static captain::FiberRWMutex s_mutex;
+    static std::atomic<int> s_readers {0};
+    static std::atomic<int> s_max_readers {0};
+    static std::atomic<int> s_writers {0};
+    static std::atomic<int> s_conflicts {0};
+    {
+        captain::IOManager iom(4, false, "rwmutex");
+        for(int i = 0; i < 20; ++i) {
+            if(i % 5 == 0) {
+                iom.schedule([](){
+                    captain::FiberRWMutex::WriteLock lock(s_mutex);
+                    if(++s_writers != 1 || s_readers != 0) {
+                        ++s_conflicts;
+                    }
+                    usleep(5 * 1000);
+                    --s_writers;
+                });
+            } else {
+                iom.schedule([](){
+                    captain::FiberRWMutex::ReadLock lock(s_mutex);
+                    int n = ++s_readers;
+                    if(s_writers != 0) {
+                        ++s_conflicts;
+                    }
+                    int m = s_max_readers;
+                    while(n > m && !s_max_readers.compare_exchange_weak(m, n)) {
+                    }
+                    usleep(5 * 1000);
+                    --s_readers;
+                });
+            }
+        }
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_rwmutex max_readers=" << s_max_readers
+        << " conflicts=" << s_conflicts;
+    CAPTAIN_ASSERT(s_conflicts == 0);
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    test_mutex_single_thread();
+    test_mutex_counter();
+    test_semaphore();
+    test_condition();
+    test_rwmutex();
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "captain/include/captain.h"
+#include "captain/include/iomanager.h"
+#include "captain/include/future.h"
+#include <stdexcept>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+//模拟一次后端调用，sleep被hook之后只挂起协程
+static int query_backend(int id, int ms) {
+    usleep(ms * 1000);
+    return id * 10;
+}
+
+//并行调用5个后端，总耗时应该接近最慢的一个而不是它们的和
+void test_when_all() {
+    captain::IOManager* iom = captain::IOManager::GetThis();
+    int delays[] = {30, 10, 50, 20, 40};
+    uint64_t begin = captain::GetCurrentMS();
+    std::vector<captain::Future<int> > futures;
+    for(int i = 0; i < 5; ++i) {
+        int ms = delays[i];
+        futures.push_back(captain::async_call(iom, [i, ms](){
+            return query_backend(i, ms);
+        }));
+    }
+    captain::when_all(futures).wait();
+    int sum = 0;
+    for(auto& i : futures) {
+        sum += i.get();
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_when_all sum=" << sum
+        << " used=" << captain::GetCurrentMS() - begin << "ms";
+}
+
+//返回最先完成的下标，异常通过get()重新抛出
+void test_when_any() {
+    captain::IOManager* iom = captain::IOManager::GetThis();
+    auto slow = captain::async_call(iom, [](){ return query_backend(1, 50);});
+    auto fast = captain::async_call(iom, [](){ return std::string("fast");});
+    auto fail = captain::async_call(iom, []() -> int {
+        usleep(20 * 1000);
+        throw std::runtime_error("backend down");
+    });
+    size_t first = captain::when_any(slow, fast).get();
+    CAPTAIN_LOG_INFO(g_logger) << "test_when_any first=" << first << " value=" << fast.get();
+
+    try {
+        fail.get();
+    } catch(std::exception& e) {
+        CAPTAIN_LOG_INFO(g_logger) << "test_when_any exception=" << e.what();
+    }
+    slow.wait();
+}
+
+//WaitGroup等待一组没有返回值的协程
+void test_wait_group() {
+    captain::IOManager* iom = captain::IOManager::GetThis();
+    static std::atomic<int> s_done {0};
+    captain::WaitGroup wg;
+    uint64_t begin = captain::GetCurrentMS();
+    for(int i = 0; i < 10; ++i) {
+        wg.add();
+        iom->schedule([&wg, i](){
+            usleep((10 + i) * 1000);
+            ++s_done;
+            wg.done();
+        });
+    }
+    wg.wait();
+    CAPTAIN_LOG_INFO(g_logger) << "test_wait_group done=" << s_done
+        << " used=" << captain::GetCurrentMS() - begin << "ms";
+}
+
+//在一个线程上的Promise由另一个线程上的协程完成
+void test_promise() {
+    captain::Promise<void> promise;
+    captain::Future<void> future = promise.getFuture();
+    captain::Thread thread([promise]() mutable {
+        usleep(10 * 1000);
+        promise.setValue();
+    }, "setter");
+    future.get();
+    thread.join();
+    CAPTAIN_LOG_INFO(g_logger) << "test_promise ready=" << future.isReady();
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    captain::IOManager iom(2, false, "future");
+    iom.schedule([](){
+        test_when_all();
+        test_when_any();
+        test_wait_group();
+        test_promise();
+    });
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "captain/include/captain.h"
+#include "captain/include/iomanager.h"
+#include "captain/include/fiber_sync.h"
+#include "captain/include/fd_manager.h"
+#include <sys/socket.h>
+#include <atomic>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+static std::atomic<uint64_t> s_rounds {0};
+
+//很多很短的协程，最后一个done()唤醒等待者，同时IOManager正在stop()。
+//单核上线程随时被抢占，任务入队、休眠和轮询线程之间的交接有遗漏的话会卡住
+void one_round(int fibers) {
+    captain::IOManager iom(2, false, "stress");
+    iom.schedule([&iom, fibers]() {
+        captain::WaitGroup wg;
+        for(int i = 0; i < fibers; ++i) {
+            wg.add(1);
+            if(i % 3 == 0) {
+                //一部分经过定时器唤醒
+                iom.schedule([&wg]() {
+                    usleep(100);
+                    wg.done();
+                });
+            } else {
+                iom.schedule([&wg]() {
+                    wg.done();
+                });
+            }
+        }
+        wg.wait();
+        ++s_rounds;
+    });
+    //一个协程阻塞在read上，另一个线程上的协程同时关闭句柄。
+    //关闭赶在注册之前完成的话，读协程要自己发现，否则IOManager一直有待处理事件停不下来
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    captain::FdMgr::GetInstance()->get(sv[0], true);
+    int fd = sv[0];
+    iom.schedule([fd]() {
+        char c;
+        read(fd, &c, 1);
+    });
+    iom.schedule([fd]() {
+        close(fd);
+    });
+    //外部线程提交的任务走全局队列
+    captain::WaitGroup* outside = new captain::WaitGroup(fibers);
+    iom.schedule([outside]() {
+        outside->wait();
+        delete outside;
+    });
+    for(int i = 0; i < fibers; ++i) {
+        iom.schedule([outside]() {
+            outside->done();
+        });
+    }
+    iom.stop();
+    close(sv[1]);
+}
+
+int main(int argc, char** argv) {
+    //taskset -c 0 ./test_idle_stress [rounds]
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    int rounds = argc > 1 ? atoi(argv[1]) : 500;
+    uint64_t begin = captain::GetCurrentMS();
+    //一轮正常只要几毫秒，超过1秒说明有唤醒丢了，靠epoll超时才恢复
+    int slow = 0;
+    for(int i = 0; i < rounds; ++i) {
+        uint64_t round_begin = captain::GetCurrentMS();
+        one_round(50 + i % 200);
+        if(captain::GetCurrentMS() - round_begin >= 1000) {
+            ++slow;
+        }
+        if((i + 1) % 100 == 0) {
+            CAPTAIN_LOG_INFO(g_logger) << "rounds=" << s_rounds << " slow=" << slow;
+        }
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_idle_stress rounds=" << s_rounds << " slow=" << slow
+        << " used=" << captain::GetCurrentMS() - begin << "ms";
+    return s_rounds == (uint64_t)rounds && slow == 0 ? 0 : 1;
+}
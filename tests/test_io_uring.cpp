@@ -0,0 +1,209 @@
+#include "captain/include/captain.h"
+#include "captain/include/iomanager.h"
+#include "captain/include/socket.h"
+#include "captain/include/fd_manager.h"
+#include "captain/http/http_server.h"
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <string.h>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+static uint64_t GetCpuUS() {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ul
+        + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+//超时、关闭和大块写在两种后端下的行为要一致
+void test_semantics(captain::IOManager* iom) {
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    captain::FdMgr::GetInstance()->get(sv[0], true);
+    captain::FdMgr::GetInstance()->get(sv[1], true);
+
+    //收不到数据时按SO_RCVTIMEO返回ETIMEDOUT
+    timeval tv = {0, 50 * 1000};
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char buf[64];
+    uint64_t begin = captain::GetCurrentMS();
+    ssize_t n = recv(sv[0], buf, sizeof(buf), 0);
+    CAPTAIN_LOG_INFO(g_logger) << "recv timeout rt=" << n << " errno=" << strerror(errno)
+        << " used=" << captain::GetCurrentMS() - begin << "ms";
+
+    //对端写入之后挂起的读被唤醒，结果直接带回来
+    iom->schedule([sv]() {
+        usleep(10 * 1000);
+        send(sv[1], "ping", 4, 0);
+    });
+    n = recv(sv[0], buf, sizeof(buf), 0);
+    CAPTAIN_LOG_INFO(g_logger) << "recv wakeup rt=" << n << " data=" << std::string(buf, n > 0 ? n : 0);
+
+    //写满发送缓冲区之后挂起，对端读走之后继续
+    std::string big(4 * 1024 * 1024, 'x');
+    captain::WaitGroup wg;
+    wg.add(1);
+    iom->schedule([sv, &wg, &big]() {
+        size_t total = 0;
+        std::vector<char> rbuf(65536);
+        while(total < big.size()) {
+            ssize_t r = recv(sv[1], &rbuf[0], rbuf.size(), 0);
+            if(r <= 0) {
+                break;
+            }
+            total += r;
+        }
+        CAPTAIN_LOG_INFO(g_logger) << "big recv total=" << total;
+        wg.done();
+    });
+    size_t sent = 0;
+    while(sent < big.size()) {
+        n = send(sv[0], big.c_str() + sent, big.size() - sent, 0);
+        if(n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+    wg.wait();
+    CAPTAIN_LOG_INFO(g_logger) << "big send total=" << sent;
+
+    //关闭句柄唤醒挂起的读
+    tv.tv_sec = 1;
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    iom->schedule([sv]() {
+        usleep(10 * 1000);
+        close(sv[0]);
+    });
+    n = recv(sv[0], buf, sizeof(buf), 0);
+    CAPTAIN_LOG_INFO(g_logger) << "recv after close rt=" << n << " errno=" << strerror(errno);
+    close(sv[1]);
+}
+
+//HttpServer还不解析请求里的Connection头，每个请求一个短连接，读到对端关闭为止
+static const char* REQUEST = "GET /bench HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static bool do_requests(captain::Address::ptr addr, int count) {
+    char buf[4096];
+    for(int i = 0; i < count; ++i) {
+        captain::Socket::ptr sock = captain::Socket::CreateTCP(addr);
+        if(!sock->connect(addr)) {
+            return false;
+        }
+        if(sock->send(REQUEST, strlen(REQUEST)) <= 0) {
+            return false;
+        }
+        int got = 0;
+        int n = 0;
+        while((n = sock->recv(buf, sizeof(buf))) > 0) {
+            got += n;
+        }
+        sock->close();
+        if(n < 0 || !got) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//每次recv都要挂起等对端，比较阻塞IO路径上的开销
+void bench_pingpong(captain::IOManager* iom, int pairs, int rounds) {
+    captain::WaitGroup wg;
+    uint64_t cpu = GetCpuUS();
+    uint64_t begin = captain::GetCurrentUS();
+    for(int i = 0; i < pairs; ++i) {
+        int sv[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        captain::FdMgr::GetInstance()->get(sv[0], true);
+        captain::FdMgr::GetInstance()->get(sv[1], true);
+        wg.add(2);
+        iom->schedule([sv, rounds, &wg]() {
+            char c = 0;
+            for(int n = 0; n < rounds; ++n) {
+                send(sv[0], &c, 1, 0);
+                recv(sv[0], &c, 1, 0);
+            }
+            close(sv[0]);
+            wg.done();
+        });
+        iom->schedule([sv, rounds, &wg]() {
+            char c = 0;
+            for(int n = 0; n < rounds; ++n) {
+                recv(sv[1], &c, 1, 0);
+                send(sv[1], &c, 1, 0);
+            }
+            close(sv[1]);
+            wg.done();
+        });
+    }
+    wg.wait();
+    uint64_t used = captain::GetCurrentUS() - begin;
+    cpu = GetCpuUS() - cpu;
+    uint64_t total = (uint64_t)pairs * rounds;
+    CAPTAIN_LOG_INFO(g_logger) << "bench_pingpong io_uring=" << iom->useIoUring()
+        << " pairs=" << pairs << " round_trips=" << total
+        << " rtt/s=" << total * 1000000 / (used ? used : 1)
+        << " cpu_per_rtt=" << cpu * 1000 / total << "ns";
+}
+
+void bench_http(const std::string& backend, int port, int conns, int requests) {
+    captain::Config::Lookup<std::string>("iomanager.backend")->setValue(backend);
+    //析构时等所有任务结束
+    captain::IOManager iom(2, false, backend);
+    iom.schedule([&]() {
+        test_semantics(&iom);
+        bench_pingpong(&iom, conns, requests * 5);
+
+        captain::http::HttpServer::ptr server(new captain::http::HttpServer(true));
+        auto addr = captain::Address::LookupAnyIPAddress("127.0.0.1:" + std::to_string(port));
+        while(!server->bind(addr)) {
+            sleep(1);
+        }
+        server->getServletDispatch()->addServlet("/bench", [](captain::http::HttpRequest::ptr req
+                    ,captain::http::HttpResponse::ptr rsp
+                    ,captain::http::HttpSession::ptr session) {
+                rsp->setBody("hello captain");
+                return 0;
+        });
+        server->start();
+
+        std::atomic<int> fails {0};
+        captain::WaitGroup clients;
+        uint64_t cpu = GetCpuUS();
+        uint64_t begin = captain::GetCurrentUS();
+        for(int i = 0; i < conns; ++i) {
+            clients.add(1);
+            iom.schedule([&]() {
+                if(!do_requests(addr, requests)) {
+                    ++fails;
+                }
+                clients.done();
+            });
+        }
+        clients.wait();
+        uint64_t used = captain::GetCurrentUS() - begin;
+        cpu = GetCpuUS() - cpu;
+        uint64_t total = (uint64_t)conns * requests;
+        CAPTAIN_LOG_INFO(g_logger) << "bench_http backend=" << backend
+            << " io_uring=" << iom.useIoUring()
+            << " conns=" << conns << " requests=" << total
+            << " fails=" << fails
+            << " qps=" << total * 1000000 / (used ? used : 1)
+            << " cpu_per_req=" << cpu * 1000 / total << "ns";
+        server->stop();
+    });
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    int conns = argc > 1 ? atoi(argv[1]) : 50;
+    int requests = argc > 2 ? atoi(argv[2]) : 200;
+    std::string backend = argc > 3 ? argv[3] : "";
+    if(backend != "io_uring") {
+        bench_http("epoll", 8035, conns, requests);
+    }
+    if(backend != "epoll") {
+        bench_http("io_uring", 8036, conns, requests);
+    }
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include "captain/include/captain.h"
 #include "captain/include/iomanager.h"
+#include "captain/include/fd_manager.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -7,6 +8,8 @@
 #include <fcntl.h>
 #include <iostream>
 #include <sys/epoll.h>
+#include <atomic>
+#include <sys/resource.h>
 
 captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
 
@@ -69,8 +72,259 @@ void test_timer() {
     }, true);
 }
 
+//一批一批地提交小任务，批次之间留出空闲让线程休眠，观察唤醒次数和无效唤醒次数
+void test_idle_wakeup() {
+    static std::atomic<int> s_done {0};
+    s_done = 0;
+    captain::IOManager iom(4, false, "wakeup");
+    int batches = 100;
+    int per_batch = 16;
+    uint64_t begin = captain::GetCurrentUS();
+    for(int i = 0; i < batches; ++i) {
+        for(int j = 0; j < per_batch; ++j) {
+            iom.schedule([](){
+                ++s_done;
+            });
+        }
+        usleep(1000);
+    }
+    while(s_done < batches * per_batch) {
+        usleep(100);
+    }
+    uint64_t used = captain::GetCurrentUS() - begin;
+    auto stats = iom.getIdleStats();
+    CAPTAIN_LOG_INFO(g_logger) << "test_idle_wakeup tasks=" << s_done
+        << " used=" << used << "us"
+        << " spin_hits=" << stats.spinHits
+        << " parks=" << stats.parks
+        << " polls=" << stats.polls
+        << " wakeups=" << stats.wakeups
+        << " spurious=" << stats.spuriousWakeups;
+}
+
+//每对socketpair来回传一个字节，统计协程被唤醒之后换了线程的次数。
+//分片模式下句柄和协程都固定在注册它的线程上，换线程的次数应该接近0
+void test_sharded(bool sharded) {
+    static std::atomic<uint64_t> s_migrations {0};
+    s_migrations = 0;
+    captain::Config::Lookup<bool>("iomanager.sharded")->setValue(sharded);
+    int pairs = 32;
+    int rounds = 2000;
+    uint64_t begin = captain::GetCurrentUS();
+    {
+        captain::IOManager iom(4, false, sharded ? "sharded" : "shared");
+        for(int i = 0; i < pairs; ++i) {
+            int sv[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+            //socketpair没有被hook，登记之后读写才会走IOManager
+            captain::FdMgr::GetInstance()->get(sv[0], true);
+            captain::FdMgr::GetInstance()->get(sv[1], true);
+            for(int j = 0; j < 2; ++j) {
+                int fd = sv[j];
+                bool first = j == 0;
+                iom.schedule([fd, first, rounds]() {
+                    char c = 0;
+                    int thread = captain::GetThreadId();
+                    for(int n = 0; n < rounds; ++n) {
+                        if(first) {
+                            send(fd, &c, 1, 0);
+                        }
+                        recv(fd, &c, 1, 0);
+                        if(!first) {
+                            send(fd, &c, 1, 0);
+                        }
+                        if(thread != captain::GetThreadId()) {
+                            thread = captain::GetThreadId();
+                            ++s_migrations;
+                        }
+                    }
+                    close(fd);
+                });
+            }
+        }
+    }
+    uint64_t used = captain::GetCurrentUS() - begin;
+    uint64_t total = (uint64_t)pairs * rounds;
+    CAPTAIN_LOG_INFO(g_logger) << "test_sharded sharded=" << sharded
+        << " round_trips=" << total
+        << " rtt/s=" << total * 1000000 / (used ? used : 1)
+        << " migrations=" << s_migrations;
+    captain::Config::Lookup<bool>("iomanager.sharded")->setValue(false);
+}
+
+//句柄号很大时也能注册；多个线程各自在自己的句柄上反复注册和取消，统计吞吐
+void test_fd_table() {
+    static std::atomic<uint64_t> s_fired {0};
+    s_fired = 0;
+    captain::IOManager iom(4, false, "fd_table");
+    //用当前进程能打开的最大句柄号，落在比较靠后的段里
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    int high = dup2(sv[0], limit.rlim_cur - 1);
+    if(high >= 0) {
+        iom.schedule([&iom, high]() {
+            iom.addEvent(high, captain::IOManager::READ, [](){
+                ++s_fired;
+            });
+        });
+        usleep(10 * 1000);
+        write(sv[1], "x", 1);
+        while(s_fired == 0) {
+            usleep(1000);
+        }
+        close(high);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    CAPTAIN_LOG_INFO(g_logger) << "test_fd_table high_fd=" << high << " fired=" << s_fired;
+
+    int loops = 100000;
+    int fibers = 4;
+    std::atomic<int> done {0};
+    uint64_t begin = captain::GetCurrentUS();
+    for(int i = 0; i < fibers; ++i) {
+        iom.schedule([&iom, &done, loops]() {
+            int fds[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+            for(int n = 0; n < loops; ++n) {
+                iom.addEvent(fds[0], captain::IOManager::READ, [](){});
+                iom.cancelEvent(fds[0], captain::IOManager::READ);
+            }
+            iom.cancelAll(fds[0]);
+            ::close(fds[0]);
+            ::close(fds[1]);
+            ++done;
+        });
+    }
+    while(done < fibers) {
+        usleep(1000);
+    }
+    uint64_t used = captain::GetCurrentUS() - begin;
+    CAPTAIN_LOG_INFO(g_logger) << "test_fd_table add+cancel=" << (uint64_t)loops * fibers
+        << " ops/s=" << (uint64_t)loops * fibers * 1000000 / (used ? used : 1);
+}
+
+//等回调执行到target次，最多等timeout_ms毫秒
+static bool wait_fired(std::atomic<int>& fired, int target, int timeout_ms) {
+    for(int i = 0; i < timeout_ms && fired < target; ++i) {
+        usleep(1000);
+    }
+    return fired >= target;
+}
+
+//句柄在另一个IOManager上被hook的close()关掉，没有经过这个IOManager的cancelAll()，
+//句柄号复用之后还要能等到事件；没有协程等待时到来的边沿缓存下来，之后注册时直接唤醒
+void test_fd_reuse() {
+    static std::atomic<int> s_fired {0};
+    s_fired = 0;
+    captain::IOManager iom(1, false, "fd_reuse");
+    captain::IOManager other(1, false, "fd_reuse_close");
+    auto wait_read = [&iom](int fd) {
+        iom.schedule([&iom, fd]() {
+            iom.addEvent(fd, captain::IOManager::READ, [](){
+                ++s_fired;
+            });
+        });
+    };
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    captain::FdMgr::GetInstance()->get(sv[0], true);
+    int fd = sv[0];
+    wait_read(fd);
+    usleep(10 * 1000);
+    write(sv[1], "x", 1);
+    bool first = wait_fired(s_fired, 1, 1000);
+    //内核里的注册随句柄一起删掉了，iom里还记着已经注册
+    std::atomic<bool> closed {false};
+    other.schedule([fd, &closed]() {
+        close(fd);
+        closed = true;
+    });
+    while(!closed) {
+        usleep(1000);
+    }
+    close(sv[1]);
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    captain::FdMgr::GetInstance()->get(sv[0], true);
+    wait_read(sv[0]);
+    usleep(10 * 1000);
+    write(sv[1], "x", 1);
+    bool reused = wait_fired(s_fired, 2, 1000);
+
+    //没人等READ的时候又来了数据，边沿被缓存
+    write(sv[1], "x", 1);
+    usleep(10 * 1000);
+    wait_read(sv[0]);
+    bool cached = wait_fired(s_fired, 3, 1000);
+    CAPTAIN_LOG_INFO(g_logger) << "test_fd_reuse fd=" << fd << " reused_fd=" << sv[0]
+        << " first=" << first << " reused=" << reused << " cached=" << cached;
+    CAPTAIN_ASSERT(first && reused && cached);
+    captain::FdMgr::GetInstance()->del(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+//很多连接同时可读，批大小从很小开始，取满之后应该逐步变大
+void test_event_batch() {
+    auto max_events = captain::Config::Lookup<uint32_t>("iomanager.max_events");
+    uint32_t old_value = max_events->getValue();
+    max_events->setValue(4);
+    int conns = 500;
+    std::vector<int> peers;
+    {
+        captain::IOManager iom(2, false, "batch");
+        for(int round = 0; round < 3; ++round) {
+            std::atomic<int> done {0};
+            peers.clear();
+            for(int i = 0; i < conns; ++i) {
+                int sv[2];
+                socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+                captain::FdMgr::GetInstance()->get(sv[0], true);
+                peers.push_back(sv[1]);
+                int fd = sv[0];
+                iom.schedule([fd, &done]() {
+                    char c;
+                    recv(fd, &c, 1, 0);
+                    close(fd);
+                    ++done;
+                });
+            }
+            //等所有协程都挂起在recv上，再一起唤醒
+            usleep(100 * 1000);
+            for(int fd : peers) {
+                write(fd, "x", 1);
+            }
+            while(done < conns) {
+                usleep(1000);
+            }
+            for(int fd : peers) {
+                close(fd);
+            }
+        }
+        auto stats = iom.getEventStats();
+        std::stringstream ss;
+        for(size_t i = 0; i < stats.histogram.size(); ++i) {
+            if(stats.histogram[i]) {
+                ss << " [" << (i ? 1 << (i - 1) : 0) << "]=" << stats.histogram[i];
+            }
+        }
+        CAPTAIN_LOG_INFO(g_logger) << "test_event_batch full_batches=" << stats.fullBatches
+            << " histogram:" << ss.str();
+    }
+    max_events->setValue(old_value);
+}
+
 int main(int argc, char** argv) {
     //test1();
+    test_event_batch();
+    test_fd_reuse();
+    test_fd_table();
+    test_idle_wakeup();
+    test_sharded(false);
+    test_sharded(true);
     test_timer();
     return 0;
 }
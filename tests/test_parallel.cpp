@@ -0,0 +1,102 @@
+#include "captain/include/captain.h"
+#include "captain/include/parallel.h"
+#include <cmath>
+#include <random>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+//每个元素的计算量，足够让切分和调度的开销可以忽略
+static double heavy(size_t i) {
+    double v = i;
+    for(int j = 0; j < 200; ++j) {
+        v = std::sqrt(v + j);
+    }
+    return v;
+}
+
+static const size_t N = 1 << 20;
+
+//结果和串行版本不一致时直接失败
+static void check(bool ok, const char* name) {
+    CAPTAIN_ASSERT2(ok, name << " result mismatch");
+}
+
+//串行版本作为基准，再用不同的线程数跑并行版本
+void bench(size_t threads, const std::vector<double>& expect_for, double expect_sum
+        , const std::vector<int>& input, const std::vector<int>& sorted) {
+    //调用线程也参与计算，调度器里少开一个线程
+    captain::Scheduler sc(threads, false, "parallel");
+    sc.start();
+
+    std::vector<double> out(N);
+    uint64_t begin = captain::GetCurrentUS();
+    captain::parallel_for(&sc, 0, N, [&out](size_t i) {
+        out[i] = heavy(i);
+    });
+    uint64_t for_used = captain::GetCurrentUS() - begin;
+    check(out == expect_for, "parallel_for");
+
+    begin = captain::GetCurrentUS();
+    double sum = captain::parallel_reduce(&sc, 0, N, 0.0, [](size_t b, size_t e, double init) {
+        for(size_t i = b; i < e; ++i) {
+            init += heavy(i);
+        }
+        return init;
+    }, [](double a, double b) {
+        return a + b;
+    });
+    uint64_t reduce_used = captain::GetCurrentUS() - begin;
+    //浮点数的合并顺序不同，只要求近似相等
+    check(std::fabs(sum - expect_sum) < 1e-6 * expect_sum, "parallel_reduce");
+
+    std::vector<int> data = input;
+    begin = captain::GetCurrentUS();
+    captain::parallel_sort(&sc, data.begin(), data.end());
+    uint64_t sort_used = captain::GetCurrentUS() - begin;
+    check(data == sorted, "parallel_sort");
+
+    CAPTAIN_LOG_INFO(g_logger) << "threads=" << threads + 1
+        << " parallel_for=" << for_used / 1000 << "ms"
+        << " parallel_reduce=" << reduce_used / 1000 << "ms"
+        << " parallel_sort=" << sort_used / 1000 << "ms";
+    sc.stop();
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+
+    std::vector<double> expect_for(N);
+    uint64_t begin = captain::GetCurrentUS();
+    for(size_t i = 0; i < N; ++i) {
+        expect_for[i] = heavy(i);
+    }
+    uint64_t for_used = captain::GetCurrentUS() - begin;
+
+    begin = captain::GetCurrentUS();
+    double expect_sum = 0;
+    for(size_t i = 0; i < N; ++i) {
+        expect_sum += heavy(i);
+    }
+    uint64_t reduce_used = captain::GetCurrentUS() - begin;
+
+    std::vector<int> input(N * 4);
+    std::mt19937 rng(12345);
+    for(auto& i : input) {
+        i = rng();
+    }
+    std::vector<int> sorted = input;
+    begin = captain::GetCurrentUS();
+    std::sort(sorted.begin(), sorted.end());
+    uint64_t sort_used = captain::GetCurrentUS() - begin;
+
+    CAPTAIN_LOG_INFO(g_logger) << "serial"
+        << " for=" << for_used / 1000 << "ms"
+        << " reduce=" << reduce_used / 1000 << "ms"
+        << " sort=" << sort_used / 1000 << "ms";
+
+    size_t threads[] = {1, 3, 7};
+    for(auto i : threads) {
+        bench(i, expect_for, expect_sum, input, sorted);
+    }
+    return 0;
+}
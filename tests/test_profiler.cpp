@@ -0,0 +1,88 @@
+#include "captain/include/captain.h"
+#include "captain/include/iomanager.h"
+#include <string.h>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+static volatile uint64_t s_sink = 0;
+
+//两种入口各自消耗CPU，火焰图里应该分成两棵树
+void burn_parse(uint64_t ms) {
+    uint64_t end = captain::GetCurrentMS() + ms;
+    while(captain::GetCurrentMS() < end) {
+        for(int i = 0; i < 10000; ++i) {
+            s_sink = s_sink * 31 + i;
+        }
+    }
+}
+
+void burn_render(uint64_t ms) {
+    uint64_t end = captain::GetCurrentMS() + ms;
+    while(captain::GetCurrentMS() < end) {
+        for(int i = 0; i < 10000; ++i) {
+            s_sink = s_sink ^ (s_sink << 7) ^ i;
+        }
+    }
+}
+
+//每个请求分几段执行，中间让出，协程会在不同线程上恢复
+void run_requests(captain::IOManager& iom, int count) {
+    const char* parse = captain::Profiler::Tag("request.parse");
+    const char* render = captain::Profiler::Tag("request.render");
+    for(int i = 0; i < count; ++i) {
+        captain::Fiber::ptr a = captain::Fiber::Create([]() {
+            for(int n = 0; n < 4; ++n) {
+                burn_parse(5);
+                captain::Fiber::YieldToReady();
+            }
+        });
+        a->setTag(parse);
+        iom.schedule(a);
+        captain::Fiber::ptr b = captain::Fiber::Create([]() {
+            for(int n = 0; n < 4; ++n) {
+                burn_render(10);
+                captain::Fiber::YieldToReady();
+            }
+        });
+        b->setTag(render);
+        iom.schedule(b);
+    }
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    auto enable = captain::Config::Lookup<bool>("profiler.enable");
+    {
+        captain::IOManager iom(2, false, "profiler");
+        //运行中通过配置打开，不需要重启
+        run_requests(iom, 10);
+        usleep(200 * 1000);
+        enable->setValue(true);
+        run_requests(iom, 20);
+        sleep(1);
+        enable->setValue(false);
+        uint64_t samples = captain::Profiler::GetSamples();
+        //关闭之后不再采样
+        run_requests(iom, 10);
+        sleep(1);
+        CAPTAIN_LOG_INFO(g_logger) << "samples=" << samples
+            << " after_stop=" << captain::Profiler::GetSamples() - samples
+            << " dropped=" << captain::Profiler::GetDropped();
+    }
+
+    std::string folded = captain::Profiler::Dump();
+    uint64_t parse = 0, render = 0;
+    std::stringstream ss(folded);
+    std::string line;
+    while(std::getline(ss, line)) {
+        uint64_t n = strtoull(line.c_str() + line.rfind(' ') + 1, nullptr, 10);
+        if(line.compare(0, 13, "request.parse") == 0) {
+            parse += n;
+        } else if(line.compare(0, 14, "request.render") == 0) {
+            render += n;
+        }
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "request.parse=" << parse << " request.render=" << render;
+    std::cout << folded;
+    return 0;
+}
@@ -1,4 +1,7 @@
 #include "captain/include/captain.h"
+#include <atomic>
+#include <sys/resource.h>
+#include <dirent.h>
 
 static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
 
@@ -13,15 +16,286 @@ void test_fiber() {
     }
 }
 
-int main(int argc, char** argv) {
-    CAPTAIN_LOG_INFO(g_logger) << "main";
+void test_scheduler() {
     captain::Scheduler sc(3, false, "test");
     sc.start();
     sleep(2);
     CAPTAIN_LOG_INFO(g_logger) << "schedule";
     sc.schedule(&test_fiber);
     sc.stop();
+}
+
+static std::atomic<int> s_done {0};
+static std::atomic<bool> s_block {false};
+static std::atomic<int> s_blocked_thread {0};
+
+//占住一个工作线程，让指定给它的任务堆积起来
+void bench_blocker() {
+    s_blocked_thread = captain::GetThreadId();
+    while(s_block) {
+    }
+}
+
+void bench_noop() {
+    ++s_done;
+}
+
+//被占住的线程上堆积了pinned个指定线程的任务时，其他线程执行count个普通任务的耗时
+//以前每次取任务都要在加锁的情况下扫描整个队列，耗时随pinned线性增长，现在应该基本不变
+uint64_t bench_pinned(int pinned, int count) {
+    s_done = 0;
+    s_block = true;
+    s_blocked_thread = 0;
+
+    captain::Scheduler sc(3, false, "bench");
+    sc.start();
+    sc.schedule(&bench_blocker);
+    while(s_blocked_thread == 0) {
+    }
+    for(int i = 0; i < pinned; ++i) {
+        sc.schedule(&bench_noop, s_blocked_thread);
+    }
+
+    uint64_t begin = captain::GetCurrentUS();
+    for(int i = 0; i < count; ++i) {
+        sc.schedule(&bench_noop);
+    }
+    while(s_done < count) {
+    }
+    uint64_t used = captain::GetCurrentUS() - begin;
+
+    s_block = false;
+    sc.stop();
+    return used;
+}
+
+//工作线程被占住时堆积不同优先级的任务，放开之后看执行顺序：
+//CRITICAL应该先执行完，期间BACKGROUND大约每64个任务执行一个
+void test_priority() {
+    static std::vector<int> s_order;
+    s_order.clear();
+    s_block = true;
+    s_blocked_thread = 0;
+
+    captain::Scheduler sc(1, false, "priority");
+    sc.start();
+    sc.schedule(&bench_blocker);
+    while(s_blocked_thread == 0) {
+    }
+    int count = 200;
+    for(int i = 0; i < count; ++i) {
+        sc.schedule([](){
+            s_order.push_back(captain::Scheduler::BACKGROUND);
+        }, -1, captain::Scheduler::BACKGROUND);
+    }
+    for(int i = 0; i < count; ++i) {
+        sc.schedule([](){
+            s_order.push_back(captain::Scheduler::CRITICAL);
+        }, -1, captain::Scheduler::CRITICAL);
+    }
+    s_block = false;
+    sc.stop();
+
+    int background_before = 0;
+    int critical = 0;
+    for(auto i : s_order) {
+        if(i == captain::Scheduler::CRITICAL) {
+            if(++critical == count) {
+                break;
+            }
+        } else {
+            ++background_before;
+        }
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_priority background tasks run before the last critical task: "
+        << background_before << "/" << count;
+}
+
+//截止时间乱序提交，应该按截止时间从早到晚执行，已经过期的任务被丢弃
+void test_deadline() {
+    static std::vector<int> s_order;
+    s_order.clear();
+    s_block = true;
+    s_blocked_thread = 0;
+    captain::Config::Lookup<bool>("scheduler.drop_expired")->setValue(true);
+
+    captain::Scheduler sc(1, false, "deadline");
+    sc.start();
+    sc.schedule(&bench_blocker);
+    while(s_blocked_thread == 0) {
+    }
+    uint64_t now = captain::GetCurrentMS();
+    int offsets[] = {500, 100, 400, -50, 200, 300, -10};
+    for(auto i : offsets) {
+        sc.scheduleWithDeadline([i](){
+            s_order.push_back(i);
+        }, now + i);
+    }
+    s_block = false;
+    sc.stop();
+    captain::Config::Lookup<bool>("scheduler.drop_expired")->setValue(false);
+
+    std::stringstream ss;
+    for(auto i : s_order) {
+        ss << i << " ";
+    }
+    CAPTAIN_LOG_INFO(g_logger) << "test_deadline order: " << ss.str()
+        << "expired=" << sc.getExpiredCount() << " dropped=" << sc.getDroppedCount();
+}
+
+//复用的协程不能带着上一个任务的截止时间，否则还没执行就被当成过期任务丢弃
+void test_recycled_deadline() {
+    static std::atomic<bool> s_ran {false};
+    static captain::Fiber* s_first = nullptr;
+    s_ran = false;
+    captain::Config::Lookup<bool>("scheduler.drop_expired")->setValue(true);
+
+    captain::Scheduler sc(1, false, "recycle");
+    sc.start();
+    //空闲协程表是每个线程的，协程要在工作线程上创建
+    sc.schedule([&sc]() {
+        captain::Fiber::ptr fiber = captain::Fiber::Create([](){});
+        s_first = fiber.get();
+        sc.scheduleWithDeadline(std::move(fiber), captain::GetCurrentMS() + 10);
+    });
+    usleep(50 * 1000);
+    bool reused = false;
+    sc.schedule([&sc, &reused]() {
+        captain::Fiber::ptr fiber = captain::Fiber::Create([](){
+            s_ran = true;
+        });
+        reused = fiber.get() == s_first;
+        sc.schedule(std::move(fiber));
+    });
+    sc.stop();
+    captain::Config::Lookup<bool>("scheduler.drop_expired")->setValue(false);
+    CAPTAIN_LOG_INFO(g_logger) << "test_recycled_deadline reused=" << reused
+        << " ran=" << s_ran << " dropped=" << sc.getDroppedCount();
+    CAPTAIN_ASSERT(s_ran && sc.getDroppedCount() == 0);
+}
+
+static size_t CountThreads() {
+    DIR* dir = opendir("/proc/self/task");
+    size_t n = 0;
+    while(dirent* e = readdir(dir)) {
+        if(e->d_name[0] != '.') {
+            ++n;
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+//任务排队时线程数从1增加到上限，空闲之后再减少到下限；
+//第二轮扩容重新启动之前退出的槽位，stop()之后所有线程都被join
+void test_elastic() {
+    captain::Config::Lookup<uint32_t>("scheduler.grow_latency_ms")->setValue(5);
+    captain::Config::Lookup<uint32_t>("scheduler.grow_interval_ms")->setValue(10);
+    captain::Config::Lookup<uint32_t>("scheduler.shrink_idle_ms")->setValue(200);
+
+    static std::atomic<int> s_count {0};
+    s_count = 0;
+    size_t threads_before = CountThreads();
+    captain::Scheduler sc(1, false, "elastic", 4);
+    sc.start();
+    int count = 40;
+    size_t max_threads = 0;
+    for(int round = 1; round <= 2; ++round) {
+        for(int i = 0; i < count; ++i) {
+            sc.schedule([](){
+                usleep(10 * 1000);
+                ++s_count;
+            });
+        }
+        while(s_count < count * round) {
+            max_threads = std::max(max_threads, sc.getThreadCount());
+            usleep(1000);
+        }
+        usleep(500 * 1000);
+        CAPTAIN_LOG_INFO(g_logger) << "test_elastic round=" << round << " max_threads=" << max_threads
+            << " threads_after_idle=" << sc.getThreadCount()
+            << " grow=" << sc.getGrowCount() << " shrink=" << sc.getShrinkCount();
+    }
+    sc.stop();
+    size_t threads_after = CountThreads();
+    CAPTAIN_LOG_INFO(g_logger) << "test_elastic threads before=" << threads_before
+        << " after stop=" << threads_after;
+    CAPTAIN_ASSERT(threads_after == threads_before);
+
+    captain::Config::Lookup<uint32_t>("scheduler.grow_latency_ms")->setValue(20);
+    captain::Config::Lookup<uint32_t>("scheduler.grow_interval_ms")->setValue(100);
+    captain::Config::Lookup<uint32_t>("scheduler.shrink_idle_ms")->setValue(30000);
+}
+
+//一个任务占住线程超过阈值时看门狗打印协程id和调用栈；
+//两个CPU密集的任务在同一个线程上调用maybe_yield()，应该交替执行而不是一个做完再做另一个
+void test_watchdog() {
+    captain::Config::Lookup<uint32_t>("scheduler.stall_threshold_ms")->setValue(100);
+    captain::Scheduler sc(1, false, "watchdog");
+    sc.start();
+    sc.schedule([](){
+        uint64_t begin = captain::GetCurrentMS();
+        while(captain::GetCurrentMS() - begin < 300) {
+        }
+    });
+
+    static std::vector<int> s_order;
+    s_order.clear();
+    for(int id = 0; id < 2; ++id) {
+        sc.schedule([id](){
+            uint64_t begin = captain::GetCurrentMS();
+            while(captain::GetCurrentMS() - begin < 100) {
+                if(s_order.empty() || s_order.back() != id) {
+                    s_order.push_back(id);
+                }
+                captain::maybe_yield();
+            }
+        });
+    }
+    sc.stop();
+    captain::Config::Lookup<uint32_t>("scheduler.stall_threshold_ms")->setValue(0);
+    CAPTAIN_LOG_INFO(g_logger) << "test_watchdog stalls=" << sc.getStallCount()
+        << " switches=" << s_order.size();
+}
+
+static uint64_t GetCpuUS() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec * 1000000ul + usage.ru_utime.tv_usec
+        + usage.ru_stime.tv_sec * 1000000ul + usage.ru_stime.tv_usec;
+}
+
+//没有任务时工作线程应该休眠，空闲1秒消耗的CPU时间应该接近0
+void test_idle_cpu() {
+    captain::Scheduler sc(3, false, "idle");
+    sc.start();
+    usleep(100 * 1000);
+    uint64_t cpu = GetCpuUS();
+    uint64_t begin = captain::GetCurrentUS();
+    sleep(1);
+    CAPTAIN_LOG_INFO(g_logger) << "test_idle_cpu threads=3 cpu=" << GetCpuUS() - cpu
+        << "us wall=" << captain::GetCurrentUS() - begin << "us";
+    sc.stop();
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_INFO(g_logger) << "main";
+    test_scheduler();
+    test_watchdog();
+
+    //调度器日志太多，压测时关掉
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    test_idle_cpu();
+    test_priority();
+    test_deadline();
+    test_recycled_deadline();
+    test_elastic();
+    int pinned[] = {0, 1000, 10000, 50000};
+    for(auto n : pinned) {
+        uint64_t used = bench_pinned(n, 100000);
+        CAPTAIN_LOG_INFO(g_logger) << "bench_pinned pinned=" << n
+            << " count=100000 used=" << used << "us";
+    }
     CAPTAIN_LOG_INFO(g_logger) << "over";
     return 0;
-
 }
@@ -0,0 +1,111 @@
+#include "captain/include/captain.h"
+#include "captain/include/iomanager.h"
+#include "captain/include/fd_manager.h"
+#include <sys/socket.h>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+static const size_t PAGE_SIZE = sysconf(_SC_PAGESIZE);
+static const int N = 5000;
+
+static std::atomic<int> s_started {0};
+static std::atomic<int> s_done {0};
+
+//虚拟内存和常驻内存，单位KB
+static void mem_kb(size_t& vsz, size_t& rss) {
+    vsz = rss = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if(fp) {
+        if(fscanf(fp, "%zu %zu", &vsz, &rss) != 2) {
+            vsz = rss = 0;
+        }
+        fclose(fp);
+    }
+    vsz = vsz * PAGE_SIZE / 1024;
+    rss = rss * PAGE_SIZE / 1024;
+}
+
+//模拟一个空闲连接：协程阻塞在read上，hook之后挂起在IOManager里等READ事件
+static void idle_connection(int fd) {
+    ++s_started;
+    char buf[16];
+    int rt = read(fd, buf, sizeof(buf));
+    if(rt != 1) {
+        CAPTAIN_LOG_ERROR(g_logger) << "read fd=" << fd << " rt=" << rt << " errno=" << errno;
+    }
+    ++s_done;
+}
+
+//N个连接都挂起之后统计每个连接占用的内存
+void bench(captain::IOManager& iom, bool shared_stack) {
+    s_started = 0;
+    s_done = 0;
+    std::vector<int> fds;
+    for(int i = 0; i < N; ++i) {
+        int sv[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+            CAPTAIN_LOG_ERROR(g_logger) << "socketpair errno=" << errno;
+            break;
+        }
+        captain::FdMgr::GetInstance()->get(sv[0], true);
+        fds.push_back(sv[0]);
+        fds.push_back(sv[1]);
+    }
+    int count = fds.size() / 2;
+
+    size_t vsz0, rss0;
+    mem_kb(vsz0, rss0);
+    std::vector<captain::Fiber::ptr> fibers;
+    for(int i = 0; i < count; ++i) {
+        int fd = fds[i * 2];
+        fibers.push_back(captain::Fiber::ptr(new captain::Fiber([fd]() {
+            idle_connection(fd);
+        }, 0, false, shared_stack)));
+        iom.schedule(fibers.back());
+    }
+    while(s_started < count) {
+        usleep(10 * 1000);
+    }
+    usleep(100 * 1000);
+    size_t vsz1, rss1;
+    mem_kb(vsz1, rss1);
+
+    size_t saved = 0;
+    for(auto& i : fibers) {
+        saved += i->getSavedStackCapacity();
+    }
+    CAPTAIN_LOG_INFO(g_logger) << (fibers[0]->isSharedStack() ? "shared" : "private")
+        << " connections=" << count
+        << " rss/conn=" << (rss1 - rss0) * 1024 / count << "B"
+        << " vsz/conn=" << (vsz1 - vsz0) * 1024 / count << "B"
+        << " saved_stack/conn=" << saved / count << "B";
+
+    //每个连接发一个字节，协程读到之后结束
+    for(int i = 0; i < count; ++i) {
+        if(write(fds[i * 2 + 1], "x", 1) != 1) {
+            CAPTAIN_LOG_ERROR(g_logger) << "write errno=" << errno;
+        }
+    }
+    while(s_done < count) {
+        usleep(10 * 1000);
+    }
+    //等协程都切出去之后再释放
+    for(auto& i : fibers) {
+        while(i->getState() != captain::Fiber::TERM) {
+            usleep(1000);
+        }
+    }
+    fibers.clear();
+    for(auto fd : fds) {
+        captain::FdMgr::GetInstance()->del(fd);
+        close(fd);
+    }
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    captain::IOManager iom(1, false, "conn");
+    bench(iom, false);
+    bench(iom, true);
+    return 0;
+}
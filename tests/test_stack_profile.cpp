@@ -0,0 +1,101 @@
+#include "captain/include/captain.h"
+#include "captain/include/tcp_server.h"
+#include "captain/include/iomanager.h"
+#include "captain/include/fiber_sync.h"
+#include <string.h>
+
+static captain::Logger::ptr g_logger = CAPTAIN_LOG_ROOT();
+
+//每层大约用掉1KB的栈
+static int recurse(int depth) {
+    char buf[1024];
+    memset(buf, depth, sizeof(buf));
+    asm volatile("" : : "r"(buf) : "memory");
+    if(depth <= 1) {
+        return buf[0];
+    }
+    return recurse(depth - 1) + buf[0];
+}
+
+//不同入口的协程用量不同，分别统计
+void test_entries() {
+    captain::IOManager* iom = captain::IOManager::GetThis();
+    captain::StackProfile* shallow = captain::StackProfile::Get("test.shallow");
+    captain::StackProfile* deep = captain::StackProfile::Get("test.deep");
+    captain::WaitGroup wg;
+    for(int i = 0; i < 200; ++i) {
+        int depth = 2 + i % 4;
+        wg.add(2);
+        captain::Fiber::ptr a(new captain::Fiber([&wg, depth]() {
+            recurse(depth);
+            wg.done();
+        }));
+        a->setStackProfile(shallow);
+        iom->schedule(a);
+        captain::Fiber::ptr b(new captain::Fiber([&wg, depth]() {
+            recurse(depth * 10);
+            wg.done();
+        }));
+        b->setStackProfile(deep);
+        iom->schedule(b);
+    }
+    wg.wait();
+    CAPTAIN_LOG_INFO(g_logger) << "test_entries shallow suggest=" << shallow->suggestStackSize(100, 100)
+        << " deep suggest=" << deep->suggestStackSize(100, 100);
+}
+
+//连接处理函数按收到的字节决定用多少栈，然后回一个字节
+class DepthServer : public captain::TcpServer {
+public:
+    void handleClient(captain::Socket::ptr client) override {
+        char c = 0;
+        if(client->recv(&c, 1) == 1) {
+            recurse(c);
+            client->send(&c, 1);
+        }
+        client->close();
+    }
+};
+
+//样本够了之后新连接的协程按统计结果选择栈大小
+void test_tcp_server() {
+    auto addr = captain::Address::LookupAny("127.0.0.1:8034");
+    DepthServer::ptr server(new DepthServer);
+    server->setName("depth");
+    server->setStackAutoSize(true);
+    while(!server->bind(addr)) {
+        sleep(1);
+    }
+    server->start();
+
+    for(int i = 0; i < 300; ++i) {
+        captain::Socket::ptr sock = captain::Socket::CreateTCP(addr);
+        if(!sock->connect(addr)) {
+            CAPTAIN_LOG_ERROR(g_logger) << "connect fail errno=" << errno;
+            break;
+        }
+        char c = 8 + i % 17;
+        sock->send(&c, 1);
+        sock->recv(&c, 1);
+        sock->close();
+    }
+    captain::StackProfile* profile = server->getStackProfile();
+    CAPTAIN_LOG_INFO(g_logger) << "test_tcp_server samples=" << profile->getCount()
+        << " auto_stack_size=" << profile->suggestStackSize(100, 100)
+        << " default=" << captain::Config::Lookup<uint32_t>("fiber.stack_size")->getValue();
+    server->stop();
+}
+
+int main(int argc, char** argv) {
+    CAPTAIN_LOG_NAME("system")->setLevel(captain::LogLevel::ERROR);
+    captain::Config::Lookup<bool>("fiber.stack_profile")->setValue(true);
+    {
+        captain::IOManager iom(2, false, "profile");
+        iom.schedule([]() {
+            test_entries();
+            test_tcp_server();
+        });
+    }
+    std::cout << captain::StackProfile::Dump();
+    return 0;
+}